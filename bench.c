@@ -0,0 +1,380 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_FILES     2000      //files of the create and delete storms
+#define BENCH_FILE_MB   64        //size of the file the data workloads run on
+#define BENCH_FANOUT    8         //subdirectories per directory of the mkdir tree
+#define BENCH_DEPTH     3
+#define BENCH_RAND_OPS  4096      //most requests of a random read or write run
+#define BENCH_MOUNTS    5         //mounts timed for every inode count
+
+//one measured workload. every call is timed on its own, so the
+//percentiles come from the latencies of single calls, and the rates from
+//the time spent in the calls. setup between the calls is not counted
+struct bench {
+	char name[64];
+	int ops;
+	int max_ops;
+	int64_t bytes;
+	double *latency;          //seconds of every call
+	double busy;              //seconds of all calls
+	double op_start;
+	int reads, writes;        //disk counts when the run started
+};
+
+static const int io_sizes[] = { 4096, 65536, 1048576 };
+#define NSIZES ((int)(sizeof(io_sizes)/sizeof(io_sizes[0])))
+
+static const char *workloads[] = { "storm", "mkdir", "data", "mount" };
+#define NWORKLOADS ((int)(sizeof(workloads)/sizeof(workloads[0])))
+
+static FILE *csv;             //machine readable results, one line per run
+static char *buffer;
+
+static double now();
+static void bench_begin( struct bench *b, const char *name, int max_ops );
+static void op_begin( struct bench *b );
+static void op_end( struct bench *b, int64_t bytes );
+static void bench_end( struct bench *b );
+static void run_storm( int nfiles );
+static void run_mkdir( int fanout, int depth );
+static void run_data( int64_t file_size );
+static void run_mount( int nfiles );
+
+int main( int argc, char *argv[] )
+{
+	const char *diskfile = "fs_bench.img";
+	const char *csvfile  = NULL;
+	int nblocks  = 65536;
+	int cache    = -1;
+	int flags    = 0;
+	int nfiles   = BENCH_FILES;
+	int file_mb  = BENCH_FILE_MB;
+	int opt;
+
+	while((opt = getopt(argc, argv, "d:b:c:m:n:s:o:")) != -1) {
+		switch(opt) {
+		case 'd': diskfile = optarg; break;
+		case 'b': nblocks  = atoi(optarg); break;
+		case 'c': cache    = atoi(optarg); break;
+		case 'n': nfiles   = atoi(optarg); break;
+		case 's': file_mb  = atoi(optarg); break;
+		case 'o': csvfile  = optarg; break;
+		case 'm':
+			if(!strcmp(optarg,"direct")) {
+				flags = DISK_DIRECT;
+			} else if(!strcmp(optarg,"mmap")) {
+				flags = DISK_MMAP;
+			} else {
+				printf("unknown disk mode: %s\n",optarg);
+				return 1;
+			}
+			break;
+		default:
+			printf("use: %s [-d diskfile] [-b nblocks] [-c cache blocks] [-m direct|mmap]\n",argv[0]);
+			printf("       [-n files] [-s file MB] [-o results.csv] [storm|mkdir|data|mount ...]\n");
+			return 1;
+		}
+	}
+
+	if(!disk_open(diskfile,nblocks,flags)) {
+		printf("couldn't initialize %s: %s\n",diskfile,strerror(errno));
+		return 1;
+	}
+	if(cache>=0 && !disk_cache_init(cache)) {
+		printf("couldn't allocate a cache of %d blocks\n",cache);
+		return 1;
+	}
+	if(csvfile) {
+		csv = fopen(csvfile,"w");
+		if(!csv) {
+			printf("couldn't open %s: %s\n",csvfile,strerror(errno));
+			return 1;
+		}
+		fprintf(csv,"workload,ops,seconds,ops_per_s,mb_per_s,p50_us,p99_us,disk_reads,disk_writes\n");
+	}
+	if(posix_memalign((void**)&buffer, DISK_BLOCK_SIZE, io_sizes[NSIZES-1])!=0) {
+		return 1;
+	}
+	for(int i=0; i<io_sizes[NSIZES-1]; i++) {
+		buffer[i] = (char)(i*7+(i>>12));
+	}
+
+	printf("%-20s %8s %10s %9s %10s %10s %9s %9s\n","workload","ops","ops/s","MB/s","p50 us","p99 us","reads","writes");
+
+	//all workloads run unless some are named
+	int nnames = optind<argc ? argc-optind : NWORKLOADS;
+	const char **names = optind<argc ? (const char**)argv+optind : workloads;
+	for(int i=0; i<nnames; i++) {
+		const char *name = names[i];
+		//every workload starts on a freshly formatted disk
+		if(!fs_format() || !fs_mount()) {
+			printf("couldn't format %s\n",diskfile);
+			return 1;
+		}
+		if(!strcmp(name,"storm")) {
+			run_storm(nfiles);
+		} else if(!strcmp(name,"mkdir")) {
+			run_mkdir(BENCH_FANOUT,BENCH_DEPTH);
+		} else if(!strcmp(name,"data")) {
+			run_data((int64_t)file_mb<<20);
+		} else if(!strcmp(name,"mount")) {
+			run_mount(nfiles);
+		} else {
+			printf("unknown workload: %s\n",name);
+		}
+	}
+
+	fs_unmount();
+	if(csv) {
+		fclose(csv);
+	}
+	free(buffer);
+	disk_close();
+	return 0;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+static void bench_begin( struct bench *b, const char *name, int max_ops )
+{
+	memset(b, 0, sizeof(*b));
+	snprintf(b->name, sizeof(b->name), "%s", name);
+	b->max_ops = max_ops;
+	b->latency = malloc(max_ops*sizeof(double));
+	if(!b->latency) {
+		printf("out of memory for %d latencies\n",max_ops);
+		exit(1);
+	}
+	disk_counts(&b->reads, &b->writes);
+}
+
+static void op_begin( struct bench *b )
+{
+	b->op_start = now();
+}
+
+static void op_end( struct bench *b, int64_t bytes )
+{
+	double t = now()-b->op_start;
+	if(b->ops < b->max_ops) {
+		b->latency[b->ops++] = t;
+	}
+	b->busy  += t;
+	b->bytes += bytes;
+}
+
+static int compare_double( const void *a, const void *b )
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x<y ? -1 : x>y ? 1 : 0;
+}
+
+//unmounts so the journal is committed and the counts include the writes
+//the run left behind, prints the results and mounts again for the next run
+static void bench_end( struct bench *b )
+{
+	double seconds = b->busy;
+	int reads, writes;
+	fs_unmount();
+	disk_counts(&reads, &writes);
+	fs_mount();
+	reads  -= b->reads;
+	writes -= b->writes;
+
+	qsort(b->latency, b->ops, sizeof(double), compare_double);
+	double p50 = b->ops ? b->latency[(b->ops-1)/2]*1e6 : 0;
+	double p99 = b->ops ? b->latency[(int)((b->ops-1)*0.99)]*1e6 : 0;
+	double ops_s = seconds>0 ? b->ops/seconds : 0;
+	double mb_s  = seconds>0 ? b->bytes/seconds/(1<<20) : 0;
+
+	printf("%-20s %8d %10.0f %9.1f %10.1f %10.1f %9d %9d\n",b->name,b->ops,ops_s,mb_s,p50,p99,reads,writes);
+	fflush(stdout);
+	if(csv) {
+		fprintf(csv,"%s,%d,%.6f,%.1f,%.2f,%.1f,%.1f,%d,%d\n",b->name,b->ops,seconds,ops_s,mb_s,p50,p99,reads,writes);
+		fflush(csv);
+	}
+	free(b->latency);
+}
+
+//creates nfiles empty files in one directory, then deletes them all
+static void run_storm( int nfiles )
+{
+	struct bench b;
+	char path[64];
+
+	fs_create_dir("/storm");
+	bench_begin(&b, "create", nfiles);
+	for(int i=0; i<nfiles; i++) {
+		sprintf(path, "/storm/f%d", i);
+		op_begin(&b);
+		if(fs_create_file(path)<0) {
+			printf("create %s failed\n",path);
+			break;
+		}
+		op_end(&b, 0);
+	}
+	bench_end(&b);
+
+	bench_begin(&b, "delete", nfiles);
+	for(int i=0; i<nfiles; i++) {
+		sprintf(path, "/storm/f%d", i);
+		op_begin(&b);
+		if(!fs_delete_file(path)) {
+			printf("delete %s failed\n",path);
+			break;
+		}
+		op_end(&b, 0);
+	}
+	bench_end(&b);
+}
+
+//helper fn
+static void mkdir_tree( struct bench *b, char *path, int fanout, int depth )
+{
+	if(depth==0) {
+		return;
+	}
+	int len = strlen(path);
+	for(int i=0; i<fanout; i++) {
+		sprintf(path+len, "/d%d", i);
+		op_begin(b);
+		if(fs_create_dir(path)==-1) {
+			printf("mkdir %s failed\n",path);
+			path[len] = 0;
+			return;
+		}
+		op_end(b, 0);
+		mkdir_tree(b, path, fanout, depth-1);
+	}
+	path[len] = 0;
+}
+
+//builds a tree of fanout subdirectories per directory, depth levels deep
+static void run_mkdir( int fanout, int depth )
+{
+	struct bench b;
+	char path[256] = "/tree";
+	int total = 0;
+	for(int d=1, n=fanout; d<=depth; d++, n*=fanout) {
+		total += n;
+	}
+	fs_create_dir(path);
+	bench_begin(&b, "mkdir", total);
+	mkdir_tree(&b, path, fanout, depth);
+	bench_end(&b);
+}
+
+//sequential writes and reads of a whole file, then random ones within it,
+//at every request size
+static void run_data( int64_t file_size )
+{
+	struct bench b;
+	char name[64];
+	int inumber = fs_create_file("/data");
+	if(inumber<0) {
+		printf("create /data failed\n");
+		return;
+	}
+
+	for(int s=0; s<NSIZES; s++) {
+		int size = io_sizes[s];
+		int nops = file_size/size;
+
+		fs_truncate(inumber, 0);
+		sprintf(name, "seqwrite-%dk", size/1024);
+		bench_begin(&b, name, nops);
+		for(int i=0; i<nops; i++) {
+			op_begin(&b);
+			int r = fs_write(inumber, buffer, size, (int64_t)i*size);
+			op_end(&b, r>0 ? r : 0);
+		}
+		bench_end(&b);
+
+		sprintf(name, "seqread-%dk", size/1024);
+		bench_begin(&b, name, nops);
+		for(int i=0; i<nops; i++) {
+			op_begin(&b);
+			int r = fs_read(inumber, buffer, size, (int64_t)i*size);
+			op_end(&b, r>0 ? r : 0);
+		}
+		bench_end(&b);
+
+		//the same offsets for every run, so runs can be compared
+		int nrand = nops<BENCH_RAND_OPS ? nops : BENCH_RAND_OPS;
+		sprintf(name, "randwrite-%dk", size/1024);
+		srand(1);
+		bench_begin(&b, name, nrand);
+		for(int i=0; i<nrand; i++) {
+			int64_t offset = (int64_t)(rand()%nops)*size;
+			op_begin(&b);
+			int r = fs_write(inumber, buffer, size, offset);
+			op_end(&b, r>0 ? r : 0);
+		}
+		bench_end(&b);
+
+		sprintf(name, "randread-%dk", size/1024);
+		srand(2);
+		bench_begin(&b, name, nrand);
+		for(int i=0; i<nrand; i++) {
+			int64_t offset = (int64_t)(rand()%nops)*size;
+			op_begin(&b);
+			int r = fs_read(inumber, buffer, size, offset);
+			op_end(&b, r>0 ? r : 0);
+		}
+		bench_end(&b);
+	}
+	fs_delete_file("/data");
+}
+
+//time to mount a cleanly unmounted disk as the number of files on it
+//grows. every file gets a block of data, so it has an extent to map
+static void run_mount( int nfiles )
+{
+	struct bench b;
+	char path[64];
+	int created = 0;
+
+	fs_create_dir("/mount");
+	for(int step=0; step<=4; step++) {
+		int target = nfiles*step/4;
+		for(; created<target; created++) {
+			sprintf(path, "/mount/f%d", created);
+			int inumber = fs_create_file(path);
+			if(inumber<0) {
+				printf("create %s failed\n",path);
+				return;
+			}
+			fs_write(inumber, buffer, DISK_BLOCK_SIZE, 0);
+		}
+
+		char name[64];
+		sprintf(name, "mount-%d", created);
+		fs_unmount();
+		bench_begin(&b, name, BENCH_MOUNTS);
+		for(int i=0; i<BENCH_MOUNTS; i++) {
+			op_begin(&b);
+			if(!fs_mount()) {
+				printf("mount failed\n");
+				exit(1);
+			}
+			op_end(&b, 0);
+			if(i<BENCH_MOUNTS-1) {
+				fs_unmount();         //not counted in the latency
+			}
+		}
+		bench_end(&b);
+	}
+}
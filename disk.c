@@ -1,30 +1,163 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #include "disk.h"
+#include "stats.h"
 
 #define DISK_MAGIC 0xf0f03410
 
-static FILE *diskfile;
+#define STREAM_BATCH   32        //blocks moved by one background read or write
+#define PREFETCH_QUEUE 64        //pending read-ahead requests, more are dropped
+#define WRITEBACK_MS   100       //write-behind wakes up at least this often
+
+//one cached copy of a disk block. frames are chained in lru order,
+//most recently used at the head. the block data lives in a separate
+//block aligned array so it can be handed to O_DIRECT reads and writes
+struct cache_frame {
+	int  blocknum;
+	int  dirty;
+	int  writing;              //a copy is being written back by the write-behind thread
+	int  pins;                 //views handed out by disk_block_ptr, the frame stays put
+	int  prev;
+	int  next;
+	char *data;
+};
+
+//the stream buffer holds bulk file data next to the cache, so streaming
+//reads and writes do not push metadata out of it. the read-ahead thread
+//loads blocks into it ahead of sequential readers and disk_writev leaves
+//blocks in it for the write-behind thread. a block is held by a cache frame
+//or a stream slot, never both. slots are reused in clock order
+#define SLOT_EMPTY   0
+#define SLOT_LOADING 1           //being read ahead
+#define SLOT_CLEAN   2
+#define SLOT_DIRTY   3
+
+struct stream_slot {
+	int  blocknum;
+	int  state;
+	int  stale;                //written while loading, the loaded data is dropped
+	int  writing;              //a copy is being written back
+	char *data;
+};
+
+struct prefetch_request {
+	int blocknum;
+	int count;
+};
+
+static int diskfd=-1;
+static int direct_io=0;
+static char *mapping;              //whole image when opened with DISK_MMAP
 static int nblocks=0;
 static int nreads=0;
 static int nwrites=0;
 
+static struct cache_frame *frames;
+static char *frame_data;
+static int *frame_of;              //block number -> frame index, -1 if not cached
+static int nframes=0;
+static int nframes_used=0;
+static int lru_head=-1;
+static int lru_tail=-1;
+static int ndirty=0;
+static int nhits=0;
+static int nmisses=0;
+static int nwritebacks=0;
+
+static struct stream_slot *slots;
+static char *slot_data;
+static int *slot_of;               //block number -> stream slot, -1 if not there
+static int nslots=0;
+static int clock_hand=0;
+static int ndirty_slots=0;
+static int nprefetched=0;
+static int nstream_hits=0;
+
+static struct prefetch_request prefetch_queue[PREFETCH_QUEUE];
+static int prefetch_head=0;
+static int prefetch_count=0;
+static struct prefetch_request prefetch_active;   //rest of the request being served
+
+//everything above is shared with the background threads and guarded by
+//disk_lock. block I/O itself runs without it
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  io_done   = PTHREAD_COND_INITIALIZER;   //a background read or write finished
+static pthread_cond_t  ra_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  wb_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t readahead_thread;
+static pthread_t writeback_thread;
+static int threads_running=0;
+static int stopping=0;
+
+static void start_threads();
+static void stop_threads();
+static void aio_start( int flags );
+static void aio_stop();
+
 int disk_init( const char *filename, int n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	return disk_open(filename, n, 0);
+}
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+int disk_open( const char *filename, int n, int flags )
+{
+	int oflags = O_RDWR|O_CREAT;
+	if(flags & DISK_DIRECT) {
+		oflags |= O_DIRECT;
+	}
+	diskfd = open(filename, oflags, 0644);
+	if(diskfd<0) return 0;
 
+	if(ftruncate(diskfd,(off_t)n*DISK_BLOCK_SIZE)<0) {
+		close(diskfd);
+		diskfd = -1;
+		return 0;
+	}
+
+	direct_io = (flags & DISK_DIRECT) != 0;
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
 
+	if(flags & DISK_MMAP) {
+		//the mapping already is the cache, block frames would only add a copy
+		if((size_t)n > (size_t)-1/DISK_BLOCK_SIZE) {
+			close(diskfd);
+			diskfd = -1;
+			return 0;
+		}
+		mapping = mmap(0, (size_t)n*DISK_BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, diskfd, 0);
+		if(mapping==MAP_FAILED) {
+			mapping = 0;
+			close(diskfd);
+			diskfd = -1;
+			return 0;
+		}
+		aio_start(flags);
+		return 1;
+	}
+
+	if(!disk_cache_init(DISK_CACHE_FRAMES)) {
+		close(diskfd);
+		diskfd = -1;
+		return 0;
+	}
+	start_threads();
+	aio_start(flags);
+
 	return 1;
 }
 
@@ -51,40 +184,1418 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
-void disk_read( int blocknum, char *data )
+static void range_check( int blocknum, int count, const void *data )
 {
 	sanity_check(blocknum,data);
+	if(count<0 || count>nblocks-blocknum) {
+		printf("ERROR: block run %d+%d is past the end of the disk!\n",blocknum,count);
+		abort();
+	}
+}
+
+//helper fn
+//loops over pread/pwrite until the whole range is transferred
+static void raw_rw( int write, off_t pos, char *buf, size_t len )
+{
+	size_t done = 0;
+	while(done<len) {
+		ssize_t r;
+		if(write) {
+			r = pwrite(diskfd, buf+done, len-done, pos+done);
+		} else {
+			r = pread(diskfd, buf+done, len-done, pos+done);
+		}
+		if(r<0 && errno==EINTR) {
+			continue;
+		}
+		if(r<=0) {
+			printf("ERROR: couldn't access simulated disk: %s\n",r<0 ? strerror(errno) : "unexpected end of file");
+			abort();
+		}
+		done += r;
+	}
+}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+//helper fn
+//moves count contiguous blocks between the disk and buf in a single syscall.
+//O_DIRECT needs block aligned memory, so unaligned buffers are staged
+//through an aligned bounce buffer. safe to call without disk_lock
+static void raw_io( int write, int blocknum, int count, char *buf )
+{
+	size_t len = (size_t)count*DISK_BLOCK_SIZE;
+	off_t  pos = (off_t)blocknum*DISK_BLOCK_SIZE;
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	if(count==0) {
+		return;
+	}
+
+	if(mapping) {
+		if(write) {
+			memcpy(mapping+pos, buf, len);
+		} else {
+			memcpy(buf, mapping+pos, len);
+		}
+	} else if(direct_io && ((unsigned long)buf % DISK_BLOCK_SIZE)!=0) {
+		char *bounce;
+		if(posix_memalign((void**)&bounce, DISK_BLOCK_SIZE, len)!=0) {
+			printf("ERROR: couldn't allocate bounce buffer\n");
+			abort();
+		}
+		if(write) {
+			memcpy(bounce, buf, len);
+			raw_rw(1, pos, bounce, len);
+		} else {
+			raw_rw(0, pos, bounce, len);
+			memcpy(buf, bounce, len);
+		}
+		free(bounce);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		raw_rw(write, pos, buf, len);
 	}
+
+	if(write) {
+		__atomic_fetch_add(&nwrites, count, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&nreads, count, __ATOMIC_RELAXED);
+	}
+	stats_io(write, count);
+}
+
+static void raw_read( int blocknum, char *data )
+{
+	raw_io(0, blocknum, 1, data);
+}
+
+static void raw_write( int blocknum, const char *data )
+{
+	raw_io(1, blocknum, 1, (char*)data);
+}
+
+//helper fn
+//unlinks frame f from the lru list
+static void lru_unlink( int f )
+{
+	if(frames[f].prev!=-1) {
+		frames[frames[f].prev].next = frames[f].next;
+	} else {
+		lru_head = frames[f].next;
+	}
+	if(frames[f].next!=-1) {
+		frames[frames[f].next].prev = frames[f].prev;
+	} else {
+		lru_tail = frames[f].prev;
+	}
+}
+
+//helper fn
+//puts frame f at the most recently used end of the list
+static void lru_push_front( int f )
+{
+	frames[f].prev = -1;
+	frames[f].next = lru_head;
+	if(lru_head!=-1) {
+		frames[lru_head].prev = f;
+	}
+	lru_head = f;
+	if(lru_tail==-1) {
+		lru_tail = f;
+	}
+}
+
+//helper fn
+//least recently used frame that may be evicted, -1 if every frame is
+//pinned or being written back
+static int lru_victim()
+{
+	for(int f=lru_tail; f!=-1; f=frames[f].prev) {
+		if(!frames[f].writing && !frames[f].pins) {
+			return f;
+		}
+	}
+	return -1;
+}
+
+//helper fn
+//nonzero if a background write of blocknum is still in flight. a newer
+//copy of the block must not reach the disk before it completes
+static int writing_back( int blocknum )
+{
+	if(frame_of && frame_of[blocknum]!=-1 && frames[frame_of[blocknum]].writing) {
+		return 1;
+	}
+	return slot_of && slot_of[blocknum]!=-1 && slots[slot_of[blocknum]].writing;
+}
+
+//helper fn
+//nonzero while the read-ahead thread is loading blocknum
+static int loading( int blocknum )
+{
+	return slot_of && slot_of[blocknum]!=-1 && slots[slot_of[blocknum]].state==SLOT_LOADING;
+}
+
+//helper fn
+//takes blocknum out of the stream buffer. a slot that is still loading
+//keeps its place but its data will be thrown away
+static void slot_drop( int blocknum )
+{
+	int s = slot_of ? slot_of[blocknum] : -1;
+	if(s==-1) {
+		return;
+	}
+	if(slots[s].state==SLOT_LOADING) {
+		slots[s].stale = 1;
+		return;
+	}
+	if(slots[s].state==SLOT_DIRTY) {
+		ndirty_slots--;
+	}
+	slots[s].state   = SLOT_EMPTY;
+	slot_of[blocknum] = -1;
+}
+
+//helper fn
+//returns a frame holding blocknum. a miss takes an unused frame or evicts the
+//least recently used one that is not pinned, writing it back first if it is
+//dirty. the block contents are loaded only if fill is set, from the stream
+//buffer if it holds the block and from disk otherwise. called with disk_lock
+//held, may wait for background I/O on the block or for a frame to free up
+static int cache_get( int blocknum, int fill )
+{
+	int f;
+	while(1) {
+		f = frame_of[blocknum];
+		if(f!=-1) {
+			nhits++;
+			stats_event(FS_EV_CACHE_HIT, 1);
+			lru_unlink(f);
+			lru_push_front(f);
+			return f;
+		}
+		if(!loading(blocknum) && !writing_back(blocknum)) {
+			f = nframes_used<nframes ? nframes_used : lru_victim();
+			if(f!=-1) {
+				break;
+			}
+		}
+		pthread_cond_wait(&io_done, &disk_lock);
+	}
+
+	nmisses++;
+	stats_event(FS_EV_CACHE_MISS, 1);
+	if(f==nframes_used) {
+		nframes_used++;
+	} else {
+		lru_unlink(f);
+		if(frames[f].dirty) {
+			raw_write(frames[f].blocknum, frames[f].data);
+			ndirty--;
+			nwritebacks++;
+			stats_event(FS_EV_WRITE_BACK, 1);
+		}
+		frame_of[frames[f].blocknum] = -1;
+	}
+
+	frames[f].blocknum = blocknum;
+	frames[f].dirty    = 0;
+	frames[f].writing  = 0;
+	frames[f].pins     = 0;
+	int s = slot_of ? slot_of[blocknum] : -1;
+	if(s!=-1) {
+		//the block moves over from the stream buffer, dirty or not
+		if(fill) {
+			memcpy(frames[f].data, slots[s].data, DISK_BLOCK_SIZE);
+			nstream_hits++;
+			stats_event(FS_EV_STREAM_HIT, 1);
+		}
+		if(slots[s].state==SLOT_DIRTY) {
+			frames[f].dirty = 1;
+			ndirty++;
+		}
+		while(writing_back(blocknum)) {
+			pthread_cond_wait(&io_done, &disk_lock);
+		}
+		slot_drop(blocknum);
+	} else if(fill) {
+		raw_read(blocknum, frames[f].data);
+	}
+	frame_of[blocknum] = f;
+	lru_push_front(f);
+	return f;
+}
+
+//helper fn
+//marks frame f dirty and wakes the write-behind thread once a quarter of
+//the cache is dirty
+static void frame_dirty( int f )
+{
+	if(!frames[f].dirty) {
+		frames[f].dirty = 1;
+		ndirty++;
+		if(ndirty > nframes/4) {
+			pthread_cond_signal(&wb_wakeup);
+		}
+	}
+}
+
+//helper fn
+//finds a stream slot for blocknum, reusing slots in clock order. clean
+//slots are taken first. if every slot is dirty one of them is written back
+//on the spot. returns -1 if all slots are busy with background I/O.
+//called with disk_lock held
+static int slot_get( int blocknum )
+{
+	if(slot_of[blocknum]!=-1) {
+		return slot_of[blocknum];
+	}
+	int victim = -1;
+	for(int i=0; i<nslots; i++) {
+		int s = (clock_hand+i)%nslots;
+		if(slots[s].writing || slots[s].state==SLOT_LOADING) {
+			continue;
+		}
+		if(slots[s].state!=SLOT_DIRTY) {
+			victim = s;
+			break;
+		}
+		if(victim==-1) {
+			victim = s;
+		}
+	}
+	if(victim==-1) {
+		return -1;
+	}
+	clock_hand = (victim+1)%nslots;
+
+	struct stream_slot *slot = &slots[victim];
+	if(slot->state==SLOT_DIRTY) {
+		raw_write(slot->blocknum, slot->data);
+		ndirty_slots--;
+		nwritebacks++;
+		stats_event(FS_EV_WRITE_BACK, 1);
+	}
+	if(slot->state!=SLOT_EMPTY) {
+		slot_of[slot->blocknum] = -1;
+	}
+	slot->blocknum = blocknum;
+	slot->state    = SLOT_EMPTY;
+	slot->stale    = 0;
+	slot_of[blocknum] = victim;
+	return victim;
+}
+
+void disk_read( int blocknum, char *data )
+{
+	sanity_check(blocknum,data);
+
+	if(nframes==0) {
+		raw_read(blocknum, data);
+		return;
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	int f = cache_get(blocknum, 1);
+	memcpy(data, frames[f].data, DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&disk_lock);
 }
 
 void disk_write( int blocknum, const char *data )
 {
 	sanity_check(blocknum,data);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	if(nframes==0) {
+		raw_write(blocknum, data);
+		return;
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	//a slot whose write-behind is in flight is dropped only once it lands,
+	//or the write-behind could not clear it and the older copy could reach
+	//the disk after this one
+	while(writing_back(blocknum)) {
+		pthread_cond_wait(&io_done, &disk_lock);
+	}
+	slot_drop(blocknum);                //the whole block is replaced
+	int f = cache_get(blocknum, 0);     //whole block is overwritten, no need to read it
+	memcpy(frames[f].data, data, DISK_BLOCK_SIZE);
+	frame_dirty(f);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+//returns a read only pointer to the contents of a block without copying it.
+//for a mapped image this points into the mapping and stays valid until
+//disk_close. otherwise it points into a cache frame, which is pinned until
+//the pointer is given back with disk_block_put. returns 0 if the cache is
+//disabled
+const char *disk_block_ptr( int blocknum )
+{
+	sanity_check(blocknum,(void*)1);
+
+	if(mapping) {
+		__atomic_fetch_add(&nreads, 1, __ATOMIC_RELAXED);
+		stats_io(0, 1);
+		return mapping+(size_t)blocknum*DISK_BLOCK_SIZE;
+	}
+	if(nframes==0) {
+		return 0;
+	}
+	pthread_mutex_lock(&disk_lock);
+	int f = cache_get(blocknum, 1);
+	frames[f].pins++;
+	pthread_mutex_unlock(&disk_lock);
+	return frames[f].data;
+}
+
+void disk_block_put( int blocknum )
+{
+	if(mapping || nframes==0) {
+		return;
+	}
+	pthread_mutex_lock(&disk_lock);
+	int f = frame_of[blocknum];
+	if(f!=-1 && frames[f].pins>0 && --frames[f].pins==0) {
+		pthread_cond_broadcast(&io_done);
+	}
+	pthread_mutex_unlock(&disk_lock);
+}
+
+//helper fn
+//a reader that got ahead of the read-ahead thread reads blocknum..+count
+//itself, so queued requests give up the part of them it covers
+static void prefetch_trim( int blocknum, int count )
+{
+	for(int i=-1;i<prefetch_count;i++) {
+		struct prefetch_request *req = i<0 ? &prefetch_active : &prefetch_queue[(prefetch_head+i)%PREFETCH_QUEUE];
+		if(req->count>0 && req->blocknum>=blocknum && req->blocknum<blocknum+count) {
+			int skip = blocknum+count-req->blocknum;
+			req->blocknum += skip;
+			req->count     = req->count>skip ? req->count-skip : 0;
+		}
+	}
+}
+
+//reads count contiguous blocks. blocks held by the cache or the stream
+//buffer are copied from there, the rest is read from disk with one call per
+//run without touching either, so bulk data does not push metadata out of
+//the cache. blocks the read-ahead thread is loading are waited for
+void disk_readv( int blocknum, int count, char *data )
+{
+	range_check(blocknum,count,data);
+
+	if(nframes==0) {
+		raw_io(0, blocknum, count, data);
+		return;
+	}
+
+	char *have = calloc(count, 1);
+	if(!have) {
+		printf("ERROR: couldn't allocate read state for %d blocks\n",count);
+		abort();
+	}
+	pthread_mutex_lock(&disk_lock);
+	for(int i=0;i<count;i++) {
+		while(loading(blocknum+i)) {
+			pthread_cond_wait(&io_done, &disk_lock);
+		}
+	}
+	for(int i=0;i<count;i++) {
+		int f = frame_of[blocknum+i];
+		int s = slot_of[blocknum+i];
+		if(f!=-1) {
+			memcpy(data+(size_t)i*DISK_BLOCK_SIZE, frames[f].data, DISK_BLOCK_SIZE);
+			have[i] = 1;
+		} else if(s!=-1) {
+			memcpy(data+(size_t)i*DISK_BLOCK_SIZE, slots[s].data, DISK_BLOCK_SIZE);
+			nstream_hits++;
+			stats_event(FS_EV_STREAM_HIT, 1);
+			have[i] = 1;
+		}
+	}
+	prefetch_trim(blocknum, count);
+	pthread_mutex_unlock(&disk_lock);
+
+	for(int i=0;i<count;) {
+		if(have[i]) {
+			i++;
+			continue;
+		}
+		int run = 1;
+		while(i+run<count && !have[i+run]) {
+			run++;
+		}
+		raw_io(0, blocknum+i, run, data+(size_t)i*DISK_BLOCK_SIZE);
+		i += run;
+	}
+	free(have);
+}
+
+//writes count contiguous blocks. cached blocks are updated in their frames,
+//the others are left dirty in the stream buffer for the write-behind thread,
+//so the caller goes on while the data is written out. without room in the
+//stream buffer the rest is written straight through
+void disk_writev( int blocknum, int count, const char *data )
+{
+	range_check(blocknum,count,data);
+
+	if(nframes==0) {
+		raw_io(1, blocknum, count, (char*)data);
+		return;
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	int i;
+	for(i=0;i<count;i++) {
+		int b = blocknum+i;
+		const char *src = data+(size_t)i*DISK_BLOCK_SIZE;
+		if(frame_of[b]!=-1) {
+			int f = frame_of[b];
+			memcpy(frames[f].data, src, DISK_BLOCK_SIZE);
+			frame_dirty(f);
+			continue;
+		}
+		int s = loading(b) ? -1 : slot_get(b);
+		if(s==-1) {
+			break;
+		}
+		memcpy(slots[s].data, src, DISK_BLOCK_SIZE);
+		if(slots[s].state!=SLOT_DIRTY) {
+			slots[s].state = SLOT_DIRTY;
+			ndirty_slots++;
+		}
+	}
+	if(ndirty_slots>0) {
+		pthread_cond_signal(&wb_wakeup);
+	}
+	if(i<count) {
+		//no slot to spare: the rest goes to disk now. stale copies must not
+		//outlive it and in flight writes of these blocks must land first
+		for(int j=i;j<count;j++) {
+			while(writing_back(blocknum+j)) {
+				pthread_cond_wait(&io_done, &disk_lock);
+			}
+			slot_drop(blocknum+j);
+			if(frame_of[blocknum+j]!=-1) {
+				int f = frame_of[blocknum+j];
+				memcpy(frames[f].data, data+(size_t)j*DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+				if(frames[f].dirty) {
+					frames[f].dirty = 0;
+					ndirty--;
+				}
+			}
+		}
+		raw_io(1, blocknum+i, count-i, (char*)data+(size_t)i*DISK_BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&disk_lock);
+}
+
+//asks the read-ahead thread to load count blocks starting at blocknum into
+//the stream buffer. requests are dropped if the queue is full
+void disk_prefetch( int blocknum, int count )
+{
+	range_check(blocknum,count,(void*)1);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	if(mapping) {
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t pos  = (size_t)blocknum*DISK_BLOCK_SIZE;
+		size_t len  = (size_t)count*DISK_BLOCK_SIZE;
+		madvise(mapping+pos/page*page, len+pos%page, MADV_WILLNEED);
+		return;
+	}
+	if(count==0) {
+		return;
+	}
+	pthread_mutex_lock(&disk_lock);
+	if(threads_running && nslots>0 && prefetch_count<PREFETCH_QUEUE) {
+		struct prefetch_request *req = &prefetch_queue[(prefetch_head+prefetch_count)%PREFETCH_QUEUE];
+		req->blocknum = blocknum;
+		req->count    = count;
+		prefetch_count++;
+		pthread_cond_signal(&ra_wakeup);
+	}
+	pthread_mutex_unlock(&disk_lock);
+}
+
+//helper fn
+//reads the blocks of the active request that are neither cached nor in the
+//stream buffer, up to STREAM_BATCH of them per disk call. called and returns
+//with disk_lock held, which is dropped during the reads
+static void prefetch_run( char *buf )
+{
+	struct prefetch_request *req = &prefetch_active;
+	while(req->count>0 && !stopping) {
+		int b = req->blocknum;
+		if(frame_of[b]!=-1 || slot_of[b]!=-1) {
+			req->blocknum++;
+			req->count--;
+			continue;
+		}
+		//claims slots for a run of absent blocks
+		int claimed[STREAM_BATCH];
+		int run = 0;
+		while(run<STREAM_BATCH && run<req->count && frame_of[b+run]==-1 && slot_of[b+run]==-1) {
+			int s = slot_get(b+run);
+			if(s==-1) {
+				break;
+			}
+			slots[s].state = SLOT_LOADING;
+			claimed[run++] = s;
+		}
+		if(run==0) {
+			req->count = 0;                //every slot is busy
+			return;
+		}
+		req->blocknum += run;
+		req->count    -= run;
+
+		pthread_mutex_unlock(&disk_lock);
+		raw_io(0, b, run, buf);
+		pthread_mutex_lock(&disk_lock);
+
+		for(int i=0;i<run;i++) {
+			struct stream_slot *slot = &slots[claimed[i]];
+			if(slot->stale) {
+				slot->state = SLOT_EMPTY;
+				slot_of[slot->blocknum] = -1;
+			} else {
+				memcpy(slot->data, buf+(size_t)i*DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+				slot->state = SLOT_CLEAN;
+				nprefetched++;
+				stats_event(FS_EV_READ_AHEAD, 1);
+			}
+			slot->stale = 0;
+		}
+		pthread_cond_broadcast(&io_done);
+	}
+}
+
+//helper fn
+//read-ahead thread: serves prefetch requests in the order they came in
+static void *readahead_main( void *arg )
+{
+	char *buf;
+	if(posix_memalign((void**)&buf, DISK_BLOCK_SIZE, (size_t)STREAM_BATCH*DISK_BLOCK_SIZE)!=0) {
+		return 0;
+	}
+	pthread_mutex_lock(&disk_lock);
+	while(!stopping) {
+		if(prefetch_count==0) {
+			pthread_cond_wait(&ra_wakeup, &disk_lock);
+			continue;
+		}
+		prefetch_active = prefetch_queue[prefetch_head];
+		prefetch_head = (prefetch_head+1)%PREFETCH_QUEUE;
+		prefetch_count--;
+		if(nslots>0) {
+			prefetch_run(buf);
+		}
+		prefetch_active.count = 0;
+	}
+	pthread_mutex_unlock(&disk_lock);
+	free(buf);
+	return 0;
+}
+
+//helper fn
+static int block_cmp( const void *a, const void *b )
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+//helper fn
+//picks up to STREAM_BATCH dirty blocks: every dirty stream slot, and the
+//least recently used dirty frames while more than an eighth of the cache is
+//dirty. their contents are copied to buf in block order and they are marked
+//clean and in flight. returns how many were picked
+static int writeback_pick( char *buf, int *blocks )
+{
+	int picked[STREAM_BATCH];
+	int n = 0;
+	for(int s=0; s<nslots && n<STREAM_BATCH; s++) {
+		if(slots[s].state==SLOT_DIRTY && !slots[s].writing) {
+			picked[n++] = slots[s].blocknum;
+		}
+	}
+	int excess = ndirty-nframes/8;
+	for(int f=lru_tail; f!=-1 && n<STREAM_BATCH && excess>0; f=frames[f].prev) {
+		if(frames[f].dirty && !frames[f].writing) {
+			picked[n++] = frames[f].blocknum;
+			excess--;
+		}
+	}
+	qsort(picked, n, sizeof(int), block_cmp);
+
+	for(int i=0;i<n;i++) {
+		int b = picked[i];
+		blocks[i] = b;
+		if(frame_of[b]!=-1) {
+			struct cache_frame *frame = &frames[frame_of[b]];
+			memcpy(buf+(size_t)i*DISK_BLOCK_SIZE, frame->data, DISK_BLOCK_SIZE);
+			frame->dirty   = 0;
+			frame->writing = 1;
+			ndirty--;
+		} else {
+			struct stream_slot *slot = &slots[slot_of[b]];
+			memcpy(buf+(size_t)i*DISK_BLOCK_SIZE, slot->data, DISK_BLOCK_SIZE);
+			slot->state   = SLOT_CLEAN;
+			slot->writing = 1;
+			ndirty_slots--;
+		}
+		nwritebacks++;
+		stats_event(FS_EV_WRITE_BACK, 1);
+	}
+	return n;
+}
+
+//helper fn
+//write-behind thread: writes dirty stream slots out as they appear and
+//keeps the dirty part of the cache small, so evictions rarely have to
+//write. each batch is written in runs of contiguous blocks
+static void *writeback_main( void *arg )
+{
+	char *buf;
+	int blocks[STREAM_BATCH];
+	if(posix_memalign((void**)&buf, DISK_BLOCK_SIZE, (size_t)STREAM_BATCH*DISK_BLOCK_SIZE)!=0) {
+		return 0;
+	}
+	pthread_mutex_lock(&disk_lock);
+	while(!stopping) {
+		int n = writeback_pick(buf, blocks);
+		if(n==0) {
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += WRITEBACK_MS*1000000L;
+			until.tv_sec  += until.tv_nsec/1000000000L;
+			until.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&wb_wakeup, &disk_lock, &until);
+			continue;
+		}
+
+		pthread_mutex_unlock(&disk_lock);
+		for(int i=0;i<n;) {
+			int run = 1;
+			while(i+run<n && blocks[i+run]==blocks[i]+run) {
+				run++;
+			}
+			raw_io(1, blocks[i], run, buf+(size_t)i*DISK_BLOCK_SIZE);
+			i += run;
+		}
+		pthread_mutex_lock(&disk_lock);
+
+		for(int i=0;i<n;i++) {
+			int b = blocks[i];
+			if(frame_of[b]!=-1) {
+				frames[frame_of[b]].writing = 0;
+			}
+			if(slot_of[b]!=-1) {
+				slots[slot_of[b]].writing = 0;
+			}
+		}
+		pthread_cond_broadcast(&io_done);
+	}
+	pthread_mutex_unlock(&disk_lock);
+	free(buf);
+	return 0;
+}
+
+static void start_threads()
+{
+	stopping = 0;
+	if(pthread_create(&readahead_thread, 0, readahead_main, 0)!=0) {
+		return;                        //everything still works, just without overlap
+	}
+	if(pthread_create(&writeback_thread, 0, writeback_main, 0)!=0) {
+		pthread_mutex_lock(&disk_lock);
+		stopping = 1;
+		pthread_cond_broadcast(&ra_wakeup);
+		pthread_mutex_unlock(&disk_lock);
+		pthread_join(readahead_thread, 0);
+		return;
+	}
+	threads_running = 1;
+}
+
+static void stop_threads()
+{
+	if(!threads_running) {
+		return;
+	}
+	pthread_mutex_lock(&disk_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&ra_wakeup);
+	pthread_cond_broadcast(&wb_wakeup);
+	pthread_mutex_unlock(&disk_lock);
+	pthread_join(readahead_thread, 0);
+	pthread_join(writeback_thread, 0);
+	threads_running = 0;
+	prefetch_count  = 0;
+}
+
+//asynchronous requests. a request is split into ops, one per run of blocks
+//that has to come from the disk, and completes when its last op does. ops
+//go to an io_uring when the kernel has one and to a small thread pool
+//otherwise. requests with a tag stay in their slot until disk_poll reports
+//them, the others are done as soon as their ops are
+struct aio_request {
+	int  busy;
+	int  parts;                //ops in flight, plus one while being submitted
+	int  pending;              //not complete yet
+	pthread_t owner;           //thread that submitted it
+	void *tag;
+};
+
+struct aio_op {
+	int  busy;
+	int  write;
+	int  blocknum;
+	int  count;
+	char *data;
+	int  req;
+	int  stat_op;              //call that submitted it, charged with its I/O
+	struct iovec iov;
+};
+
+static struct aio_request aio_reqs[DISK_QUEUE_DEPTH];
+static struct aio_op aio_ops[DISK_QUEUE_DEPTH];
+static int aio_nops=0;                 //ops in flight
+static int aio_pending=0;              //requests not complete yet
+static int aio_done[DISK_QUEUE_DEPTH]; //completed tagged requests, oldest first
+static int aio_done_head=0;
+static int aio_done_count=0;
+
+//thread pool backend
+#define AIO_WORKERS 4
+static int aio_queue[DISK_QUEUE_DEPTH];       //ops waiting for a worker
+static int aio_queue_head=0;
+static int aio_queue_count=0;
+static int aio_finished[DISK_QUEUE_DEPTH];    //ops done by a worker, not reaped yet
+static int aio_nfinished=0;
+static pthread_cond_t aio_work    = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t aio_settled = PTHREAD_COND_INITIALIZER;
+static pthread_t aio_workers[AIO_WORKERS];
+static int aio_nworkers=0;
+static int aio_stopping=0;
+
+//io_uring backend, set up with raw system calls
+static int ring_fd=-1;
+static void *sq_ring;
+static void *cq_ring;
+static size_t sq_ring_len;
+static size_t cq_ring_len;
+static struct io_uring_sqe *sqes;
+static size_t sqes_len;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static int sq_unsubmitted=0;
+
+//helper fn
+//maps the rings of a new io_uring. returns 0 if the kernel has none
+static int uring_setup()
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, DISK_QUEUE_DEPTH, &p);
+	if(fd<0) {
+		return 0;
+	}
+	if(!(p.features & IORING_FEAT_EXT_ARG)) {
+		close(fd);                     //waits need a timeout, older kernels get the threads
+		return 0;
+	}
+
+	sq_ring_len = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	cq_ring_len = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(cq_ring_len>sq_ring_len) {
+			sq_ring_len = cq_ring_len;
+		}
+		cq_ring_len = sq_ring_len;
+	}
+	sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+
+	sq_ring = mmap(0, sq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(sq_ring==MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ring = sq_ring;
+	} else {
+		cq_ring = mmap(0, cq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	}
+	sqes = mmap(0, sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(cq_ring==MAP_FAILED || sqes==MAP_FAILED) {
+		if(cq_ring!=MAP_FAILED && cq_ring!=sq_ring) {
+			munmap(cq_ring, cq_ring_len);
+		}
+		if(sqes!=MAP_FAILED) {
+			munmap(sqes, sqes_len);
+		}
+		munmap(sq_ring, sq_ring_len);
+		close(fd);
+		return 0;
+	}
+
+	sq_head  = (unsigned*)((char*)sq_ring+p.sq_off.head);
+	sq_tail  = (unsigned*)((char*)sq_ring+p.sq_off.tail);
+	sq_mask  = (unsigned*)((char*)sq_ring+p.sq_off.ring_mask);
+	sq_array = (unsigned*)((char*)sq_ring+p.sq_off.array);
+	cq_head  = (unsigned*)((char*)cq_ring+p.cq_off.head);
+	cq_tail  = (unsigned*)((char*)cq_ring+p.cq_off.tail);
+	cq_mask  = (unsigned*)((char*)cq_ring+p.cq_off.ring_mask);
+	cqes     = (struct io_uring_cqe*)((char*)cq_ring+p.cq_off.cqes);
+	ring_fd  = fd;
+	return 1;
+}
+
+static void uring_teardown()
+{
+	if(ring_fd<0) {
+		return;
+	}
+	munmap(sqes, sqes_len);
+	if(cq_ring!=sq_ring) {
+		munmap(cq_ring, cq_ring_len);
+	}
+	munmap(sq_ring, sq_ring_len);
+	close(ring_fd);
+	ring_fd = -1;
+}
+
+//helper fn
+//hands the queued submission entries to the kernel
+static void uring_flush()
+{
+	while(sq_unsubmitted>0) {
+		int r = syscall(__NR_io_uring_enter, ring_fd, sq_unsubmitted, 0, 0, NULL, 0);
+		if(r<0 && (errno==EINTR || errno==EAGAIN || errno==EBUSY)) {
+			continue;
+		}
+		if(r<0) {
+			printf("ERROR: couldn't submit asynchronous I/O: %s\n",strerror(errno));
+			abort();
+		}
+		sq_unsubmitted -= r;
+	}
+}
+
+//helper fn
+//a request whose last op finished is either done or waits to be polled
+static void request_done( int r )
+{
+	aio_pending--;
+	aio_reqs[r].pending = 0;
+	if(aio_reqs[r].tag) {
+		aio_done[(aio_done_head+aio_done_count)%DISK_QUEUE_DEPTH] = r;
+		aio_done_count++;
+	} else {
+		aio_reqs[r].busy = 0;
+	}
+}
+
+//helper fn
+//retires op i, which transferred res bytes. a short or failed transfer is
+//finished synchronously, which also reports a real disk error
+static void op_finish( int i, int res )
+{
+	struct aio_op *op = &aio_ops[i];
+	size_t len = (size_t)op->count*DISK_BLOCK_SIZE;
+	if(res<0) {
+		res = 0;
+	}
+	if((size_t)res<len) {
+		raw_rw(op->write, (off_t)op->blocknum*DISK_BLOCK_SIZE+res, op->data+res, len-res);
+	}
+	op->busy = 0;
+	aio_nops--;
+	if(--aio_reqs[op->req].parts==0) {
+		request_done(op->req);
+	}
+}
+
+//helper fn
+//retires the ops that finished and returns how many. threads waiting for
+//some other thread's ops are woken to check on them
+static int aio_collect()
+{
+	int reaped = 0;
+	if(ring_fd>=0) {
+		unsigned head = *cq_head;
+		while(head!=__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+			op_finish((int)cqe->user_data, cqe->res);
+			head++;
+			reaped++;
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	} else {
+		while(aio_nfinished>0) {
+			int i = aio_finished[--aio_nfinished];
+			op_finish(i, aio_ops[i].count*DISK_BLOCK_SIZE);
+			reaped++;
+		}
+	}
+	if(reaped) {
+		pthread_cond_broadcast(&aio_settled);
+	}
+	return reaped;
+}
+
+//helper fn
+//retires finished ops. with wait set and nothing finished yet, waits once
+//for ops to finish; callers loop until what they wait for is done. the
+//kernel wait has a short timeout, since another thread may reap the
+//completion this one is waiting for. called with disk_lock held, which is
+//dropped while waiting
+static void aio_reap( int wait )
+{
+	if(aio_collect() || !wait || aio_nops==0) {
+		return;
+	}
+	if(ring_fd>=0) {
+		struct __kernel_timespec ts = { 0, 1000000 };
+		struct io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (unsigned long)&ts;
+		uring_flush();
+		pthread_mutex_unlock(&disk_lock);
+		syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		pthread_mutex_lock(&disk_lock);
+	} else {
+		pthread_cond_wait(&aio_settled, &disk_lock);
+	}
+	aio_collect();
+}
+
+//helper fn
+//starts a transfer of count blocks for request r. mapped images and
+//unaligned O_DIRECT buffers, which io_uring can't take, are done on the spot
+static void op_start( int write, int blocknum, int count, char *data, int r )
+{
+	if(mapping || (ring_fd>=0 && direct_io && ((unsigned long)data % DISK_BLOCK_SIZE)!=0)) {
+		raw_io(write, blocknum, count, data);
+		return;
+	}
+	while(aio_nops==DISK_QUEUE_DEPTH) {
+		aio_reap(1);
+	}
+	int i = 0;
+	while(aio_ops[i].busy) {
+		i++;
+	}
+	struct aio_op *op = &aio_ops[i];
+	op->busy     = 1;
+	op->write    = write;
+	op->blocknum = blocknum;
+	op->count    = count;
+	op->data     = data;
+	op->req      = r;
+	op->stat_op  = stats_op();
+	aio_nops++;
+	aio_reqs[r].parts++;
+
+	if(ring_fd>=0) {
+		op->iov.iov_base = data;
+		op->iov.iov_len  = (size_t)count*DISK_BLOCK_SIZE;
+		unsigned tail = *sq_tail;
+		unsigned idx  = tail & *sq_mask;
+		struct io_uring_sqe *sqe = &sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode    = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd        = diskfd;
+		sqe->off       = (off_t)blocknum*DISK_BLOCK_SIZE;
+		sqe->addr      = (unsigned long)&op->iov;
+		sqe->len       = 1;
+		sqe->user_data = i;
+		sq_array[idx]  = idx;
+		__atomic_store_n(sq_tail, tail+1, __ATOMIC_RELEASE);
+		sq_unsubmitted++;
+		__atomic_fetch_add(write ? &nwrites : &nreads, count, __ATOMIC_RELAXED);
+		stats_io(write, count);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		aio_queue[(aio_queue_head+aio_queue_count)%DISK_QUEUE_DEPTH] = i;
+		aio_queue_count++;
+		pthread_cond_signal(&aio_work);
+	}
+}
+
+//helper fn
+//thread pool worker: runs queued ops with plain blocking I/O
+static void *aio_worker_main( void *arg )
+{
+	pthread_mutex_lock(&disk_lock);
+	while(1) {
+		if(aio_queue_count==0) {
+			if(aio_stopping) {
+				break;
+			}
+			pthread_cond_wait(&aio_work, &disk_lock);
+			continue;
+		}
+		int i = aio_queue[aio_queue_head];
+		aio_queue_head = (aio_queue_head+1)%DISK_QUEUE_DEPTH;
+		aio_queue_count--;
+		struct aio_op op = aio_ops[i];
+
+		pthread_mutex_unlock(&disk_lock);
+		stats_set_op(op.stat_op);
+		raw_io(op.write, op.blocknum, op.count, op.data);
+		stats_set_op(FS_OP_NONE);
+		pthread_mutex_lock(&disk_lock);
+
+		aio_finished[aio_nfinished++] = i;
+		pthread_cond_broadcast(&aio_settled);
+	}
+	pthread_mutex_unlock(&disk_lock);
+	return 0;
+}
+
+//helper fn
+//picks the io_uring backend unless told not to or the kernel lacks it
+static void aio_start( int flags )
+{
+	if(mapping) {
+		return;                        //every transfer is a memcpy, done on the spot
+	}
+	if(!(flags & DISK_NO_URING) && uring_setup()) {
+		return;
+	}
+	aio_stopping = 0;
+	for(aio_nworkers=0; aio_nworkers<AIO_WORKERS; aio_nworkers++) {
+		if(pthread_create(&aio_workers[aio_nworkers], 0, aio_worker_main, 0)!=0) {
+			break;
+		}
+	}
+	if(aio_nworkers==0) {
+		printf("ERROR: couldn't start asynchronous I/O threads\n");
 		abort();
 	}
 }
 
+static void aio_stop()
+{
+	pthread_mutex_lock(&disk_lock);
+	while(aio_pending>0) {
+		aio_reap(1);
+	}
+	pthread_mutex_unlock(&disk_lock);
+	uring_teardown();
+	pthread_mutex_lock(&disk_lock);
+	aio_stopping = 1;
+	pthread_cond_broadcast(&aio_work);
+	pthread_mutex_unlock(&disk_lock);
+	for(int i=0;i<aio_nworkers;i++) {
+		pthread_join(aio_workers[i], 0);
+	}
+	aio_nworkers   = 0;
+	aio_done_count = 0;
+	for(int r=0;r<DISK_QUEUE_DEPTH;r++) {
+		aio_reqs[r].busy = 0;
+	}
+}
+
+//starts an asynchronous transfer of count contiguous blocks between the disk
+//and data. blocks held by the cache or the stream buffer are served from
+//there at once, like disk_readv and disk_writev do. returns 0 if every
+//request slot holds a completion that was not polled yet
+int disk_submit( int write, int blocknum, int count, char *data, void *tag )
+{
+	range_check(blocknum,count,data);
+
+	int done = 0;
+	if(mapping) {
+		raw_io(write, blocknum, count, data);    //just a memcpy, kept out of the lock
+		if(!tag) {
+			return 1;
+		}
+		done = 1;
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	int r;
+	while(1) {
+		for(r=0; r<DISK_QUEUE_DEPTH && aio_reqs[r].busy; r++);
+		if(r<DISK_QUEUE_DEPTH) {
+			break;
+		}
+		if(aio_pending==0) {
+			pthread_mutex_unlock(&disk_lock);
+			return 0;
+		}
+		aio_reap(1);
+	}
+	aio_reqs[r].busy  = 1;
+	aio_reqs[r].parts = 1;
+	aio_reqs[r].tag   = tag;
+	aio_reqs[r].pending = 1;
+	aio_reqs[r].owner = pthread_self();
+	aio_pending++;
+
+	if(done) {
+		//nothing left to do but report it
+	} else if(nframes==0) {
+		op_start(write, blocknum, count, data, r);
+	} else if(!write) {
+		for(int i=0;i<count;i++) {
+			while(loading(blocknum+i)) {
+				pthread_cond_wait(&io_done, &disk_lock);
+			}
+		}
+		//present blocks are copied now, every run of absent ones is an op
+		int run = 0;
+		for(int i=0;i<=count;i++) {
+			int f = i<count ? frame_of[blocknum+i] : -1;
+			int s = i<count ? slot_of[blocknum+i] : -1;
+			if(i<count && f==-1 && s==-1) {
+				run++;
+				continue;
+			}
+			if(run>0) {
+				op_start(0, blocknum+i-run, run, data+(size_t)(i-run)*DISK_BLOCK_SIZE, r);
+				run = 0;
+			}
+			if(f!=-1) {
+				memcpy(data+(size_t)i*DISK_BLOCK_SIZE, frames[f].data, DISK_BLOCK_SIZE);
+			} else if(s!=-1) {
+				memcpy(data+(size_t)i*DISK_BLOCK_SIZE, slots[s].data, DISK_BLOCK_SIZE);
+				nstream_hits++;
+				stats_event(FS_EV_STREAM_HIT, 1);
+			}
+		}
+		prefetch_trim(blocknum, count);
+	} else {
+		//cached copies are refreshed and become clean, older writes of
+		//these blocks land first
+		for(int i=0;i<count;i++) {
+			int b = blocknum+i;
+			while(writing_back(b) || loading(b)) {
+				pthread_cond_wait(&io_done, &disk_lock);
+			}
+			slot_drop(b);
+			if(frame_of[b]!=-1) {
+				int f = frame_of[b];
+				memcpy(frames[f].data, data+(size_t)i*DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+				if(frames[f].dirty) {
+					frames[f].dirty = 0;
+					ndirty--;
+				}
+			}
+		}
+		op_start(1, blocknum, count, data, r);
+	}
+
+	if(--aio_reqs[r].parts==0) {
+		request_done(r);
+	}
+	if(ring_fd>=0) {
+		uring_flush();
+	}
+	pthread_mutex_unlock(&disk_lock);
+	return 1;
+}
+
+//stores the tags of up to max completed requests in tags, oldest first, and
+//returns how many. with wait set it waits for a completion if none is there
+//yet and a request is still in flight
+int disk_poll( void **tags, int max, int wait )
+{
+	pthread_mutex_lock(&disk_lock);
+	aio_reap(0);
+	while(wait && aio_done_count==0 && aio_pending>0) {
+		aio_reap(1);
+	}
+	int n = 0;
+	while(n<max && aio_done_count>0) {
+		int r = aio_done[aio_done_head];
+		aio_done_head = (aio_done_head+1)%DISK_QUEUE_DEPTH;
+		aio_done_count--;
+		tags[n++] = aio_reqs[r].tag;
+		aio_reqs[r].busy = 0;
+	}
+	pthread_mutex_unlock(&disk_lock);
+	return n;
+}
+
+//helper fn
+//nonzero while a request of the calling thread is not complete
+static int own_pending()
+{
+	pthread_t self = pthread_self();
+	for(int r=0;r<DISK_QUEUE_DEPTH;r++) {
+		if(aio_reqs[r].pending && pthread_equal(aio_reqs[r].owner, self)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//waits until every request the calling thread submitted is complete.
+//tagged requests can still be polled afterwards
+void disk_drain()
+{
+	pthread_mutex_lock(&disk_lock);
+	while(own_pending()) {
+		aio_reap(1);
+	}
+	pthread_mutex_unlock(&disk_lock);
+}
+
+//helper fn
+//writes every dirty frame and stream slot and waits for background writes
+//and reads to finish. called with disk_lock held
+static void flush_locked()
+{
+	for(int f=0;f<nframes_used;f++) {
+		while(frames[f].writing) {
+			pthread_cond_wait(&io_done, &disk_lock);
+		}
+		if(frames[f].dirty) {
+			raw_write(frames[f].blocknum, frames[f].data);
+			frames[f].dirty = 0;
+			ndirty--;
+			nwritebacks++;
+			stats_event(FS_EV_WRITE_BACK, 1);
+		}
+	}
+	for(int s=0;s<nslots;s++) {
+		while(slots[s].writing || slots[s].state==SLOT_LOADING) {
+			pthread_cond_wait(&io_done, &disk_lock);
+		}
+		if(slots[s].state==SLOT_DIRTY) {
+			raw_write(slots[s].blocknum, slots[s].data);
+			slots[s].state = SLOT_CLEAN;
+			ndirty_slots--;
+			nwritebacks++;
+			stats_event(FS_EV_WRITE_BACK, 1);
+		}
+	}
+}
+
+void disk_flush()
+{
+	pthread_mutex_lock(&disk_lock);
+	flush_locked();
+	pthread_mutex_unlock(&disk_lock);
+	if(mapping) {
+		msync(mapping, (size_t)nblocks*DISK_BLOCK_SIZE, MS_SYNC);
+	}
+}
+
+//waits until what has been written to the image so far is on stable
+//storage. blocks still dirty in the cache or the stream buffer are not
+//written, disk_flush does that
+void disk_sync()
+{
+	if(mapping) {
+		msync(mapping, (size_t)nblocks*DISK_BLOCK_SIZE, MS_SYNC);
+	} else if(diskfd>=0) {
+		fdatasync(diskfd);
+	}
+}
+
+//helper fn
+//drops the cache and the stream buffer. called with disk_lock held after
+//everything is flushed
+static void free_buffers()
+{
+	free(frames);
+	free(frame_data);
+	free(frame_of);
+	free(slots);
+	free(slot_data);
+	free(slot_of);
+	frames       = 0;
+	frame_data   = 0;
+	frame_of     = 0;
+	slots        = 0;
+	slot_data    = 0;
+	slot_of      = 0;
+	nframes      = 0;
+	nframes_used = 0;
+	nslots       = 0;
+	clock_hand   = 0;
+	ndirty       = 0;
+	ndirty_slots = 0;
+	lru_head     = -1;
+	lru_tail     = -1;
+}
+
+int disk_cache_init( int n )
+{
+	if(n<0) {
+		return 0;
+	}
+	if(mapping) {
+		return 1;                  //mapped images are not cached
+	}
+
+	//dirty blocks of the old cache must reach the disk before it is dropped
+	pthread_mutex_lock(&disk_lock);
+	flush_locked();
+	free_buffers();
+
+	if(n==0) {
+		pthread_mutex_unlock(&disk_lock);
+		return 1;                  //cache disabled, every access goes to the disk
+	}
+
+	int ns   = DISK_STREAM_FRAMES;
+	frames   = malloc(n*sizeof(struct cache_frame));
+	frame_of = malloc(nblocks*sizeof(int));
+	slots    = calloc(ns, sizeof(struct stream_slot));
+	slot_of  = malloc(nblocks*sizeof(int));
+	if(posix_memalign((void**)&frame_data, DISK_BLOCK_SIZE, (size_t)n*DISK_BLOCK_SIZE)!=0) {
+		frame_data = 0;
+	}
+	if(posix_memalign((void**)&slot_data, DISK_BLOCK_SIZE, (size_t)ns*DISK_BLOCK_SIZE)!=0) {
+		slot_data = 0;
+	}
+	if(!frames || !frame_of || !frame_data || !slots || !slot_of || !slot_data) {
+		free_buffers();
+		pthread_mutex_unlock(&disk_lock);
+		return 0;
+	}
+	for(int i=0;i<nblocks;i++) {
+		frame_of[i] = -1;
+		slot_of[i]  = -1;
+	}
+	for(int f=0;f<n;f++) {
+		frames[f].data = frame_data+(size_t)f*DISK_BLOCK_SIZE;
+	}
+	for(int s=0;s<ns;s++) {
+		slots[s].data = slot_data+(size_t)s*DISK_BLOCK_SIZE;
+	}
+	nframes = n;
+	nslots  = ns;
+	pthread_mutex_unlock(&disk_lock);
+
+	return 1;
+}
+
+//blocks read from and written to the image since it was opened
+void disk_counts( int *reads, int *writes )
+{
+	*reads  = __atomic_load_n(&nreads, __ATOMIC_RELAXED);
+	*writes = __atomic_load_n(&nwrites, __ATOMIC_RELAXED);
+}
+
 void disk_close()
 {
-	if(diskfile) {
+	if(diskfd>=0) {
+		aio_stop();
+		stop_threads();
+		disk_flush();
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+		printf("%d cache hits, %d cache misses, %d dirty write backs\n",nhits,nmisses,nwritebacks);
+		printf("%d blocks read ahead, %d stream buffer hits\n",nprefetched,nstream_hits);
+		if(mapping) {
+			munmap(mapping, (size_t)nblocks*DISK_BLOCK_SIZE);
+			mapping = 0;
+		}
+		close(diskfd);
+		diskfd = -1;
 	}
+	pthread_mutex_lock(&disk_lock);
+	free_buffers();
+	pthread_mutex_unlock(&disk_lock);
 }
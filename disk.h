@@ -2,12 +2,38 @@
 #define DISK_H
 
 #define DISK_BLOCK_SIZE 4096
+#define DISK_CACHE_FRAMES 256    //default number of cached blocks (1 MiB)
+#define DISK_STREAM_FRAMES 512   //blocks held for read-ahead and write-behind (2 MiB)
+#define DISK_QUEUE_DEPTH  32     //asynchronous requests that can be in flight
+
+//flags for disk_open
+#define DISK_DIRECT 1            //open the image with O_DIRECT, bypassing the page cache
+#define DISK_MMAP   2            //map the whole image into memory
+#define DISK_NO_URING 4          //run asynchronous requests on threads even if io_uring works
 
 int  disk_init( const char *filename, int nblocks );
+int  disk_open( const char *filename, int nblocks, int flags );
 int  disk_size();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+const char *disk_block_ptr( int blocknum );
+void disk_block_put( int blocknum );
+void disk_readv( int blocknum, int count, char *data );
+void disk_writev( int blocknum, int count, const char *data );
+void disk_prefetch( int blocknum, int count );
+
+//asynchronous block I/O. a request moves count contiguous blocks and
+//completes in the background; its buffer and blocks must be left alone
+//until then. requests submitted with a tag are reported by disk_poll,
+//disk_drain waits for all of them
+int  disk_submit( int write, int blocknum, int count, char *data, void *tag );
+int  disk_poll( void **tags, int max, int wait );
+void disk_drain();
+void disk_flush();
+void disk_sync();
+int  disk_cache_init( int nframes );
+void disk_counts( int *reads, int *writes );
 void disk_close();
 
 
-#endif
\ No newline at end of file
+#endif
@@ -1,848 +1,3159 @@
 #include "fs.h"
 #include "disk.h"
+#include "journal.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
-#define POINTERS_PER_INODE 5
+#define FS_MAGIC           0xf0f03414
+#define FS_CLEAN           1     //superblock state: not mounted, or unmounted cleanly
+#define FS_INLINE          1     //inode flag: the file's data is kept in the inode
+#define INODES_PER_BLOCK   32
+#define INLINE_DATA_SIZE   100
+#define EXTENTS_PER_INODE  3
+#define EXTENTS_PER_BLOCK  341
 #define POINTERS_PER_BLOCK 1024
-#define DIR_PATH_SIZE      20
-#define FILE_NAME_SIZE     24
+#define MAX_EXTENT_DEPTH   2
+#define MAX_FILE_BLOCKS    (1<<30)
+#define FILE_NAME_SIZE     FS_NAME_SIZE
 #define DIR_ENTRIES_PER_BLOCK 128
+#define DX_ENTRIES_PER_BLOCK  510
+#define READAHEAD_MIN      8
+#define READAHEAD_MAX      256
+#define MOUNT_READ_BLOCKS  32
+#define DCACHE_MAX         65536 //cached names, the least recently used go first
+#define BLOCKS_PER_GROUP   4096  //bits under one summary word of the bitmap
+#define GROUPS_PER_BLOCK   64
+#define GROUP_BLOCKS       1     //block bitmap of a group changed
+#define GROUP_INODES       2     //inode bitmap of a group changed
 
 struct fs_superblock {
 	int magic;
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int blocks_per_group;
+	int ngroups;
+	int group_inode_blocks;   //inode blocks in every group
+	int group_table_blocks;   //blocks of group descriptors after the superblock
+	int journal_start;        //metadata journal, after the group table
+	int journal_blocks;
+	int state;                //FS_CLEAN, or 0 while mounted and after a crash
 };
 
-union attributes {
-	int direct[POINTERS_PER_INODE];
-	char dir_name[DIR_PATH_SIZE];
+//the disk is split into block groups of blocks_per_group blocks, the last
+//one taking up the rest. every group starts with its block bitmap, its
+//inode bitmap and its slice of the inode table followed by its data blocks,
+//group 0 has the superblock, the group descriptor table and the journal in
+//front. files are placed in the group of their directory so their inodes,
+//directory entries and data stay close together
+struct fs_group {
+	int start;                //first block of the group
+	int nblocks;
+	int block_bitmap;         //one bit per block of the group, set if in use
+	int inode_bitmap;         //one bit per inode of the group
+	int inode_start;          //first block of its inode table slice
+	int data_start;           //first data block
+	int free_blocks;
+	int free_inodes;
+	int ndirs;
+	int reserved[7];
+};
+
+//a run of contiguous disk blocks backing contiguous blocks of a file
+struct fs_extent {
+	int logical;      //first file block covered
+	int start;        //first disk block
+	int length;       //number of blocks
 };
 
+//files and directories keep their extents sorted by logical block. the first
+//ones live in the inode and the rest in the extent tree rooted at indirect.
+//a file of at most INLINE_DATA_SIZE bytes keeps its data in place of the
+//extents instead, with FS_INLINE set and no extents, until it grows past
+//that and its data moves to a block
 struct fs_inode {
 	int isvalid;
-	int size;
-	union attributes attr;
-	int indirect;
+	int nextents;
+	int64_t size;             //bytes for a file, number of entries for a directory
+	int parent;               //directories: inode no of the parent directory
+	int depth;                //levels of index blocks in the extent tree
+	int flags;
+	union {
+		struct {
+			struct fs_extent extent[EXTENTS_PER_INODE];
+			int indirect;
+		};
+		char data[INLINE_DATA_SIZE];    //FS_INLINE: bytes past size are zero
+	};
+};
+
+//the extents of a file or directory while they are worked on in memory
+struct extent_list {
+	struct fs_extent *ext;
+	int n;
+	int cap;
+	int held;                 //blocks in the extent tree on disk
+	int spare[4];             //blocks set aside for the tree to grow into
+	int nspare;
+	int dir;                  //the blocks hold a directory, so they are metadata
 };
 
+//directory entries live in leaf blocks of DIR_ENTRIES_PER_BLOCK slots, a slot
+//with an empty name is free. a directory starts out as a single leaf. when
+//that leaf fills up the directory becomes a hashed b-tree: block 0 turns into
+//the index root and the entries are spread over new leaves by the hash of
+//their name, so any directory with more than one block is indexed.
+//index nodes hold (hash, block) pairs sorted by hash, an entry covering the
+//hashes up to the next one. the root points either at leaves or at one level
+//of inner index nodes, so a lookup reads at most three blocks. names with
+//equal hashes always share a leaf
 struct dir_block {
 	char name[FILE_NAME_SIZE];
 	int type;
 	int inode_num;
 };
 
+struct dx_entry {
+	unsigned hash;            //lowest hash covered
+	int block;                //logical block in the directory
+};
+
+struct dx_node {
+	int levels;               //root only: levels of inner nodes below it, 0 or 1
+	int count;
+	int reserved[2];
+	struct dx_entry entry[DX_ENTRIES_PER_BLOCK];
+};
+
 union fs_block {
 	struct fs_superblock super;
+	struct fs_group group[GROUPS_PER_BLOCK];
 	struct fs_inode inode[INODES_PER_BLOCK];
+	struct fs_extent extent[EXTENTS_PER_BLOCK];
 	int pointers[POINTERS_PER_BLOCK];
 	char data[DISK_BLOCK_SIZE];
 	struct dir_block dir[DIR_ENTRIES_PER_BLOCK];
+	struct dx_node dx;
+};
+
+//allocation bitmap with one bit per item packed into 64 bit words.
+//a summary word keeps one bit per bitmap word which is set once that word is
+//full, so a search skips 64 full words (4096 items) with a single test.
+//the inode slices of neighbouring groups can share a summary word while
+//their groups are locked separately, so summary bits change with atomics
+struct fs_bitmap {
+	uint64_t *words;
+	uint64_t *full;
+	int nbits;
+	int nwords;
+	int nfree;
+	int cursor;            //next fit: searches resume after the last allocation
 };
 
-static int *bitmap;
+static struct fs_bitmap bitmap;   //free block bitmap
+static struct fs_bitmap inode_map; //free inode bitmap
 static int  is_mounted;
 
-int minimum(int a, int b) {
-	return a<b?a:b;
-}
+//superblock and inode table are kept in memory while the file system is mounted.
+//changed inodes are marked dirty and only their blocks are written back
+static struct fs_superblock super;
+static struct fs_inode *inode_table;
+static char *inode_dirty;         //one flag per inode
+static char *inode_block_dirty;   //one flag per inode block
+static struct fs_group *groups;   //group descriptors, free counts change with atomics
+static int  *group_cursor;        //next fit position in every group
+static char groups_dirty;         //descriptors changed since they were written
+static char *group_dirty;         //GROUP_BLOCKS and GROUP_INODES flags of every group
+
+//dentry cache: results of name lookups hashed by (parent inode, name).
+//a miss scans the directory once and caches the answer, including "not
+//there" as an entry with inumber -1. create, delete, mkdir and rmdir keep
+//cached entries current. entries sit on an lru list and the least recently
+//used one is dropped once DCACHE_MAX are cached. every directory also lists
+//its own entries, so they are freed together when the directory is removed
+//and a new directory reusing its inode starts with none
+struct dentry {
+	int parent;
+	int inumber;              //-1 for a cached negative result
+	int type;
+	char name[FILE_NAME_SIZE];
+	struct dentry *next, **pprev;             //hash chain
+	struct dentry *lru_next, *lru_prev;       //most recently used first
+	struct dentry *dir_next, **dir_pprev;     //entries of the same parent
+};
 
-int fs_format()
-{
-	int disk_blocks         = disk_size();
-	union fs_block block;
-	int cur_disk_block       = 0;
-	memset(block.data, 0, sizeof(block));
-	block.super.magic        = FS_MAGIC;
-	block.super.nblocks      = disk_blocks;
-	block.super.ninodeblocks = disk_blocks*0.1+1;
-	block.super.ninodes      = block.super.ninodeblocks*INODES_PER_BLOCK;
-	disk_write(0, block.data);     //super block written
-	cur_disk_block++;
+static struct dentry **dcache;
+static int  dcache_buckets;
+static int  dcache_count;
+static struct dentry dcache_lru = { .lru_next = &dcache_lru, .lru_prev = &dcache_lru };
+static struct dentry **dcache_dir;            //entries of every directory inode
+
+//read-ahead state of every inode. a read that starts where the previous one
+//ended doubles the window of blocks loaded ahead of it, up to READAHEAD_MAX.
+//any other read closes the window until reads are sequential again
+struct readahead {
+	int64_t next;             //byte offset a sequential read starts at
+	int window;               //blocks to keep loading past the end of a read
+	int issued;               //file blocks before this one were already requested
+};
 
-	//Making isvalid flag 0 for all the inodes
-	int num_inode_blocks     = block.super.ninodeblocks;
-	memset(block.data, 0, sizeof(block));
-	
-	for(int i=0;i<num_inode_blocks;i++) {
-		disk_write(cur_disk_block, block.data);
-		cur_disk_block++;
-	}
+static struct readahead *readahead;
+
+//concurrency. format and mount hold mount_lock exclusively, every other
+//call shares it. name space operations and lookups are serialized by
+//ns_lock, which also guards directories, the dentry cache and the inode map.
+//file data and sizes are guarded by a rwlock per inode: reads share it,
+//writes and truncates hold it exclusively and releasing an inode takes it to
+//wait out calls still using it. inode blocks are put together from the inode
+//table and written under a latch per inode block, so threads changing
+//inodes that share a block can't write it back out of order. the block
+//allocator locks one block group at a time, so threads filling files in
+//different groups don't contend. calls that change anything also hold a
+//journal handle, which a commit may wait for.
+//lock order: mount_lock, journal handle, ns_lock, inode locks, inode block
+//latches, group table latch, groups
+static pthread_rwlock_t mount_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t  ns_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t *inode_lock;    //one per inode
+static pthread_mutex_t  *inode_latch;   //one per inode block
+static pthread_mutex_t  *group_lock;    //one per block group
+static pthread_mutex_t  group_latch = PTHREAD_MUTEX_INITIALIZER;   //writing the group table
 
-	//creating root directory in the file system after formatting
-	disk_read(1, block.data);
-	block.inode[0].isvalid = 2;
-	block.inode[0].indirect = 1+num_inode_blocks;
-	block.inode[0].size = 0;
-	strcpy( block.inode[0].attr.dir_name, "root");
-	disk_write(1,block.data);
+int minimum(int a, int b) {
+	return a<b?a:b;
+}
 
-	return 1;
+int maximum(int a, int b) {
+	return a>b?a:b;
+}
 
+//helper fn
+//index of the inode block holding the given inode, counting the inode
+//blocks of all groups in order
+static int inode_block_of(int inumber) {
+	return inumber/INODES_PER_BLOCK;
 }
 
-void fs_debug()
-{
-	if(is_mounted == 0) {
-		printf("File system not mounted\n");
-		return;
-	}
-	union fs_block block;
+//helper fn
+//disk block of inode block bl
+static int inode_block_disk(int bl) {
+	return groups[bl/super.group_inode_blocks].inode_start+bl%super.group_inode_blocks;
+}
 
-	disk_read(0,block.data);
+//helper fn
+static int group_of_inode(int inumber) {
+	return inumber/(super.group_inode_blocks*INODES_PER_BLOCK);
+}
 
-	printf("superblock:\n");
-	if(block.super.magic == 0xf0f03410) {
-		printf("    magic number is valid\n");
-	} else {
-		printf("    magic number is invalid.Disk corrupted.Abort\n");
-		return;
-	}
-	printf("    %d blocks on disk\n",block.super.nblocks);
-	printf("    %d inode blocks for inodes\n",block.super.ninodeblocks);
-	printf("    %d inodes total\n",block.super.ninodes);
+//helper fn
+//the last group may be longer than the others
+static int group_of_block(int blocknum) {
+	return minimum(blocknum/super.blocks_per_group, super.ngroups-1);
+}
 
-	
-	int num_inode_blocks = block.super.ninodeblocks;
-	int cur_inode        = 0;  
-	for(int bl=1; bl<= num_inode_blocks; bl++) {
-		disk_read(bl, block.data);
-		for(int i=0;i<INODES_PER_BLOCK;i++) {
-			if(block.inode[i].isvalid==1) { //file
-
-				struct fs_inode inode = block.inode[i];
-				printf("inode %d\n", cur_inode);
-				printf("    %d size\n", inode.size);
-				if(inode.size>0) {
-					printf("    direct blocks: ");
-					for(int i=0; i<POINTERS_PER_INODE; i++) {
-						if(inode.attr.direct[i]!= 0) {
-							printf("%d ", inode.attr.direct[i]);
-						}
-					}
-					printf("\n");
-
-					if(inode.indirect!=0) {
-						int indirect_block = inode.indirect;
-						printf("    indirect block: %d\n", indirect_block);
-						disk_read(indirect_block, block.data);
-						printf("    indirect data blocks: ");
-						for(int j=0;j<POINTERS_PER_BLOCK;j++) {
-							if(block.pointers[j]!=0) {
-								printf("%d ",block.pointers[j]);
-							}
-						}
-						printf("\n");
-						disk_read(bl, block.data);
-					}
-		        }
-
-			} else if(block.inode[i].isvalid==2) {   //directory
-				struct fs_inode inode = block.inode[i];
-				printf("inode %d\n", cur_inode);
-				printf("    %d size\n", inode.size);
-				printf("    directory name %s\n", inode.attr.dir_name);
-				printf("    directory block %d\n", inode.indirect);
-
-				if(inode.size>0) {
-					printf("    directory contents:\n");
-					int indirect_block = inode.indirect;
-					int sz             = inode.size;
-					disk_read(indirect_block, block.data);
-					for(int j=0;j<sz;j++) {
-						if(block.dir[j].type==1) {
-							printf("    directory name: ");
-						} else {
-							printf("    file name: ");
-						}
-						printf("%s\t",block.dir[j].name);
-						printf("inode: %d\n", block.dir[j].inode_num);
-					}
-					disk_read(bl, block.data);
-				}
+//helper fn
+//k-th group to try when g is the first choice: g itself, then its
+//neighbours on either side moving outwards
+static int group_near(int g, int k) {
+	int d = (k%2) ? (k+1)/2 : -(k/2);
+	return ((g+d)%super.ngroups+super.ngroups)%super.ngroups;
+}
 
+//helper fn
+//adds delta to a free count of a group descriptor
+static void group_count(int *count, int delta) {
+	__atomic_fetch_add(count, delta, __ATOMIC_RELAXED);
+	__atomic_store_n(&groups_dirty, 1, __ATOMIC_RELAXED);
+}
 
-			}
-			cur_inode++;
-		}
-	}
+//helper fn
+//notes that a bitmap of group g changed, called with its group lock held
+static void group_mark(int g, int what) {
+	__atomic_fetch_or(&group_dirty[g], what, __ATOMIC_RELAXED);
+	__atomic_store_n(&groups_dirty, 1, __ATOMIC_RELAXED);
 }
-	
 
-int fs_mount()
-{
-	union fs_block block;
+//helper fn
+static int is_valid_inumber(int inumber) {
+	return inumber>=0 && inumber<super.ninodes;
+}
 
-	disk_read(0,block.data);
+//helper fn
+static void inode_mark_dirty(int inumber) {
+	int bl = inode_block_of(inumber);
+	pthread_mutex_lock(&inode_latch[bl]);
+	inode_dirty[inumber]  = 1;
+	__atomic_store_n(&inode_block_dirty[bl], 1, __ATOMIC_RELAXED);   //read without the latch by inode_sync
+	pthread_mutex_unlock(&inode_latch[bl]);
+}
 
-	if(block.super.magic != 0xf0f03410) {
-		return 0;                                   //valid file system not present
-	}
-	bitmap = (int*)malloc(disk_size()*sizeof(int)); //initializing bitmap
-    if(bitmap == NULL) {
-    	return 0;                                  //could not allocate memory for bitmap
-    }
-    memset(bitmap,0,disk_size());
-    bitmap[0] = 1;                                 //disk 0 superblock is always allocated
-
-	int num_inode_blocks = block.super.ninodeblocks;
-
-	for(int bl=1; bl<= num_inode_blocks; bl++) {
-		disk_read(bl, block.data);
-		bitmap[bl] = 1;
-		for(int i=0;i<INODES_PER_BLOCK;i++) {
-			if(block.inode[i].isvalid==1) {
-				struct fs_inode inode = block.inode[i];
-				if(inode.size>0) {
-					for(int i=0; i<POINTERS_PER_INODE; i++) {
-						if(inode.attr.direct[i]!= 0) {
-							bitmap[inode.attr.direct[i]]=1; //updating bitmap with occupied disk data
-						}
-					}
-					
-					if(inode.indirect!=0) {
-						int indirect_block = inode.indirect;
-						bitmap[indirect_block]=1;
-						disk_read(indirect_block, block.data);
-						for(int j=0;j<POINTERS_PER_BLOCK;j++) {
-							if(block.pointers[j]!=0) {
-								bitmap[block.pointers[j]]=1;
-							}
-						}
-						disk_read(bl, block.data);
-					}
-		        }
-			} else if(block.inode[i].isvalid==2) {
-				struct fs_inode inode = block.inode[i];
-				bitmap[inode.indirect]=1;
-			}
-		}
+//helper fn
+//metadata (inode blocks, the group table, directory and extent tree blocks)
+//is written through the journal, so a block may have a newer version there
+//than on disk
+static void meta_read(int blocknum, char *data) {
+	if(!journal_read(blocknum, data)) {
+		disk_read(blocknum, data);
 	}
-
-	
-	
-    is_mounted = 1;
-	return 1;
 }
 
-//creates a file.  parent directory inode no and file name should be provided
-int fs_create(int dir_inode_no, char* file_name)
-{
-	if(is_mounted == 0) {
-		printf("File system not mounted\n");
-		return -1;
-	}
-	
-	union fs_block block;
-	int cur_disk_block = 0;
-	disk_read(0,block.data);
-	cur_disk_block++;
+//helper fn
+static void meta_write(int blocknum, const char *data) {
+	journal_write(blocknum, data);
+}
 
-	int num_inode_blocks = block.super.ninodeblocks;
-	
-	int inode_idx = 0;
-    int file_inode_block = 0;
-	for(int i=1; i<=num_inode_blocks; i++) {
-		disk_read(i, block.data);
-		for(int j=0;j<INODES_PER_BLOCK; j++) {
-			if(block.inode[j].isvalid == 0) {
-				block.inode[j].isvalid=1;
-				block.inode[j].size=0;
-				for(int k=0;k<POINTERS_PER_INODE;k++) {
-					block.inode[j].attr.direct[k]=0;
-				}
-				block.inode[j].indirect=0;
-				//disk_write(i, block.data);
-				file_inode_block = i;
-				break;
-			}
-			
-			inode_idx++;
+//helper fn
+//starts reading count metadata blocks into data. blocks the journal has a
+//newer version of are copied from it, runs of the others are read
+//asynchronously and waited for with disk_drain
+static void meta_submit(int blocknum, int count, char *data) {
+	int run = 0;
+	for(int i=0; i<=count; i++) {
+		if(i < count && !journal_read(blocknum+i, data+(size_t)i*DISK_BLOCK_SIZE)) {
+			run++;
+			continue;
 		}
-		if(file_inode_block>0) {
-				break;
-			}
-	}
-	if(file_inode_block==0)
-		return -1;   //inode table full
-
-	union fs_block dir_block;
-	union fs_block dir_entry_block;
-	int dir_inode_block     = dir_inode_no/INODES_PER_BLOCK + 1;//first block is superblock
-	int dir_inode_block_idx = dir_inode_no % INODES_PER_BLOCK;
-	disk_read(dir_inode_block, dir_block.data);
-	if((dir_block.inode[dir_inode_block_idx].isvalid!=2) || (dir_block.inode[dir_inode_block_idx].size == DIR_ENTRIES_PER_BLOCK)) {
-		return -1; //Not a directory or directory full
-	} 
-
-	int dir_entry_block_no = dir_block.inode[dir_inode_block_idx].indirect;
-	int dir_size           = dir_block.inode[dir_inode_block_idx].size;
-
-	//checking if duplicate filenames are present
-	disk_read(dir_entry_block_no, dir_entry_block.data);
-	for(int i=0;i<dir_size; i++) {
-		if(strcmp(dir_entry_block.dir[i].name, file_name)==0) {
-			printf("File already exists in the directory\n");
-			return -1;
+		if(run > 0) {
+			disk_submit(0, blocknum+i-run, run, data+(size_t)(i-run)*DISK_BLOCK_SIZE, NULL);
 		}
+		run = 0;
 	}
+}
 
-	strcpy(dir_entry_block.dir[dir_size].name, file_name);
-	dir_entry_block.dir[dir_size].inode_num = inode_idx;
-	dir_entry_block.dir[dir_size].type = 0;
-	disk_write(dir_entry_block_no, dir_entry_block.data);
+//helper fn
+//frees a metadata block. it is handed back to the allocator once the
+//transaction freeing it has committed
+static void meta_free(int blocknum) {
+	journal_free(blocknum);
+}
 
+//helper fn
+static void bitmap_release(struct fs_bitmap *bm) {
+	free(bm->words);
+	free(bm->full);
+	memset(bm, 0, sizeof(*bm));
+}
 
-	dir_block.inode[dir_inode_block_idx].size++;
+//helper fn
+static int bitmap_test(struct fs_bitmap *bm, int i) {
+	return (bm->words[i/64] >> (i%64)) & 1;
+}
 
-	//printf("writing to %d %d %d %d\n",dir_inode_block,dir_inode_block_idx, dir_entry_block_no, dir_size);
-	if(file_inode_block != dir_inode_block) {
-		disk_write(file_inode_block, block.data);
-		
-	} else {
-		dir_block.inode[inode_idx%INODES_PER_BLOCK].isvalid = 1;
-		dir_block.inode[inode_idx%INODES_PER_BLOCK].size = 0;
-		for(int k=0;k<POINTERS_PER_INODE;k++) {
-			dir_block.inode[inode_idx%INODES_PER_BLOCK].attr.direct[k]=0;
-		}
-		dir_block.inode[inode_idx%INODES_PER_BLOCK].indirect=0;
+//helper fn
+static void bitmap_set(struct fs_bitmap *bm, int i) {
+	int w = i/64;
+	uint64_t bit = 1ULL << (i%64);
+	if(bm->words[w] & bit) {
+		return;
+	}
+	bm->words[w] |= bit;
+	__atomic_fetch_sub(&bm->nfree, 1, __ATOMIC_RELAXED);
+	if(bm->words[w] == ~0ULL) {
+		__atomic_fetch_or(&bm->full[w/64], 1ULL << (w%64), __ATOMIC_RELAXED);
 	}
-	disk_write(dir_inode_block, dir_block.data);
-
-	return inode_idx;
-
 }
 
-//inode no of file and inode no of parent directory
-int fs_delete( int inumber, int dir_inode_no)
-{
-	union fs_block block;
-	disk_read(0, block.data);
-	if((inumber<0) || (inumber>=block.super.ninodes)||(is_mounted==0)) {  //invalid inumber input
-		return 0;
+//helper fn
+static void bitmap_clear(struct fs_bitmap *bm, int i) {
+	int w = i/64;
+	uint64_t bit = 1ULL << (i%64);
+	if(!(bm->words[w] & bit)) {
+		return;
 	}
-	int inode_block_num = inumber/INODES_PER_BLOCK+1;
-	int inode_block_idx = inumber%INODES_PER_BLOCK;
+	bm->words[w] &= ~bit;
+	__atomic_fetch_add(&bm->nfree, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_and(&bm->full[w/64], ~(1ULL << (w%64)), __ATOMIC_RELAXED);
+}
 
-	disk_read(inode_block_num, block.data);
-	if(block.inode[inode_block_idx].isvalid == 0) {  //inode already invalid(free)
+//helper fn
+//all bits start clear. padding bits past nbits are set so they are never handed out
+static int bitmap_init(struct fs_bitmap *bm, int nbits) {
+	int nwords = (nbits+63)/64;
+	int nfull  = (nwords+63)/64;
+	bm->words  = calloc(nwords, sizeof(uint64_t));
+	bm->full   = calloc(nfull, sizeof(uint64_t));
+	if(bm->words == NULL || bm->full == NULL) {
+		bitmap_release(bm);
 		return 0;
 	}
-
-	block.inode[inode_block_idx].isvalid = 0;
-	for(int i=0; i<POINTERS_PER_INODE; i++) {
-		if(block.inode[inode_block_idx].attr.direct[i]!=0) {
-			bitmap[block.inode[inode_block_idx].attr.direct[i]] = 0; //freeing direct blocks
-			block.inode[inode_block_idx].attr.direct[i]         = 0;
-		}
+	bm->nbits  = nbits;
+	bm->nwords = nwords;
+	bm->nfree  = nbits;
+	bm->cursor = 0;
+	if(nbits%64) {
+		bm->words[nwords-1] = ~0ULL << (nbits%64);
+	}
+	if(nwords%64) {
+		bm->full[nfull-1] = ~0ULL << (nwords%64);
 	}
+	if(bm->words[nwords-1] == ~0ULL) {
+		bm->full[(nwords-1)/64] |= 1ULL << ((nwords-1)%64);
+	}
+	return 1;
+}
 
-	int indirect_block = block.inode[inode_block_idx].indirect;
-	block.inode[inode_block_idx].size = 0;
-	disk_write(inode_block_num, block.data);
-	
-	if(indirect_block != 0) {
-		disk_read(indirect_block, block.data);
-		for(int i=0;i<POINTERS_PER_BLOCK;i++) {
-			if(block.pointers[i]!=0) {                  //freeing indirect blocks
-				bitmap[block.pointers[i]] = 0;
-				block.pointers[i]         = 0;
-			}
+//helper fn
+//number of clear bits in [lo, hi)
+static int bitmap_count_zero(struct fs_bitmap *bm, int lo, int hi) {
+	int count = 0;
+	for(int i=lo; i<hi; ) {
+		if(i%64 == 0 && i+64 <= hi) {
+			count += 64-__builtin_popcountll(bm->words[i/64]);
+			i     += 64;
+		} else {
+			count += !bitmap_test(bm, i);
+			i++;
 		}
-
-		disk_write(indirect_block, block.data);
 	}
+	return count;
+}
 
-	//removing entry from directory
-	int dir_inode_block_idx = dir_inode_no % INODES_PER_BLOCK;
-	int dir_block_idx       = dir_inode_no/INODES_PER_BLOCK+1;
-	
-
-	disk_read(dir_block_idx, block.data);
-	int dir_entry_block_idx = block.inode[dir_inode_block_idx].indirect;
-	int dir_entry_sz        = block.inode[dir_inode_block_idx].size;
-	block.inode[dir_inode_block_idx].size--;
-	disk_write(dir_block_idx, block.data);
+//helper fn
+//copies the bits [lo, lo+count) into a bitmap block, lo being a multiple
+//of 64. the rest of the block reads as in use
+static void bitmap_store(struct fs_bitmap *bm, int lo, int count, char *data) {
+	memset(data, 0xff, DISK_BLOCK_SIZE);
+	memcpy(data, &bm->words[lo/64], (count+63)/64*sizeof(uint64_t));
+	if(count%64) {
+		((uint64_t*)data)[count/64] |= ~0ULL << (count%64);
+	}
+}
 
-	if(dir_entry_sz>1) {
-		disk_read(dir_entry_block_idx, block.data);
+//helper fn
+//copies a bitmap block written by bitmap_store back into the bits
+//[lo, lo+count). bitmap_restore has to be called once all are loaded
+static void bitmap_load(struct fs_bitmap *bm, int lo, int count, const char *data) {
+	memcpy(&bm->words[lo/64], data, (count+63)/64*sizeof(uint64_t));
+}
 
-		for(int i=0;i<dir_entry_sz; i++) {
-			if(block.dir[i].inode_num==inumber) {
-				for(int j=i+1;j<dir_entry_sz;j++) {
-					block.dir[j-1]=block.dir[j];
-				}
-				break;
-			}
+//helper fn
+//works out the free count and the summary words again after the words
+//were loaded from disk
+static void bitmap_restore(struct fs_bitmap *bm) {
+	int nfull = (bm->nwords+63)/64;
+	if(bm->nbits%64) {
+		bm->words[bm->nwords-1] |= ~0ULL << (bm->nbits%64);
+	}
+	memset(bm->full, 0, nfull*sizeof(uint64_t));
+	if(bm->nwords%64) {
+		bm->full[nfull-1] = ~0ULL << (bm->nwords%64);
+	}
+	bm->nfree = 0;
+	for(int w=0; w<bm->nwords; w++) {
+		bm->nfree += 64-__builtin_popcountll(bm->words[w]);
+		if(bm->words[w] == ~0ULL) {
+			bm->full[w/64] |= 1ULL << (w%64);
 		}
-		disk_read(dir_entry_block_idx, block.data);
-    }
-
-
-
-
-	return 1;
+	}
 }
 
-int fs_getsize( int inumber )
-{
-	union fs_block block;
-	disk_read(0, block.data);
-	if((inumber<0) || (inumber>=block.super.ninodes)||(is_mounted==0)) {  //invalid inumber input
+//helper fn
+//returns the first clear bit in [from, to), -1 if there is none. the search
+//reads no word past to, rounded up to a multiple of 64 words
+static int bitmap_find_zero(struct fs_bitmap *bm, int from, int to) {
+	to = minimum(to, bm->nbits);
+	if(from >= to) {
 		return -1;
 	}
-	int inode_block_num = inumber/INODES_PER_BLOCK+1;
-	int inode_block_idx = inumber%INODES_PER_BLOCK;
+	int w    = from/64;
+	int wend = (to+63)/64;
+	int i    = -1;
+	int scanned = 1;
+	uint64_t free_bits = ~bm->words[w] & (~0ULL << (from%64));
+	if(free_bits) {
+		i = w*64 + __builtin_ctzll(free_bits);
+	}
+	w++;
+	while(i == -1 && w < wend) {
+		scanned++;
+		int s = w/64;
+		uint64_t not_full = ~__atomic_load_n(&bm->full[s], __ATOMIC_RELAXED) & (~0ULL << (w%64));
+		if(not_full == 0) {
+			w = (s+1)*64;             //next 64 words are all full
+			continue;
+		}
+		w = s*64 + __builtin_ctzll(not_full);
+		if(w < wend) {
+			i = w*64 + __builtin_ctzll(~bm->words[w]);
+		}
+	}
+	stats_scan(scanned);
+	return i < to ? i : -1;
+}
 
-	disk_read(inode_block_num, block.data);
-	if(block.inode[inode_block_idx].isvalid == 0) {  //inode is free
+//helper fn
+//allocates a clear bit in [lo, hi) searching from the cursor and wrapping
+//around to lo. returns -1 if all bits are set
+static int bitmap_alloc(struct fs_bitmap *bm, int lo, int hi) {
+	if(__atomic_load_n(&bm->nfree, __ATOMIC_RELAXED) == 0) {
 		return -1;
 	}
-
-	return block.inode[inode_block_idx].size;
+	int cursor = __atomic_load_n(&bm->cursor, __ATOMIC_RELAXED);
+	int start  = cursor < lo || cursor >= hi ? lo : cursor;
+	int i = bitmap_find_zero(bm, start, hi);
+	if(i == -1 && start > lo) {
+		i = bitmap_find_zero(bm, lo, hi);
+	}
+	if(i == -1) {
+		return -1;
+	}
+	bitmap_set(bm, i);
+	__atomic_store_n(&bm->cursor, i+1, __ATOMIC_RELAXED);
+	return i;
 }
 
-int fs_read( int inumber, char *data, int length, int offset )
-{
-	memset(data,0,length*sizeof(data[0]));
-	union fs_block block;
-	disk_read(0, block.data);
-	if((inumber<0) || (inumber>=block.super.ninodes)||(length==0)||(is_mounted==0)) {  //invalid inumber input
-		return 0;
+//helper fn
+//length of the run of clear bits starting at i, counting at most max
+static int bitmap_zero_run(struct fs_bitmap *bm, int i, int max) {
+	int len = 0;
+	while(len < max && i < bm->nbits) {
+		int b = i%64;
+		uint64_t bits = bm->words[i/64] >> b;
+		int run = bits ? __builtin_ctzll(bits) : 64-b;
+		len += run;
+		i   += run;
+		if(bits) {
+			break;                    //hit a set bit
+		}
 	}
+	return minimum(len, max);
+}
 
-	int inode_block_num = inumber/INODES_PER_BLOCK+1;
-	int inode_block_idx = inumber%INODES_PER_BLOCK;
-
-	disk_read(inode_block_num, block.data);
-	if((block.inode[inode_block_idx].isvalid == 0)||(offset>=block.inode[inode_block_idx].size)) {  
-		return 0;
+//helper fn
+//allocates a run of up to want clear bits in [lo, hi). the search starts
+//at goal and wraps around to lo, taking the first run that is long enough
+//or else the longest one seen. returns the first bit and stores the run
+//length in got, or returns -1 if all bits are set
+static int bitmap_alloc_run(struct fs_bitmap *bm, int lo, int hi, int goal, int want, int *got) {
+	*got = 0;
+	if(__atomic_load_n(&bm->nfree, __ATOMIC_RELAXED) == 0 || want <= 0) {
+		return -1;
 	}
-
-	struct fs_inode inode = block.inode[inode_block_idx];
-
-	//Assuming that indirect disk blocks are filled only after all the direct disk blocks are filled
-	int begin_disk_num        = offset/DISK_BLOCK_SIZE;
-	int last_byte             = minimum(offset+length-1, inode.size-1);
-	int end_disk_num          = last_byte/DISK_BLOCK_SIZE;
-	int bytes_copied          = minimum(length, (inode.size-offset));
-
-	
-	union fs_block indirect_block;
-
-	if(end_disk_num>=POINTERS_PER_INODE) {
-		disk_read(inode.indirect, indirect_block.data);
+	if(goal < lo || goal >= hi) {
+		goal = lo;
 	}
 
-	for(int i=begin_disk_num;i<=end_disk_num;i++) {
-		if(i >= POINTERS_PER_INODE) {
-            disk_read(indirect_block.pointers[i-POINTERS_PER_INODE], block.data);
-		} else {
-			disk_read(inode.attr.direct[i], block.data);
-		}
-		if(i==begin_disk_num) {
-			int strt_byte = offset%DISK_BLOCK_SIZE;
-			if(i==end_disk_num) {
-				char str[DISK_BLOCK_SIZE];
-				memset(str,0,sizeof(str));
-				int end_byte = (strt_byte+bytes_copied-1)%DISK_BLOCK_SIZE;
-				int cur = 0;
-				for(int i=strt_byte;i<=end_byte;i++) {
-					str[cur++] = block.data[i];
-				}
-                strcat(data, str);
-			} else {
-				char* str;
-				str = block.data+ strt_byte;
-				strcat(data, str);
-		    }
-			
-		} else if(i==end_disk_num) {
-			int strt_byte = offset%DISK_BLOCK_SIZE;
-			char str[DISK_BLOCK_SIZE];
-			memset(str,0,DISK_BLOCK_SIZE*sizeof(str[0]));
-			int end_byte = (bytes_copied-(DISK_BLOCK_SIZE-strt_byte)-1)%DISK_BLOCK_SIZE;
-			for(int j=0;j<=end_byte;j++) {
-				str[j] = block.data[j];
+	int best = -1, best_len = 0;
+	int from = goal, wrapped = 0;
+	while(best_len < want) {
+		int i = bitmap_find_zero(bm, from, hi);
+		if(wrapped && (i == -1 || i >= goal)) {
+			break;
+		}
+		if(i == -1) {
+			if(goal == lo) {
+				break;
 			}
-			strcat(data, str);
-
-
-		} else {
-			strcat(data, block.data);
+			wrapped = 1;
+			from    = lo;
+			continue;
 		}
+		int len = bitmap_zero_run(bm, i, minimum(want, hi-i));
+		if(len > best_len) {
+			best     = i;
+			best_len = len;
+		}
+		from = i+len;
 	}
 
-	return bytes_copied;
+	for(int i=0; i<best_len; i++) {
+		bitmap_set(bm, best+i);
+	}
+	__atomic_store_n(&bm->cursor, best+best_len, __ATOMIC_RELAXED);
+	*got = best_len;
+	return best;
 }
 
 //helper fn
-void bitmap_status() {
-	for(int i=0;i<disk_size();i++){
-		printf("%d ",bitmap[i]);
+//writes the group descriptor table and the bitmap blocks that changed. a
+//bitmap block is copied under its group lock, and the latch keeps the
+//copies taken by concurrent calls in order
+static void group_sync() {
+	if(__atomic_load_n(&groups_dirty, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	union fs_block block;
+	int per = super.group_inode_blocks*INODES_PER_BLOCK;
+	pthread_mutex_lock(&group_latch);
+	__atomic_store_n(&groups_dirty, 0, __ATOMIC_RELAXED);
+	for(int b=0; b<super.group_table_blocks; b++) {
+		memset(block.data, 0, sizeof(block));
+		for(int i=0; i<GROUPS_PER_BLOCK && b*GROUPS_PER_BLOCK+i<super.ngroups; i++) {
+			struct fs_group *g = &groups[b*GROUPS_PER_BLOCK+i];
+			block.group[i].start        = g->start;
+			block.group[i].nblocks      = g->nblocks;
+			block.group[i].block_bitmap = g->block_bitmap;
+			block.group[i].inode_bitmap = g->inode_bitmap;
+			block.group[i].inode_start  = g->inode_start;
+			block.group[i].data_start   = g->data_start;
+			block.group[i].free_blocks  = __atomic_load_n(&g->free_blocks, __ATOMIC_RELAXED);
+			block.group[i].free_inodes  = __atomic_load_n(&g->free_inodes, __ATOMIC_RELAXED);
+			block.group[i].ndirs        = __atomic_load_n(&g->ndirs, __ATOMIC_RELAXED);
+		}
+		meta_write(1+b, block.data);
+	}
+	for(int g=0; g<super.ngroups; g++) {
+		int what = __atomic_exchange_n(&group_dirty[g], 0, __ATOMIC_RELAXED);
+		if(what & GROUP_BLOCKS) {
+			pthread_mutex_lock(&group_lock[g]);
+			bitmap_store(&bitmap, groups[g].start, groups[g].nblocks, block.data);
+			pthread_mutex_unlock(&group_lock[g]);
+			meta_write(groups[g].block_bitmap, block.data);
+		}
+		if(what & GROUP_INODES) {
+			pthread_mutex_lock(&group_lock[g]);
+			bitmap_store(&inode_map, g*per, per, block.data);
+			pthread_mutex_unlock(&group_lock[g]);
+			meta_write(groups[g].inode_bitmap, block.data);
+		}
 	}
-	printf("\n\n");
+	pthread_mutex_unlock(&group_latch);
 }
 
 //helper fn
-int get_free_block(int num_inode_blocks) {
-	//bitmap_status();
-	int begin_block_search = 1+num_inode_blocks+1;
-	for(int i=begin_block_search;i<disk_size();i++) {
-		if(bitmap[i]==0){
-			bitmap[i] = 1;
-			return i;
+//writes the inode blocks that contain dirty inodes back to disk, then the
+//group table. the latch is held until the block is written, so the disk
+//sees the copies of a block in the order they were taken
+static void inode_sync() {
+	union fs_block block;
+	for(int bl=0; bl<super.ninodeblocks; bl++) {
+		if(__atomic_load_n(&inode_block_dirty[bl], __ATOMIC_RELAXED)==0) {
+			continue;
 		}
+		pthread_mutex_lock(&inode_latch[bl]);
+		if(inode_block_dirty[bl]) {
+			memcpy(block.inode, &inode_table[bl*INODES_PER_BLOCK], sizeof(block.inode));
+			meta_write(inode_block_disk(bl), block.data);
+			memset(&inode_dirty[bl*INODES_PER_BLOCK], 0, INODES_PER_BLOCK);
+			__atomic_store_n(&inode_block_dirty[bl], 0, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&inode_latch[bl]);
 	}
-	return -1;
+	group_sync();
 }
 
-
-int fs_write( int inumber, const char *data, int length, int offset )
-{
-	
-	union fs_block block;
-	disk_read(0, block.data);
-	if((inumber<0) || (inumber>=block.super.ninodes)||(is_mounted==0)) {  //invalid inumber input
-		return 0;
+//helper fn
+//group for a new directory. subdirectories of the root are spread over the
+//groups with the most free blocks, deeper ones stay with their parent unless
+//its group has fewer free blocks than average
+static int group_for_dir(int parent) {
+	int home = group_of_inode(parent);
+	int64_t total = 0;
+	for(int g=0; g<super.ngroups; g++) {
+		total += __atomic_load_n(&groups[g].free_blocks, __ATOMIC_RELAXED);
 	}
-	int num_inode_blocks = block.super.ninodeblocks; 
-	int inode_block_num  = inumber/INODES_PER_BLOCK+1;
-	int inode_block_idx  = inumber%INODES_PER_BLOCK;
-
-	disk_read(inode_block_num, block.data);
-
-	union  fs_block inode_block = block;
-	
-	inode_block.inode[inode_block_idx].isvalid = 1;
-	int strt_disk_num         = offset/DISK_BLOCK_SIZE;
-	int last_byte             = offset+length-1;
-	int end_disk_num          = last_byte/DISK_BLOCK_SIZE;
-	int bytes_copied          = 0;
-
-
-    int cur_idx = 0;
-
-	for(int i=strt_disk_num;i<=end_disk_num;i++) {
-		//bitmap_status();
-		int free_block = get_free_block(num_inode_blocks);
-		if(free_block == -1) {
-			inode_block.inode[inode_block_idx].size+=bytes_copied;
-			disk_write(inode_block_num, inode_block.data);
-			return bytes_copied;
-		}
-		char cur_data[DISK_BLOCK_SIZE];
-		int strt_cp_byte = cur_idx*DISK_BLOCK_SIZE;
-		int end_cp_byte  = minimum((cur_idx+1)*DISK_BLOCK_SIZE-1, length-1);
-		int idx = 0;
-		for(int j=strt_cp_byte; j<=end_cp_byte;j++) {    //copying data to disk
-			cur_data[idx] = data[j];
-			idx++;
-		}
-		
-		if(i<POINTERS_PER_INODE) {                       //direct pointers
-			inode_block.inode[inode_block_idx].attr.direct[i] = free_block;
-		} else {
-			if(inode_block.inode[inode_block_idx].indirect==0) {
-				int indirect_free_ptr_block = get_free_block(num_inode_blocks);
-				if(indirect_free_ptr_block == -1) {   //free block for indirect block pointers not available
-					inode_block.inode[inode_block_idx].size+=bytes_copied;
-					disk_write(inode_block_num, inode_block.data);
-					bitmap[free_block] = 0;
-					return bytes_copied;
-				} else {                  //free block for indirect block pointers not available
-					inode_block.inode[inode_block_idx].indirect = indirect_free_ptr_block;
-					union fs_block indirect_block;
-					memset(indirect_block.pointers,0, POINTERS_PER_BLOCK*sizeof(indirect_block.pointers[0]));
-					indirect_block.pointers[0] = free_block;
-					disk_write(indirect_free_ptr_block, indirect_block.data);
-				}
-			} else {                         //already indirect block pointers allocated
-				union fs_block indirect_block;
-				disk_read(inode_block.inode[inode_block_idx].indirect, indirect_block.data);
-				int j;
-				for(j=0;j<POINTERS_PER_BLOCK;j++) {
-					if(indirect_block.pointers[j]==0) {
-						break;
-					}
-				}
-				if(j==POINTERS_PER_BLOCK) { //maximum file size exceeded
-					inode_block.inode[inode_block_idx].size+=bytes_copied;
-					disk_write(inode_block_num, inode_block.data);
-					return bytes_copied;
-				} else {
-					indirect_block.pointers[j] = free_block;
-					disk_write(inode_block.inode[inode_block_idx].indirect, indirect_block.data);
-				}
-			}
+	if(parent != 0 && (int64_t)__atomic_load_n(&groups[home].free_blocks, __ATOMIC_RELAXED)*super.ngroups >= total) {
+		return home;
+	}
+	int best = home, best_free = -1, best_dirs = 0;
+	for(int k=0; k<super.ngroups; k++) {
+		int g     = group_near(home, k);
+		int nfree = __atomic_load_n(&groups[g].free_blocks, __ATOMIC_RELAXED);
+		int ndirs = __atomic_load_n(&groups[g].ndirs, __ATOMIC_RELAXED);
+		if(__atomic_load_n(&groups[g].free_inodes, __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		if(nfree > best_free || (nfree == best_free && ndirs < best_dirs)) {
+			best      = g;
+			best_free = nfree;
+			best_dirs = ndirs;
 		}
-
-		disk_write(free_block, cur_data);
-		cur_idx++;
-		bytes_copied += (end_cp_byte-strt_cp_byte+1);
 	}
-	inode_block.inode[inode_block_idx].size+=length;
- 	disk_write(inode_block_num, inode_block.data);
- 	fs_debug();
-	return length;
+	return best;
 }
 
 //helper fn
-//returns inode no of the directory
-struct fs_inode get_dir_inode(char* dir_name, int num_inode_blocks) {
-	
-	union fs_block block;
-
-	for(int bl=1; bl<= num_inode_blocks; bl++) {
-		disk_read(bl, block.data);
-		for(int i=0;i<INODES_PER_BLOCK;i++) {
-			if(block.inode[i].isvalid==2 && strcmp(block.inode[i].attr.dir_name,dir_name)==0) {
-				return block.inode[i];
+//allocates an inode for a new file or directory below parent, in the group
+//of the parent for a file or the one picked by group_for_dir, moving on to
+//the neighbouring groups when it has no free inode. within a group the
+//lowest numbered free inode is taken: the cursor of the inode map is moved
+//back whenever an inode is freed, so the search touches only a few words
+static int inode_alloc(int parent, int dir) {
+	int home = dir ? group_for_dir(parent) : group_of_inode(parent);
+	int per  = super.group_inode_blocks*INODES_PER_BLOCK;
+	int searched = 0;
+	for(int k=0; k<super.ngroups; k++) {
+		int g = group_near(home, k);
+		if(__atomic_load_n(&groups[g].free_inodes, __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		pthread_mutex_lock(&group_lock[g]);
+		int inumber = bitmap_alloc(&inode_map, g*per, (g+1)*per);
+		if(inumber != -1) {
+			group_count(&groups[g].free_inodes, -1);
+			group_mark(g, GROUP_INODES);
+			if(dir) {
+				group_count(&groups[g].ndirs, 1);
 			}
-			
+		}
+		pthread_mutex_unlock(&group_lock[g]);
+		searched++;
+		if(inumber != -1) {
+			stats_alloc(FS_ALLOC_INODE, searched);
+			return inumber;
 		}
 	}
-	
-	return block.inode[0];
+	stats_alloc(FS_ALLOC_INODE, searched);
+	return -1;
 }
 
 //helper fn
-//checks if the path provided is valid
-int is_valid_path(char* dir_path) {
-
-	int num_delimit = 0;
-	const char delimit[2] = "/";
-	char* token;
-
-	for(int i=0;i<strlen(dir_path);i++) {
-		if(dir_path[i]=='/' && i<strlen(dir_path)-1) {
-			num_delimit++;
-		}
+static void inode_free(int inumber, int dir) {
+	int g = group_of_inode(inumber);
+	pthread_mutex_lock(&group_lock[g]);
+	bitmap_clear(&inode_map, inumber);
+	if(inumber < __atomic_load_n(&inode_map.cursor, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&inode_map.cursor, inumber, __ATOMIC_RELAXED);
 	}
+	group_count(&groups[g].free_inodes, 1);
+	group_mark(g, GROUP_INODES);
+	if(dir) {
+		group_count(&groups[g].ndirs, -1);
+	}
+	pthread_mutex_unlock(&group_lock[g]);
+}
 
-	if(dir_path[0]!='/') {
-		num_delimit++;
+//helper fn
+//returns a read only view of a disk block. mapped images and cached blocks are
+//read in place, otherwise the block is copied into scratch. the view stays
+//valid until it is given back with block_unview
+static const union fs_block *block_view(int blocknum, union fs_block *scratch) {
+	if(journal_read(blocknum, scratch->data)) {
+		return scratch;                         //newer than the disk
+	}
+	const char *ptr = disk_block_ptr(blocknum);
+	if(ptr) {
+		return (const union fs_block*)ptr;
 	}
+	disk_read(blocknum, scratch->data);
+	return scratch;
+}
 
+//helper fn
+static void block_unview(int blocknum, const union fs_block *view, union fs_block *scratch) {
+	if(view != scratch) {
+		disk_block_put(blocknum);
+	}
+}
 
+//helper fn
+//bounds of the data blocks of group g
+static void group_range(int g, int *lo, int *hi) {
+	*lo = groups[g].data_start;
+	*hi = groups[g].start+groups[g].nblocks;
+}
+
+//helper fn
+//where new files of an inode start looking for blocks: the next fit
+//position in its group
+static int group_goal(int inumber) {
+	return __atomic_load_n(&group_cursor[group_of_inode(inumber)], __ATOMIC_RELAXED);
+}
+
+//helper fn
+//allocates a run of up to want data blocks, searching from goal in its
+//group and then in the neighbouring groups from their next fit position.
+//runs do not cross groups. the first group with a run long enough wins,
+//otherwise the longest run found is taken. returns -1 if the disk is full
+static int block_alloc_run(int goal, int want, int *got) {
+	*got = 0;
+	if(goal < 0 || goal >= bitmap.nbits) {
+		goal = groups[0].data_start;
+	}
+	int first = group_of_block(goal), best = -1, best_len = 0, searched = 0;
+	for(int k=0; k<super.ngroups; k++) {
+		int g = group_near(first, k), lo, hi;
+		if(__atomic_load_n(&groups[g].free_blocks, __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		group_range(g, &lo, &hi);
+		pthread_mutex_lock(&group_lock[g]);
+		int start = bitmap_alloc_run(&bitmap, lo, hi, k == 0 ? goal : group_cursor[g], want, got);
+		if(*got < want) {
+			for(int i=0; i<*got; i++) {
+				bitmap_clear(&bitmap, start+i);      //too short, given back for now
+			}
+		} else {
+			group_count(&groups[g].free_blocks, -want);
+			group_mark(g, GROUP_BLOCKS);
+			__atomic_store_n(&group_cursor[g], start+want, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&group_lock[g]);
+		searched++;
+		if(*got == want) {
+			stats_alloc(FS_ALLOC_BLOCK, searched);
+			return start;
+		}
+		if(*got > best_len) {
+			best     = g;
+			best_len = *got;
+		}
+	}
+	*got = 0;
+	if(best == -1) {
+		stats_alloc(FS_ALLOC_BLOCK, searched);
+		return -1;
+	}
+	int lo, hi;
+	group_range(best, &lo, &hi);
+	pthread_mutex_lock(&group_lock[best]);
+	int start = bitmap_alloc_run(&bitmap, lo, hi, best == first ? goal : group_cursor[best], want, got);
+	if(start != -1) {
+		group_count(&groups[best].free_blocks, -*got);
+		group_mark(best, GROUP_BLOCKS);
+		__atomic_store_n(&group_cursor[best], start+*got, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&group_lock[best]);
+	stats_alloc(FS_ALLOC_BLOCK, searched+1);
+	return start;
+}
+
+//helper fn
+//allocates a single data block as close after goal as possible
+static int block_alloc(int goal) {
+	int got;
+	return block_alloc_run(goal, 1, &got);
+}
+
+//helper fn
+static void block_free(int blocknum) {
+	int g = group_of_block(blocknum);
+	pthread_mutex_lock(&group_lock[g]);
+	bitmap_clear(&bitmap, blocknum);
+	group_count(&groups[g].free_blocks, 1);
+	group_mark(g, GROUP_BLOCKS);
+	pthread_mutex_unlock(&group_lock[g]);
+}
+
+//helper fn
+//index of the first extent that ends after file block logical, n if none.
+//that extent holds logical unless logical falls in a hole
+static int extent_next(struct fs_extent *ext, int n, int logical) {
+	int lo = 0, hi = n;
+	while(lo < hi) {
+		int mid = (lo+hi)/2;
+		if(ext[mid].logical+ext[mid].length <= logical) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+//helper fn
+//number of extent blocks holding the extents past the inline ones
+static int extent_blocks_for(int n) {
+	return n > EXTENTS_PER_INODE ? (n-EXTENTS_PER_INODE+EXTENTS_PER_BLOCK-1)/EXTENTS_PER_BLOCK : 0;
+}
+
+//helper fn
+//levels of index blocks needed above nblocks extent blocks
+static int extent_depth_for(int nblocks) {
+	int depth = 0;
+	for(int64_t reach = 1; reach < nblocks; reach *= POINTERS_PER_BLOCK) {
+		depth++;
+	}
+	return depth;
+}
+
+//helper fn
+//extent blocks plus the index blocks above them
+static int extent_tree_size(int nblocks) {
+	int total = nblocks;
+	while(nblocks > 1) {
+		nblocks = (nblocks+POINTERS_PER_BLOCK-1)/POINTERS_PER_BLOCK;
+		total  += nblocks;
+	}
+	return total;
+}
+
+//helper fn
+//collects the extent blocks below tree block blocknum in file order into
+//blocks and the index blocks on the way into index
+static void extent_tree_walk(int blocknum, int depth, int *blocks, int *nblocks, int *index, int *nindex) {
+	if(depth == 0) {
+		blocks[(*nblocks)++] = blocknum;
+		return;
+	}
+	index[(*nindex)++] = blocknum;
+	union fs_block block;
+	meta_read(blocknum, block.data);
+	for(int i=0; i<POINTERS_PER_BLOCK && block.pointers[i] != 0; i++) {
+		extent_tree_walk(block.pointers[i], depth-1, blocks, nblocks, index, nindex);
+	}
+}
+
+//helper fn
+//returns the blocks of the extent tree of an inode, the extent blocks first
+//in file order and then the index blocks, and stores their count in count.
+//the caller frees the array
+static int *extent_tree_blocks(struct fs_inode *inode, int *count) {
+	int nblocks = extent_blocks_for(inode->nextents);
+	int total   = extent_tree_size(nblocks);
+	int *blocks = malloc((total+1)*sizeof(int));
+	if(blocks == NULL) {
+		printf("ERROR: out of memory for the extent tree of an inode\n");
+		abort();
+	}
+	int nb = 0, ni = 0;
+	if(nblocks > 0) {
+		extent_tree_walk(inode->indirect, inode->depth, blocks, &nb, blocks+nblocks, &ni);
+	}
+	*count = nb+ni;
+	return blocks;
+}
+
+//helper fn
+//makes room for count extents in a list
+static void extent_room(struct extent_list *list, int count) {
+	if(count <= list->cap) {
+		return;
+	}
+	int cap = maximum(count, 2*list->cap);
+	struct fs_extent *ext = realloc(list->ext, cap*sizeof(struct fs_extent));
+	if(ext == NULL) {
+		printf("ERROR: out of memory for an extent list of %d extents\n", count);
+		abort();
+	}
+	list->ext = ext;
+	list->cap = cap;
+}
+
+//helper fn
+//reads the extent list of a file or directory into list. extents past the
+//inline ones sit in extent blocks of EXTENTS_PER_BLOCK each. one extent
+//block hangs off indirect directly, more than that are reached through
+//depth levels of index blocks, each holding POINTERS_PER_BLOCK block numbers
+//ended by a 0. release the list with extent_release
+static void extent_load(struct fs_inode *inode, struct extent_list *list) {
+	int n = inode->nextents;
+	memset(list, 0, sizeof(*list));
+	extent_room(list, maximum(n+1, 8));
+	list->n   = n;
+	list->dir = inode->isvalid == 2;
+	memcpy(list->ext, inode->extent, minimum(n, EXTENTS_PER_INODE)*sizeof(struct fs_extent));
+	if(n > EXTENTS_PER_INODE) {
+		int count;
+		int *blocks = extent_tree_blocks(inode, &count);
+		for(int i=0; i<extent_blocks_for(n); i++) {
+			int first = EXTENTS_PER_INODE+i*EXTENTS_PER_BLOCK;
+			union fs_block block;
+			const union fs_block *view = block_view(blocks[i], &block);
+			memcpy(list->ext+first, view->extent, minimum(n-first, EXTENTS_PER_BLOCK)*sizeof(struct fs_extent));
+			block_unview(blocks[i], view, &block);
+		}
+		list->held = count;
+		free(blocks);
+	}
+}
+
+//helper fn
+//frees an extent list along with any tree blocks it set aside but did not use
+static void extent_release(struct extent_list *list) {
+	for(int i=0; i<list->nspare; i++) {
+		block_free(list->spare[i]);
+	}
+	free(list->ext);
+	memset(list, 0, sizeof(*list));
+}
+
+//helper fn
+//sets aside the blocks the extent tree needs to hold count extents, so that
+//storing the list later can not run out of space. returns 0 if the disk is
+//full or the tree would get deeper than MAX_EXTENT_DEPTH
+static int extent_reserve(struct extent_list *list, int count) {
+	int nblocks = extent_blocks_for(count);
+	if(extent_depth_for(nblocks) > MAX_EXTENT_DEPTH) {
+		return 0;
+	}
+	int need = extent_tree_size(nblocks)-list->held-list->nspare;
+	while(need-- > 0) {
+		if(list->nspare == sizeof(list->spare)/sizeof(list->spare[0])) {
+			return 0;
+		}
+		int blk = block_alloc(list->n ? list->ext[list->n-1].start : 0);   //next to the data
+		if(blk == -1) {
+			return 0;
+		}
+		list->spare[list->nspare++] = blk;
+	}
+	return 1;
+}
+
+//helper fn
+//writes a block unless the disk already holds the same contents
+static void write_if_changed(int blocknum, const union fs_block *block) {
+	union fs_block scratch;
+	const union fs_block *view = block_view(blocknum, &scratch);
+	int changed = memcmp(view->data, block->data, DISK_BLOCK_SIZE) != 0;
+	block_unview(blocknum, view, &scratch);
+	if(changed) {
+		meta_write(blocknum, block->data);
+	}
+}
+
+//helper fn
+//stores an extent list into the inode and its extent tree. extent blocks
+//keep their place so an append only rewrites the last one, and blocks whose
+//contents did not change are not written. blocks the tree gains come from
+//the old tree and from the ones set aside by extent_reserve, the ones it no
+//longer needs are freed
+static void extent_store(int inumber, struct extent_list *list) {
+	struct fs_inode *inode = &inode_table[inumber];
+	int n = list->n;
+	memset(inode->extent, 0, sizeof(inode->extent));
+	memcpy(inode->extent, list->ext, minimum(n, EXTENTS_PER_INODE)*sizeof(struct fs_extent));
+
+	int nold;
+	int *old    = extent_tree_blocks(inode, &nold);
+	int nblocks = extent_blocks_for(n);
+	int keep    = minimum(extent_blocks_for(inode->nextents), nblocks);
+	int total   = extent_tree_size(nblocks);
+	int *pool   = malloc((nold+list->nspare+1)*sizeof(int));
+	int *tree   = malloc((total+1)*sizeof(int));
+	if(pool == NULL || tree == NULL) {
+		printf("ERROR: out of memory for the extent tree of inode %d\n", inumber);
+		abort();
+	}
+	int npool = 0;
+	for(int i=keep; i<nold; i++) {
+		pool[npool++] = old[i];
+	}
+	for(int i=0; i<list->nspare; i++) {
+		pool[npool++] = list->spare[i];
+	}
+	list->nspare = 0;
+	for(int i=0; i<total; i++) {
+		if(i < keep) {
+			tree[i] = old[i];
+		} else if(npool > 0) {
+			tree[i] = pool[--npool];
+		} else if((tree[i] = block_alloc(group_goal(inumber))) == -1) {
+			printf("ERROR: no space left for the extent tree of inode %d\n", inumber);
+			abort();
+		}
+	}
+	while(npool > 0) {
+		meta_free(pool[--npool]);
+	}
+
+	union fs_block block;
+	for(int i=0; i<nblocks; i++) {
+		int first = EXTENTS_PER_INODE+i*EXTENTS_PER_BLOCK;
+		memset(block.data, 0, sizeof(block));
+		memcpy(block.extent, list->ext+first, minimum(n-first, EXTENTS_PER_BLOCK)*sizeof(struct fs_extent));
+		write_if_changed(tree[i], &block);
+	}
+	//index levels are built bottom up until a single root is left
+	int level = 0, count = nblocks, next = nblocks;
+	while(count > 1) {
+		int parents = (count+POINTERS_PER_BLOCK-1)/POINTERS_PER_BLOCK;
+		for(int p=0; p<parents; p++) {
+			int first = p*POINTERS_PER_BLOCK;
+			memset(block.data, 0, sizeof(block));
+			memcpy(block.pointers, tree+level+first, minimum(count-first, POINTERS_PER_BLOCK)*sizeof(int));
+			write_if_changed(tree[next+p], &block);
+		}
+		level  = next;
+		next  += parents;
+		count  = parents;
+	}
+	inode->indirect = nblocks ? tree[level] : 0;
+	inode->depth    = extent_depth_for(nblocks);
+	inode->nextents = n;
+	inode_mark_dirty(inumber);
+	list->held = total;
+	free(old);
+	free(pool);
+	free(tree);
+}
+
+//helper fn
+//frees a block mapped by a file or directory. either kind is handed back
+//only once the transaction that unmapped it has committed
+static void mapped_free(struct extent_list *list, int blocknum) {
+	if(list->dir) {
+		meta_free(blocknum);
+	} else {
+		journal_release(blocknum);
+	}
+}
+
+//helper fn
+//unmaps file blocks [first, first+count) and frees their disk blocks.
+//an extent that straddles the range is split in two, so the list may grow
+//by one. the caller reserves tree space for that with extent_reserve
+static void extent_punch(struct extent_list *list, int first, int count) {
+	struct fs_extent *ext = list->ext;
+	int n   = list->n;
+	int m   = 0;
+	int end = first+count;
+	struct fs_extent *out = malloc((n+1)*sizeof(struct fs_extent));
+	if(out == NULL) {
+		printf("ERROR: out of memory for an extent list of %d extents\n", n+1);
+		abort();
+	}
+	for(int i=0; i<n; i++) {
+		struct fs_extent e = ext[i];
+		int e_end = e.logical+e.length;
+		if(e_end <= first || e.logical >= end) {
+			out[m++] = e;
+			continue;
+		}
+		int cut_begin = e.logical > first ? e.logical : first;
+		int cut_end   = minimum(e_end, end);
+		for(int b=cut_begin; b<cut_end; b++) {
+			mapped_free(list, e.start+(b-e.logical));
+		}
+		if(e.logical < first) {
+			out[m++] = (struct fs_extent){e.logical, e.start, first-e.logical};
+		}
+		if(e_end > end) {
+			out[m++] = (struct fs_extent){end, e.start+(end-e.logical), e_end-end};
+		}
+	}
+	free(list->ext);
+	list->ext = out;
+	list->n   = m;
+	list->cap = n+1;
+}
+
+//helper fn
+//adds a mapping for file blocks the list does not cover yet, merging it with
+//neighbours that are contiguous both in the file and on disk
+static void extent_insert(struct extent_list *list, int logical, int start, int length) {
+	extent_room(list, list->n+1);
+	struct fs_extent *ext = list->ext;
+	int n   = list->n;
+	int pos = extent_next(ext, n, logical);
+	if(pos > 0) {
+		struct fs_extent *prev = &ext[pos-1];
+		if(prev->logical+prev->length == logical && prev->start+prev->length == start) {
+			prev->length += length;
+			if(pos < n && logical+length == ext[pos].logical && start+length == ext[pos].start) {
+				prev->length += ext[pos].length;
+				memmove(&ext[pos], &ext[pos+1], (n-pos-1)*sizeof(struct fs_extent));
+				list->n--;
+			}
+			return;
+		}
+	}
+	if(pos < n && logical+length == ext[pos].logical && start+length == ext[pos].start) {
+		ext[pos].logical = logical;
+		ext[pos].start   = start;
+		ext[pos].length += length;
+		return;
+	}
+	memmove(&ext[pos+1], &ext[pos], (n-pos)*sizeof(struct fs_extent));
+	ext[pos] = (struct fs_extent){logical, start, length};
+	list->n++;
+}
+
+//helper fn
+//frees every block of a file: its extents and its extent tree
+static void extent_free_all(struct fs_inode *inode) {
+	struct extent_list list;
+	extent_load(inode, &list);
+	for(int i=0; i<list.n; i++) {
+		for(int b=0; b<list.ext[i].length; b++) {
+			mapped_free(&list, list.ext[i].start+b);
+		}
+	}
+	extent_release(&list);
+	int count;
+	int *blocks = extent_tree_blocks(inode, &count);
+	for(int i=0; i<count; i++) {
+		meta_free(blocks[i]);
+	}
+	free(blocks);
+}
+
+//helper fn
+//maps the holes in file blocks [first, last] to newly allocated runs, placed
+//right after the disk block backing the preceding file block so appends
+//extend the last extent, or in the group of the inode for its first run.
+//returns the last block that is mapped afterwards, which is below last if
+//the disk fills up or the extent tree can not grow
+static int map_range(int inumber, struct extent_list *list, int first, int last) {
+	int b = first;
+	while(b <= last) {
+		struct fs_extent *ext = list->ext;
+		int n = list->n;
+		int i = extent_next(ext, n, b);
+		if(i < n && ext[i].logical <= b) {
+			b = ext[i].logical+ext[i].length;     //already mapped
+			continue;
+		}
+		int gap_end = (i < n) ? minimum(last+1, ext[i].logical) : last+1;
+		int goal    = (i > 0) ? ext[i-1].start+ext[i-1].length : group_goal(inumber);
+
+		if(!extent_reserve(list, n+1)) {
+			return b-1;                         //no room to record another run
+		}
+		int got;
+		int start = block_alloc_run(goal, gap_end-b, &got);
+		if(start == -1) {
+			return b-1;                         //disk full
+		}
+		extent_insert(list, b, start, got);
+		b += got;
+	}
+	return last;
+}
+
+//helper fn
+//blocks reserved past the end of a file hold stale data. before the size
+//grows over file blocks [first, last) without writing them, any of them
+//that are mapped are unmapped again, so they read as zeros like any hole.
+//returns 0 if the extent tree has no room for the split this may need
+static int unreserve(struct extent_list *list, int first, int last) {
+	int i = extent_next(list->ext, list->n, first);
+	if(first >= last || i == list->n || list->ext[i].logical >= last) {
+		return 1;                           //nothing reserved in the range
+	}
+	if(!extent_reserve(list, list->n+1)) {
+		return 0;
+	}
+	extent_punch(list, first, last-first);
+	return 1;
+}
+
+//helper fn
+//disk block backing block logical, which has to be mapped
+static int extent_lookup(struct fs_extent *ext, int n, int logical) {
+	int i = extent_next(ext, n, logical);
+	return ext[i].start+(logical-ext[i].logical);
+}
+
+//helper fn
+//first block past the last extent. directories have no holes, so for them
+//this is the number of blocks
+static int extent_end(struct fs_extent *ext, int n) {
+	return n ? ext[n-1].logical+ext[n-1].length : 0;
+}
+
+//helper fn
+//appends a block to a directory and returns its logical block, -1 if the
+//disk is full. the caller fills the new block in
+static int dir_grow(int dir, struct extent_list *list) {
+	int logical = extent_end(list->ext, list->n);
+	int last    = map_range(dir, list, logical, logical);
+	extent_store(dir, list);
+	return last == logical ? logical : -1;
+}
+
+//helper fn
+//gives back the blocks appended to a directory past nblocks
+static void dir_shrink(int dir, struct extent_list *list, int nblocks) {
+	extent_punch(list, nblocks, extent_end(list->ext, list->n)-nblocks);
+	extent_store(dir, list);
+}
+
+//helper fn
+//hash of a name in a directory index, FNV-1a
+static unsigned dx_hash(const char *name) {
+	unsigned h = 2166136261u;
+	while(*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+//helper fn
+//index of the entry of an index node that covers hash
+static int dx_search(const struct dx_node *node, unsigned hash) {
+	int lo = 1, hi = node->count;
+	while(lo < hi) {
+		int mid = (lo+hi)/2;
+		if(node->entry[mid].hash <= hash) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo-1;
+}
+
+//helper fn
+//adds an entry at position pos of an index node that has room for it
+static void dx_insert(struct dx_node *node, int pos, unsigned hash, int block) {
+	memmove(&node->entry[pos+1], &node->entry[pos], (node->count-pos)*sizeof(struct dx_entry));
+	node->entry[pos] = (struct dx_entry){hash, block};
+	node->count++;
+}
+
+//helper fn
+//moves the upper half of a full index node into hi, then adds the entry that
+//did not fit at position pos of the original node to the half it belongs in
+static void dx_split(struct dx_node *lo, struct dx_node *hi, int pos, unsigned hash, int block) {
+	int half = lo->count/2;
+	memset(hi, 0, sizeof(*hi));
+	hi->count = lo->count-half;
+	memcpy(hi->entry, &lo->entry[half], hi->count*sizeof(struct dx_entry));
+	lo->count = half;
+	if(pos <= half) {
+		dx_insert(lo, pos, hash, block);
+	} else {
+		dx_insert(hi, pos-half, hash, block);
+	}
+}
+
+//the index nodes passed on the way from the root to a leaf
+struct dx_path {
+	int levels;               //-1 if the directory is a single leaf
+	int node;                 //logical block of the inner node, if any
+	int slot[2];              //entry followed in the root and the inner node
+	int leaf;                 //logical block of the leaf
+};
+
+//helper fn
+//finds the leaf of a directory that holds names with the given hash
+static void dx_descend(struct fs_extent *ext, int n, unsigned hash, struct dx_path *path) {
+	path->levels = -1;
+	path->leaf   = 0;
+	if(extent_end(ext, n) == 1) {
+		return;
+	}
+	union fs_block block;
+	int root = extent_lookup(ext, n, 0);
+	const union fs_block *view = block_view(root, &block);
+	path->levels  = view->dx.levels;
+	path->slot[0] = dx_search(&view->dx, hash);
+	path->leaf    = view->dx.entry[path->slot[0]].block;
+	block_unview(root, view, &block);
+	if(path->levels == 1) {
+		int node      = extent_lookup(ext, n, path->leaf);
+		path->node    = path->leaf;
+		view          = block_view(node, &block);
+		path->slot[1] = dx_search(&view->dx, hash);
+		path->leaf    = view->dx.entry[path->slot[1]].block;
+		block_unview(node, view, &block);
+	}
+}
+
+//helper fn
+//slot of the entry called name in a leaf, -1 if there is none
+static int leaf_find(const union fs_block *leaf, const char *name) {
+	for(int i=0; i<DIR_ENTRIES_PER_BLOCK; i++) {
+		if(leaf->dir[i].name[0] != '\0' && strcmp(leaf->dir[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+//helper fn
+//returns the inode no of the entry called name in a directory and its type
+//in type, -1 if there is none. reads the root, the inner node and the leaf
+static int dir_find(int dir, const char *name, int *type) {
+	struct extent_list list;
+	extent_load(&inode_table[dir], &list);
+	struct dx_path path;
+	dx_descend(list.ext, list.n, dx_hash(name), &path);
+
+	union fs_block block;
+	int leaf = extent_lookup(list.ext, list.n, path.leaf);
+	const union fs_block *view = block_view(leaf, &block);
+	int slot    = leaf_find(view, name);
+	int inumber = -1;
+	if(slot != -1) {
+		*type   = view->dir[slot].type;
+		inumber = view->dir[slot].inode_num;
+	}
+	block_unview(leaf, view, &block);
+	extent_release(&list);
+	return inumber;
+}
+
+//a directory entry together with the hash of its name, for splitting leaves
+struct dx_item {
+	unsigned hash;
+	struct dir_block entry;
+};
+
+//helper fn
+static int dx_item_cmp(const void *a, const void *b) {
+	unsigned ha = ((const struct dx_item*)a)->hash;
+	unsigned hb = ((const struct dx_item*)b)->hash;
+	return ha < hb ? -1 : ha > hb;
+}
+
+//helper fn
+//writes items[0, count) into a fresh leaf
+static void leaf_write(int blocknum, struct dx_item *items, int count) {
+	union fs_block block;
+	memset(block.data, 0, sizeof(block));
+	for(int i=0; i<count; i++) {
+		block.dir[i] = items[i].entry;
+	}
+	meta_write(blocknum, block.data);
+}
+
+//helper fn
+//adds an entry to a directory whose extents are loaded in list. a full leaf is split in two at the median
+//hash, the upper half going to a new leaf that is linked into the index.
+//a full index node is split the same way one level up. returns 1 on
+//success, 0 if the disk is full or the directory has reached its size limit
+static int dir_insert(int dir, struct extent_list *list, const char *name, int inumber, int type) {
+	int nblocks = extent_end(list->ext, list->n);
+	struct dx_path path;
+	dx_descend(list->ext, list->n, dx_hash(name), &path);
+
+	union fs_block leaf;
+	int leaf_blk = extent_lookup(list->ext, list->n, path.leaf);
+	meta_read(leaf_blk, leaf.data);
+	struct dir_block entry;
+	memset(&entry, 0, sizeof(entry));
+	strcpy(entry.name, name);
+	entry.type      = type;
+	entry.inode_num = inumber;
+	for(int i=0; i<DIR_ENTRIES_PER_BLOCK; i++) {
+		if(leaf.dir[i].name[0] == '\0') {
+			leaf.dir[i] = entry;
+			meta_write(leaf_blk, leaf.data);
+			return 1;
+		}
+	}
+
+	//the leaf is full. its entries and the new one are sorted by hash and
+	//split where the hash changes closest to the middle
+	struct dx_item items[DIR_ENTRIES_PER_BLOCK+1];
+	int count = 0;
+	for(int i=0; i<DIR_ENTRIES_PER_BLOCK; i++) {
+		items[count++] = (struct dx_item){dx_hash(leaf.dir[i].name), leaf.dir[i]};
+	}
+	items[count++] = (struct dx_item){dx_hash(name), entry};
+	qsort(items, count, sizeof(struct dx_item), dx_item_cmp);
+	int mid = count/2;
+	while(mid < count && items[mid].hash == items[mid-1].hash) {
+		mid++;
+	}
+	if(mid == count) {
+		mid = count/2;
+		while(mid > 0 && items[mid].hash == items[mid-1].hash) {
+			mid--;
+		}
+		if(mid == 0) {
+			return 0;                       //every name in the leaf has the same hash
+		}
+	}
+	unsigned split = items[mid].hash;
+
+	union fs_block root, inner, other;
+	if(path.levels == -1) {
+		//the single leaf becomes the root, both halves move to new leaves
+		int lo = dir_grow(dir, list);
+		int hi = dir_grow(dir, list);
+		if(lo == -1 || hi == -1) {
+			dir_shrink(dir, list, nblocks);
+			return 0;
+		}
+		leaf_write(extent_lookup(list->ext, list->n, lo), items, mid);
+		leaf_write(extent_lookup(list->ext, list->n, hi), items+mid, count-mid);
+		memset(root.data, 0, sizeof(root));
+		root.dx.count    = 2;
+		root.dx.entry[0] = (struct dx_entry){0, lo};
+		root.dx.entry[1] = (struct dx_entry){split, hi};
+		meta_write(leaf_blk, root.data);
+		return 1;
+	}
+
+	//the new leaf goes into the index node right above the full one
+	meta_read(extent_lookup(list->ext, list->n, 0), root.data);
+	struct dx_node *parent = &root.dx;
+	int pos = path.slot[0]+1;
+	if(path.levels == 1) {
+		meta_read(extent_lookup(list->ext, list->n, path.node), inner.data);
+		parent = &inner.dx;
+		pos    = path.slot[1]+1;
+	}
+	int parent_full = parent->count == DX_ENTRIES_PER_BLOCK;
+	if(parent_full && path.levels == 1 && root.dx.count == DX_ENTRIES_PER_BLOCK) {
+		return 0;                           //both index levels are full
+	}
+
+	int new_leaf = dir_grow(dir, list);
+	int node_a   = parent_full ? dir_grow(dir, list) : 0;
+	int node_b   = parent_full && path.levels == 0 ? dir_grow(dir, list) : 0;
+	if(new_leaf == -1 || node_a == -1 || node_b == -1) {
+		dir_shrink(dir, list, nblocks);
+		return 0;
+	}
+	leaf_write(leaf_blk, items, mid);
+	leaf_write(extent_lookup(list->ext, list->n, new_leaf), items+mid, count-mid);
+
+	if(!parent_full) {
+		dx_insert(parent, pos, split, new_leaf);
+		meta_write(extent_lookup(list->ext, list->n, path.levels == 1 ? path.node : 0), path.levels == 1 ? inner.data : root.data);
+	} else if(path.levels == 0) {
+		//the root is full: its entries are shared out between two new inner
+		//nodes and the root points at those
+		memset(inner.data, 0, sizeof(inner));
+		inner.dx.count = root.dx.count;
+		memcpy(inner.dx.entry, root.dx.entry, root.dx.count*sizeof(struct dx_entry));
+		dx_split(&inner.dx, &other.dx, pos, split, new_leaf);
+		meta_write(extent_lookup(list->ext, list->n, node_a), inner.data);
+		meta_write(extent_lookup(list->ext, list->n, node_b), other.data);
+		memset(root.data, 0, sizeof(root));
+		root.dx.levels   = 1;
+		root.dx.count    = 2;
+		root.dx.entry[0] = (struct dx_entry){0, node_a};
+		root.dx.entry[1] = (struct dx_entry){other.dx.entry[0].hash, node_b};
+		meta_write(extent_lookup(list->ext, list->n, 0), root.data);
+	} else {
+		//the inner node is full: its upper half moves to a new inner node
+		//that is linked into the root
+		dx_split(&inner.dx, &other.dx, pos, split, new_leaf);
+		dx_insert(&root.dx, path.slot[0]+1, other.dx.entry[0].hash, node_a);
+		meta_write(extent_lookup(list->ext, list->n, path.node), inner.data);
+		meta_write(extent_lookup(list->ext, list->n, node_a), other.data);
+		meta_write(extent_lookup(list->ext, list->n, 0), root.data);
+	}
+	return 1;
+}
+
+//helper fn
+//adds an entry to a directory, see dir_insert
+static int dir_add(int dir, const char *name, int inumber, int type) {
+	struct extent_list list;
+	extent_load(&inode_table[dir], &list);
+	int ok = dir_insert(dir, &list, name, inumber, type);
+	extent_release(&list);
+	return ok;
+}
+
+//helper fn
+//clears the entry called name in a directory. the slot is simply marked
+//free, nothing else moves and leaves are never merged. returns 1 if the
+//entry was there
+static int dir_remove(int dir, const char *name) {
+	struct extent_list list;
+	extent_load(&inode_table[dir], &list);
+	struct dx_path path;
+	dx_descend(list.ext, list.n, dx_hash(name), &path);
+
+	union fs_block leaf;
+	int leaf_blk = extent_lookup(list.ext, list.n, path.leaf);
+	meta_read(leaf_blk, leaf.data);
+	int slot = leaf_find(&leaf, name);
+	if(slot != -1) {
+		memset(&leaf.dir[slot], 0, sizeof(leaf.dir[slot]));
+		meta_write(leaf_blk, leaf.data);
+	}
+	extent_release(&list);
+	return slot != -1;
+}
+
+typedef void (*dir_visit_fn)(struct dir_block *entry, void *arg);
+
+//helper fn
+static void leaf_visit(union fs_block *leaf, dir_visit_fn visit, void *arg) {
+	for(int i=0; i<DIR_ENTRIES_PER_BLOCK; i++) {
+		if(leaf->dir[i].name[0] != '\0') {
+			visit(&leaf->dir[i], arg);
+		}
+	}
+}
+
+//helper fn
+//calls visit for every entry of a directory, in hash order once the
+//directory is indexed. visit may change other directories but not this one.
+//all blocks of the directory are read up front, one asynchronous request per
+//extent, so a large directory is not read one block at a time
+static void dir_iterate(int dir, dir_visit_fn visit, void *arg) {
+	struct extent_list list;
+	extent_load(&inode_table[dir], &list);
+	int nblocks = extent_end(list.ext, list.n);
+	union fs_block *blocks = malloc((size_t)nblocks*sizeof(union fs_block));
+	if(!blocks) {
+		printf("ERROR: couldn't allocate %d directory blocks\n", nblocks);
+		abort();
+	}
+	for(int i=0; i<list.n; i++) {
+		meta_submit(list.ext[i].start, list.ext[i].length, blocks[list.ext[i].logical].data);
+	}
+	disk_drain();
+	extent_release(&list);
+
+	if(nblocks == 1) {
+		leaf_visit(&blocks[0], visit, arg);
+		free(blocks);
+		return;
+	}
+	struct dx_node *root = &blocks[0].dx;
+	for(int i=0; i<root->count; i++) {
+		if(root->levels == 0) {
+			leaf_visit(&blocks[root->entry[i].block], visit, arg);
+			continue;
+		}
+		struct dx_node *inner = &blocks[root->entry[i].block].dx;
+		for(int j=0; j<inner->count; j++) {
+			leaf_visit(&blocks[inner->entry[j].block], visit, arg);
+		}
+	}
+	free(blocks);
+}
+
+//a search for the entry that refers to a given inode
+struct dir_match {
+	int inumber;
+	char name[FILE_NAME_SIZE];
+};
+
+//helper fn
+static void match_inumber(struct dir_block *entry, void *arg) {
+	struct dir_match *match = arg;
+	if(entry->inode_num == match->inumber) {
+		strcpy(match->name, entry->name);
+	}
+}
+
+//helper fn
+//copies the name under which a directory lists inumber into name. this has
+//to look at every entry, so callers that know the name should use it.
+//returns 0 if inumber is not in the directory
+static int dir_name_of(int dir, int inumber, char *name) {
+	struct dir_match match;
+	match.inumber = inumber;
+	match.name[0] = '\0';
+	dir_iterate(dir, match_inumber, &match);
+	strcpy(name, match.name);
+	return name[0] != '\0';
+}
+
+//helper fn
+static unsigned dentry_hash(int parent, const char *name) {
+	unsigned h = 2166136261u ^ (unsigned)parent;   //FNV-1a
+	while(*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+//helper fn
+//doubles the hash table once the chains get longer than two entries on
+//average. the lru limit keeps it from growing past DCACHE_MAX/2 buckets
+static void dcache_grow() {
+	int nbuckets = dcache_buckets ? dcache_buckets*2 : 1024;
+	struct dentry **table = calloc(nbuckets, sizeof(struct dentry*));
+	if(table == NULL) {
+		return;                      //keep the old table, lookups just get slower
+	}
+	for(int b=0; b<dcache_buckets; b++) {
+		struct dentry *d = dcache[b];
+		while(d) {
+			struct dentry *next = d->next;
+			unsigned h = dentry_hash(d->parent, d->name) % nbuckets;
+			d->next  = table[h];
+			d->pprev = &table[h];
+			if(table[h]) {
+				table[h]->pprev = &d->next;
+			}
+			table[h] = d;
+			d = next;
+		}
+	}
+	free(dcache);
+	dcache         = table;
+	dcache_buckets = nbuckets;
+}
+
+//helper fn
+static void lru_unlink(struct dentry *d) {
+	d->lru_prev->lru_next = d->lru_next;
+	d->lru_next->lru_prev = d->lru_prev;
+}
+
+//helper fn
+static void lru_push(struct dentry *d) {
+	d->lru_next = dcache_lru.lru_next;
+	d->lru_prev = &dcache_lru;
+	dcache_lru.lru_next->lru_prev = d;
+	dcache_lru.lru_next = d;
+}
+
+//helper fn
+//unlinks an entry from the table and both lists and frees it
+static void dentry_free(struct dentry *d) {
+	*d->pprev = d->next;
+	if(d->next) {
+		d->next->pprev = d->pprev;
+	}
+	*d->dir_pprev = d->dir_next;
+	if(d->dir_next) {
+		d->dir_next->dir_pprev = d->dir_pprev;
+	}
+	lru_unlink(d);
+	free(d);
+	dcache_count--;
+}
+
+//helper fn
+//returns the cached entry for name in parent, NULL if it is not cached.
+//a hit moves the entry to the front of the lru list
+static struct dentry *dcache_find(int parent, const char *name) {
+	struct dentry *d = dcache[dentry_hash(parent, name) % dcache_buckets];
+	while(d) {
+		if(d->parent == parent && strcmp(d->name, name) == 0) {
+			lru_unlink(d);
+			lru_push(d);
+			return d;
+		}
+		d = d->next;
+	}
+	return NULL;
+}
+
+//helper fn
+//records that name in parent refers to inumber, -1 meaning it does not exist
+static void dcache_add(int parent, const char *name, int inumber, int type) {
+	struct dentry *d = dcache_find(parent, name);
+	if(d == NULL) {
+		if(dcache_count >= DCACHE_MAX) {
+			dentry_free(dcache_lru.lru_prev);
+		}
+		if(dcache_count >= 2*dcache_buckets) {
+			dcache_grow();
+		}
+		d = malloc(sizeof(struct dentry));
+		if(d == NULL) {
+			return;                  //not cached, the next lookup scans the directory
+		}
+		d->parent = parent;
+		strcpy(d->name, name);
+		unsigned h = dentry_hash(parent, name) % dcache_buckets;
+		d->next  = dcache[h];
+		d->pprev = &dcache[h];
+		if(dcache[h]) {
+			dcache[h]->pprev = &d->next;
+		}
+		dcache[h] = d;
+		d->dir_next  = dcache_dir[parent];
+		d->dir_pprev = &dcache_dir[parent];
+		if(dcache_dir[parent]) {
+			dcache_dir[parent]->dir_pprev = &d->dir_next;
+		}
+		dcache_dir[parent] = d;
+		lru_push(d);
+		dcache_count++;
+	}
+	d->inumber = inumber;
+	d->type    = type;
+}
+
+//helper fn
+//frees the cached entries of a directory that is going away
+static void dcache_forget(int parent) {
+	while(dcache_dir[parent]) {
+		dentry_free(dcache_dir[parent]);
+	}
+}
+
+//helper fn
+//a removed name is remembered as a negative entry
+static void dcache_remove(int parent, const char *name) {
+	dcache_add(parent, name, -1, 0);
+}
+
+//helper fn
+//returns the inode no of the entry called name in the given directory and
+//its type in type, -1 if there is none. a name that is not cached is
+//looked up through the directory index and the result, found or not,
+//is cached
+static int dcache_lookup(int parent, const char *name, int *type) {
+	struct dentry *d = dcache_find(parent, name);
+	if(d != NULL) {
+		*type = d->type;
+		return d->inumber;
+	}
+
+	*type = 0;
+	int inumber = dir_find(parent, name, type);
+	if(strlen(name) < FILE_NAME_SIZE) {
+		dcache_add(parent, name, inumber, *type);
+	}
+	return inumber;
+}
+
+//helper fn
+//forgets every cached name
+static void dcache_release() {
+	for(int b=0; b<dcache_buckets; b++) {
+		struct dentry *d = dcache[b];
+		while(d) {
+			struct dentry *next = d->next;
+			free(d);
+			d = next;
+		}
+	}
+	free(dcache);
+	free(dcache_dir);
+	dcache         = NULL;
+	dcache_dir     = NULL;
+	dcache_buckets = 0;
+	dcache_count   = 0;
+	dcache_lru.lru_next = dcache_lru.lru_prev = &dcache_lru;
+}
+
+//helper fn
+//sets up the inode locks, inode block latches and group locks for the
+//file system described by super. returns 0 if memory runs out
+static int locks_init() {
+	inode_lock  = malloc(super.ninodes*sizeof(pthread_rwlock_t));
+	inode_latch = malloc(super.ninodeblocks*sizeof(pthread_mutex_t));
+	group_lock  = malloc(super.ngroups*sizeof(pthread_mutex_t));
+	if(inode_lock == NULL || inode_latch == NULL || group_lock == NULL) {
+		free(inode_lock);
+		free(inode_latch);
+		free(group_lock);
+		inode_lock  = NULL;
+		inode_latch = NULL;
+		group_lock  = NULL;
+		return 0;
+	}
+	for(int i=0; i<super.ninodes; i++) {
+		pthread_rwlock_init(&inode_lock[i], NULL);
+	}
+	for(int i=0; i<super.ninodeblocks; i++) {
+		pthread_mutex_init(&inode_latch[i], NULL);
+	}
+	for(int i=0; i<super.ngroups; i++) {
+		pthread_mutex_init(&group_lock[i], NULL);
+	}
+	return 1;
+}
+
+//helper fn
+static void locks_release() {
+	if(inode_lock == NULL) {
+		return;
+	}
+	for(int i=0; i<super.ninodes; i++) {
+		pthread_rwlock_destroy(&inode_lock[i]);
+	}
+	for(int i=0; i<super.ninodeblocks; i++) {
+		pthread_mutex_destroy(&inode_latch[i]);
+	}
+	for(int i=0; i<super.ngroups; i++) {
+		pthread_mutex_destroy(&group_lock[i]);
+	}
+	free(inode_lock);
+	free(inode_latch);
+	free(group_lock);
+	inode_lock  = NULL;
+	inode_latch = NULL;
+	group_lock  = NULL;
+}
+
+//helper fn
+//drops the in memory state of a mounted file system
+static void release_tables() {
+	journal_close();                 //commits what is left while the tables are still here
+	locks_release();
+	bitmap_release(&bitmap);
+	bitmap_release(&inode_map);
+	dcache_release();
+	free(inode_table);
+	free(inode_dirty);
+	free(inode_block_dirty);
+	free(readahead);
+	free(groups);
+	free(group_cursor);
+	free(group_dirty);
+	inode_table       = NULL;
+	inode_dirty       = NULL;
+	inode_block_dirty = NULL;
+	readahead         = NULL;
+	groups            = NULL;
+	group_cursor      = NULL;
+	group_dirty       = NULL;
+	groups_dirty      = 0;
+	is_mounted        = 0;
+}
+
+//helper fn
+//works out the block groups of a disk of nblocks blocks. a disk of a single
+//group keeps a tenth of its blocks for inodes, larger ones give every group
+//the same slice. a last group too short to hold its slice and some data is
+//folded into the one before it. the journal gets a sixteenth of the disk,
+//at least JOURNAL_MIN_BLOCKS and at most JOURNAL_BLOCKS
+static void super_layout(int nblocks, struct fs_superblock *sb) {
+	int ngroups = (nblocks+BLOCKS_PER_GROUP-1)/BLOCKS_PER_GROUP;
+	int slice   = ngroups == 1 ? nblocks*0.1+1 : BLOCKS_PER_GROUP/10+1;
+	if(ngroups > 1 && nblocks-(ngroups-1)*BLOCKS_PER_GROUP < 2*slice) {
+		ngroups--;
+	}
+	sb->magic              = FS_MAGIC;
+	sb->nblocks            = nblocks;
+	sb->blocks_per_group   = BLOCKS_PER_GROUP;
+	sb->ngroups            = ngroups;
+	sb->group_inode_blocks = slice;
+	sb->group_table_blocks = (ngroups+GROUPS_PER_BLOCK-1)/GROUPS_PER_BLOCK;
+	sb->journal_start      = 1+sb->group_table_blocks;
+	sb->journal_blocks     = minimum(JOURNAL_BLOCKS, maximum(JOURNAL_MIN_BLOCKS, nblocks/16));
+	sb->ninodeblocks       = ngroups*slice;
+	sb->ninodes            = sb->ninodeblocks*INODES_PER_BLOCK;
+}
+
+//helper fn
+//descriptor of group i with all its blocks and inodes free
+static void group_describe(const struct fs_superblock *sb, int i, struct fs_group *g) {
+	memset(g, 0, sizeof(*g));
+	g->start        = i*sb->blocks_per_group;
+	g->nblocks      = (i == sb->ngroups-1) ? sb->nblocks-g->start : sb->blocks_per_group;
+	g->block_bitmap = (i == 0) ? sb->journal_start+sb->journal_blocks : g->start;
+	g->inode_bitmap = g->block_bitmap+1;
+	g->inode_start  = g->inode_bitmap+1;
+	g->data_start   = g->inode_start+sb->group_inode_blocks;
+	g->free_blocks  = g->start+g->nblocks-g->data_start;
+	g->free_inodes  = sb->group_inode_blocks*INODES_PER_BLOCK;
+}
+
+static int do_format()
+{
+	if(is_mounted) {
+		release_tables();    //in memory tables would not match the new layout
+	}
+	int disk_blocks = disk_size();
+	union fs_block block;
+	struct fs_superblock sb;
+	super_layout(disk_blocks, &sb);
+	struct fs_group *g = calloc(sb.group_table_blocks*GROUPS_PER_BLOCK, sizeof(struct fs_group));
+	if(g == NULL) {
+		return 0;
+	}
+	for(int i=0; i<sb.ngroups; i++) {
+		group_describe(&sb, i, &g[i]);
+	}
+	if(g[0].data_start >= g[0].start+g[0].nblocks) {
+		free(g);
+		return 0;            //no room for the root directory
+	}
+
+	//root directory takes the first inode and, as one empty leaf, the first
+	//data block of group 0
+	g[0].free_blocks--;
+	g[0].free_inodes--;
+	g[0].ndirs = 1;
+
+	//the bitmaps start out with the blocks in front of the data of every
+	//group in use, and the root directory
+	struct fs_bitmap blocks, inodes;
+	if(!bitmap_init(&blocks, sb.nblocks) || !bitmap_init(&inodes, sb.ninodes)) {
+		bitmap_release(&blocks);
+		free(g);
+		return 0;
+	}
+	for(int i=0; i<sb.ngroups; i++) {
+		for(int b=g[i].start; b<g[i].data_start; b++) {
+			bitmap_set(&blocks, b);
+		}
+	}
+	bitmap_set(&blocks, g[0].data_start);
+	bitmap_set(&inodes, 0);
+
+	memset(block.data, 0, sizeof(block));
+	block.super       = sb;
+	block.super.state = FS_CLEAN;
+	disk_write(0, block.data);     //super block written
+	for(int b=0; b<sb.group_table_blocks; b++) {
+		memcpy(block.group, &g[b*GROUPS_PER_BLOCK], sizeof(block.group));
+		disk_write(1+b, block.data);
+	}
+	journal_format(sb.journal_start, sb.journal_blocks);
+
+	int per = sb.group_inode_blocks*INODES_PER_BLOCK;
+	for(int i=0; i<sb.ngroups; i++) {
+		bitmap_store(&blocks, g[i].start, g[i].nblocks, block.data);
+		disk_write(g[i].block_bitmap, block.data);
+		bitmap_store(&inodes, i*per, per, block.data);
+		disk_write(g[i].inode_bitmap, block.data);
+	}
+	bitmap_release(&blocks);
+	bitmap_release(&inodes);
+
+	//Making isvalid flag 0 for all the inodes
+	memset(block.data, 0, sizeof(block));
+	for(int i=0; i<sb.ngroups; i++) {
+		for(int b=0; b<sb.group_inode_blocks; b++) {
+			disk_write(g[i].inode_start+b, block.data);
+		}
+	}
+
+	//creating root directory in the file system after formatting.
+	disk_write(g[0].data_start, block.data);
+	block.inode[0].isvalid   = 2;
+	block.inode[0].nextents  = 1;
+	block.inode[0].extent[0] = (struct fs_extent){0, g[0].data_start, 1};
+	disk_write(g[0].inode_start, block.data);
+
+	free(g);
+	return 1;
+
+}
+
+//helper fn
+//prints the extents of a file or directory
+static void debug_extents(struct fs_inode *inode) {
+	if(inode->nextents==0) {
+		return;
+	}
+	struct extent_list list;
+	extent_load(inode, &list);
+	printf("    extents: ");
+	for(int i=0; i<list.n; i++) {
+		struct fs_extent *e = &list.ext[i];
+		printf("%d-%d@%d ", e->logical, e->logical+e->length-1, e->start);
+	}
+	printf("\n");
+	if(inode->indirect!=0) {
+		printf("    extent tree: root %d, depth %d\n", inode->indirect, inode->depth);
+	}
+	extent_release(&list);
+}
+
+//helper fn
+static void debug_entry(struct dir_block *entry, void *arg) {
+	if(entry->type==1) {
+		printf("    directory name: ");
+	} else {
+		printf("    file name: ");
+	}
+	printf("%s\t",entry->name);
+	printf("inode: %d\n", entry->inode_num);
+}
+
+static void do_debug()
+{
+	if(is_mounted == 0) {
+		printf("File system not mounted\n");
+		return;
+	}
+
+	printf("superblock:\n");
+	if(super.magic == FS_MAGIC) {
+		printf("    magic number is valid\n");
+	} else {
+		printf("    magic number is invalid.Disk corrupted.Abort\n");
+		return;
+	}
+	printf("    %d blocks on disk\n",super.nblocks);
+	printf("    %d inode blocks for inodes\n",super.ninodeblocks);
+	printf("    %d inodes total\n",super.ninodes);
+	printf("    %d block groups of %d blocks, %d inode blocks each\n",super.ngroups,super.blocks_per_group,super.group_inode_blocks);
+	printf("    journal of %d blocks at block %d\n",super.journal_blocks,super.journal_start);
+	for(int g=0; g<super.ngroups; g++) {
+		printf("group %d\n", g);
+		printf("    blocks %d-%d, bitmaps at %d and %d, data from %d\n", groups[g].start, groups[g].start+groups[g].nblocks-1, groups[g].block_bitmap, groups[g].inode_bitmap, groups[g].data_start);
+		printf("    %d free blocks, %d free inodes, %d directories\n", groups[g].free_blocks, groups[g].free_inodes, groups[g].ndirs);
+	}
+
+	
+	for(int cur_inode=0; cur_inode<super.ninodes; cur_inode++) {
+		if(inode_table[cur_inode].isvalid==1) { //file
+
+			struct fs_inode inode = inode_table[cur_inode];
+			printf("inode %d\n", cur_inode);
+			printf("    %lld size\n", (long long)inode.size);
+			if(inode.flags & FS_INLINE) {
+				printf("    data inline\n");
+			}
+			debug_extents(&inode);
+
+		} else if(inode_table[cur_inode].isvalid==2) {   //directory
+			struct fs_inode inode = inode_table[cur_inode];
+			printf("inode %d\n", cur_inode);
+			printf("    %lld size\n", (long long)inode.size);
+			printf("    parent directory %d\n", inode.parent);
+			debug_extents(&inode);
+
+			if(inode.size>0) {
+				printf("    directory contents:\n");
+				dir_iterate(cur_inode, debug_entry, NULL);
+			}
+		}
+	}
+}
+	
+
+//helper fn
+//writes the superblock once every block written before it is on the disk,
+//and waits for it to get there as well
+static void super_store() {
+	union fs_block block;
+	memset(block.data, 0, sizeof(block));
+	block.super = super;
+	disk_flush();
+	disk_sync();
+	disk_write(0, block.data);
+	disk_flush();
+	disk_sync();
+}
+
+//helper fn
+//reads the block and inode bitmaps of all groups, which lie next to each
+//other at the start of every group, with many requests in flight
+static int bitmaps_load() {
+	int per = super.group_inode_blocks*INODES_PER_BLOCK;
+	char *buffer;
+	if(posix_memalign((void**)&buffer, DISK_BLOCK_SIZE, (size_t)super.ngroups*2*DISK_BLOCK_SIZE) != 0) {
+		return 0;
+	}
+	for(int g=0; g<super.ngroups; g++) {
+		disk_submit(0, groups[g].block_bitmap, 2, buffer+(size_t)g*2*DISK_BLOCK_SIZE, NULL);
+	}
+	disk_drain();
+	for(int g=0; g<super.ngroups; g++) {
+		char *data = buffer+(size_t)g*2*DISK_BLOCK_SIZE;
+		bitmap_load(&bitmap, groups[g].start, groups[g].nblocks, data);
+		bitmap_load(&inode_map, g*per, per, data+DISK_BLOCK_SIZE);
+	}
+	bitmap_restore(&bitmap);
+	bitmap_restore(&inode_map);
+	free(buffer);
+	return 1;
+}
+
+//helper fn
+//rebuilds the bitmaps after a crash from the extents of every file and
+//directory, and the counts of the group table with them. both are
+//written out again
+static void bitmaps_scan() {
+	for(int n=0; n<super.ninodes; n++) {
+		if(inode_table[n].isvalid!=0) {             //files and directories map their blocks alike
+			bitmap_set(&inode_map, n);
+			struct fs_inode *inode = &inode_table[n];
+			if(inode->nextents>0) {
+				struct extent_list list;
+				extent_load(inode, &list);
+				for(int i=0; i<list.n; i++) {
+					for(int b=0; b<list.ext[i].length; b++) {
+						bitmap_set(&bitmap, list.ext[i].start+b); //updating bitmap with occupied disk data
+					}
+				}
+				extent_release(&list);
+				int count;
+				int *blocks = extent_tree_blocks(inode, &count);
+				for(int i=0; i<count; i++) {
+					bitmap_set(&bitmap, blocks[i]);
+				}
+				free(blocks);
+	        }
+		}
+	}
+
+	int per = super.group_inode_blocks*INODES_PER_BLOCK;
+	for(int g=0; g<super.ngroups; g++) {
+		int ndirs = 0;
+		for(int n=g*per; n<(g+1)*per; n++) {
+			ndirs += inode_table[n].isvalid == 2;
+		}
+		groups[g].free_blocks = bitmap_count_zero(&bitmap, groups[g].data_start, groups[g].start+groups[g].nblocks);
+		groups[g].free_inodes = bitmap_count_zero(&inode_map, g*per, (g+1)*per);
+		groups[g].ndirs       = ndirs;
+		group_dirty[g]        = GROUP_BLOCKS|GROUP_INODES;
+	}
+	groups_dirty = 1;
+}
+
+//commits the journal, writes the bitmaps the last commit changed and marks
+//the superblock clean, then drops the in memory tables so the disk can be
+//closed
+static int do_unmount()
+{
+	if(is_mounted == 0) {
+		return 0;
+	}
+	journal_close();                 //blocks freed by the last commit reach the bitmaps
+	group_sync();                    //straight to the disk now
+	super.state = FS_CLEAN;
+	super_store();
+	release_tables();
+	return 1;
+}
+
+//a cleanly unmounted file system is mounted by reading the superblock, the
+//group table, the bitmaps and the inode table. the superblock is marked as
+//mounted before anything else is written, so after a crash the next mount
+//finds it still marked and works the bitmaps out again from all extents
+static int do_mount()
+{
 	union fs_block block;
-	//int inode_num = 1;
-	int block_num,sz;
 
+	if(is_mounted) {
+		do_unmount();
+	}
 	disk_read(0,block.data);
-	int num_inode_blocks = block.super.ninodeblocks;
 
-	disk_read(1, block.data);
-	struct fs_inode inode_val = block.inode[0];
-	
+	if(block.super.magic != FS_MAGIC) {
+		return 0;                                   //valid file system not present
+	}
+	super = block.super;
+	if(super.nblocks > disk_size() || super.ngroups <= 0 || super.group_inode_blocks <= 0 || super.ninodeblocks != super.ngroups*super.group_inode_blocks) {
+		return 0;                                   //group layout is damaged
+	}
+	if(!locks_init()) {
+		return 0;
+	}
+	int clean = super.state == FS_CLEAN;
+	if(clean) {
+		super.state = 0;
+		super_store();
+	}
+	//transactions committed before a crash are put in place before anything
+	//else is read
+	if(journal_open(super.journal_start, super.journal_blocks, block_free) < 0) {
+		release_tables();
+		return 0;
+	}
+	groups       = malloc(super.group_table_blocks*sizeof(block.group));
+	group_cursor = malloc(super.ngroups*sizeof(int));
+	group_dirty  = calloc(super.ngroups, 1);
+	if(groups == NULL || group_cursor == NULL || group_dirty == NULL) {
+		release_tables();
+		return 0;
+	}
+	for(int b=0; b<super.group_table_blocks; b++) {
+		disk_read(1+b, block.data);
+		memcpy(&groups[b*GROUPS_PER_BLOCK], block.group, sizeof(block.group));
+	}
+	for(int g=0; g<super.ngroups; g++) {
+		group_cursor[g] = groups[g].data_start;
+	}
+
+	if(posix_memalign((void**)&inode_table, DISK_BLOCK_SIZE, super.ninodes*sizeof(struct fs_inode))!=0) {
+		inode_table = NULL;                        //aligned so O_DIRECT can read into it
+	}
+	inode_dirty       = calloc(super.ninodes, 1);
+	inode_block_dirty = calloc(super.ninodeblocks, 1);
+	dcache_dir        = calloc(super.ninodes, sizeof(struct dentry*));
+	readahead         = calloc(super.ninodes, sizeof(struct readahead));
+	dcache_grow();
+    if(!bitmap_init(&bitmap, disk_size()) || !bitmap_init(&inode_map, super.ninodes) || inode_table == NULL || inode_dirty == NULL || inode_block_dirty == NULL || dcache_dir == NULL || readahead == NULL || dcache == NULL) {
+    	release_tables();
+    	return 0;                                  //could not allocate memory for bitmap or inode table
+    }
+	if(clean && !bitmaps_load()) {
+		release_tables();
+		return 0;
+	}
+	for(int b=0; b<super.journal_start+super.journal_blocks; b++) {
+		bitmap_set(&bitmap, b);                    //superblock, group table and journal are always allocated
+	}
+
+	//the inode table is read straight into place, with many requests in
+	//flight. each group holds its own slice of it, behind its bitmaps
+	int slice = super.group_inode_blocks;
+	for(int g=0; g<super.ngroups; g++) {
+		struct fs_inode *table = &inode_table[g*slice*INODES_PER_BLOCK];
+		for(int bl=0; bl<slice; bl+=MOUNT_READ_BLOCKS) {
+			int count = minimum(MOUNT_READ_BLOCKS, slice-bl);
+			disk_submit(0, groups[g].inode_start+bl, count, (char*)&table[bl*INODES_PER_BLOCK], NULL);
+		}
+		for(int b=groups[g].block_bitmap; b<groups[g].data_start; b++) {
+			bitmap_set(&bitmap, b);
+		}
+	}
+	disk_drain();
+
+	if(!clean) {
+		bitmaps_scan();
+		group_sync();
+	}
+
+    is_mounted = 1;
+	return 1;
+}
+
+//creates a file.  parent directory inode no and file name should be provided
+//helper fn
+//adds an empty file to a directory. the inode blocks it changes are left
+//for the caller to write with inode_sync
+static int file_add(int dir_inode_no, const char* file_name)
+{
+	if(!is_valid_inumber(dir_inode_no)) {
+		return -1;
+	}
+	struct fs_inode *dir_inode = &inode_table[dir_inode_no];
+	if(dir_inode->isvalid!=2) {
+		return -1; //Not a directory
+	} 
+
+	if(file_name[0] == '\0' || strlen(file_name) >= FILE_NAME_SIZE) {
+		return -1; //name does not fit in a directory entry
+	}
+
+	//checking if duplicate filenames are present
+	int type;
+	if(dcache_lookup(dir_inode_no, file_name, &type) != -1) {
+		printf("File already exists in the directory\n");
+		return -1;
+	}
+
+	int inode_idx = inode_alloc(dir_inode_no, 0);
+	if(inode_idx == -1)
+		return -1;   //inode table full
+
+	if(!dir_add(dir_inode_no, file_name, inode_idx, 0)) {
+		inode_free(inode_idx, 0);
+		return -1;   //disk full or directory at its size limit
+	}
+	dcache_add(dir_inode_no, file_name, inode_idx, 0);
+
+	dir_inode->size++;
+	inode_mark_dirty(dir_inode_no);
+
+	struct fs_inode *inode = &inode_table[inode_idx];
+	pthread_rwlock_wrlock(&inode_lock[inode_idx]);
+	memset(inode, 0, sizeof(*inode));
+	inode->isvalid = 1;
+	inode->flags   = FS_INLINE;
+	inode_mark_dirty(inode_idx);
+	pthread_rwlock_unlock(&inode_lock[inode_idx]);
+	return inode_idx;
+}
+
+static int do_create(int dir_inode_no, char* file_name)
+{
+	if(is_mounted == 0) {
+		printf("File system not mounted\n");
+		return -1;
+	}
+	int inumber = file_add(dir_inode_no, file_name);
+	inode_sync();
+	return inumber;
+}
+
+//creates count files in one directory. all of them are made under one
+//hold of the name space lock and one journal handle, and the inode blocks
+//they change are written once at the end instead of once per file.
+//inumbers[i] is set to the new file's inode no or -1 if names[i] could not
+//be created. returns the number of files created
+static int do_create_batch(int dir_inode_no, const char **names, int count, int *inumbers)
+{
+	if(is_mounted == 0) {
+		printf("File system not mounted\n");
+		return -1;
+	}
+	int created = 0;
+	for(int i=0; i<count; i++) {
+		inumbers[i] = file_add(dir_inode_no, names[i]);
+		created += inumbers[i] != -1;
+	}
+	inode_sync();
+	return created;
+}
+
+//helper fn
+//frees an inode and every block it maps
+static void inode_release(int inumber) {
+	struct fs_inode *inode = &inode_table[inumber];
+	pthread_rwlock_wrlock(&inode_lock[inumber]);    //waits for reads and writes in progress
+	int dir = inode->isvalid == 2;
+	extent_free_all(inode);
+	memset(inode, 0, sizeof(*inode));
+	inode_free(inumber, dir);
+	inode_mark_dirty(inumber);
+	pthread_rwlock_unlock(&inode_lock[inumber]);
+}
+
+//helper fn
+//deletes the file listed as name in the given directory
+static int delete_entry(int inumber, int dir_inode_no, const char *name) {
+	if(!dir_remove(dir_inode_no, name)) {
+		return 0;
+	}
+	dcache_remove(dir_inode_no, name);
+	inode_table[dir_inode_no].size--;
+	inode_mark_dirty(dir_inode_no);
+	inode_release(inumber);              //freeing data blocks
+	inode_sync();
+	return 1;
+}
+
+//inode no of file and inode no of parent directory
+static int do_delete( int inumber, int dir_inode_no)
+{
+	if((is_mounted==0)||!is_valid_inumber(inumber)||!is_valid_inumber(dir_inode_no)) {  //invalid inumber input
+		return 0;
+	}
+
+	if(inode_table[inumber].isvalid != 1 || inode_table[dir_inode_no].isvalid != 2) {  //not a file, or not a directory
+		return 0;
+	}
+
+	//only the inode no is known, so the directory is searched for its name
+	char name[FILE_NAME_SIZE];
+	if(!dir_name_of(dir_inode_no, inumber, name)) {
+		return 0;
+	}
+	return delete_entry(inumber, dir_inode_no, name);
+}
+
+static int64_t do_getsize( int inumber )
+{
+	if((is_mounted==0)||!is_valid_inumber(inumber)) {  //invalid inumber input
+		return -1;
+	}
+	if(inode_table[inumber].isvalid == 0) {  //inode is free
+		return -1;
+	}
+
+	return inode_table[inumber].size;
+}
+
+//helper fn
+//updates the read-ahead window of an inode for a read of [offset, end) and
+//asks the disk to load the next window of file blocks in the background.
+//blocks are mapped through the extents so every disk run is one request,
+//holes are skipped. new requests go out once half the window is consumed
+static void readahead_update(int inumber, struct extent_list *list, int64_t offset, int64_t end) {
+	struct readahead *ra = &readahead[inumber];
+	int end_block = (int)((end+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE);
+	int file_end  = (int)((inode_table[inumber].size+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE);
+	int first = 0, last = 0;
+
+	//readers of the same file share the state, the inode block latch keeps
+	//their updates apart
+	pthread_mutex_t *latch = &inode_latch[inode_block_of(inumber)];
+	pthread_mutex_lock(latch);
+	if(offset == ra->next) {
+		ra->window = ra->window ? minimum(ra->window*2, READAHEAD_MAX) : READAHEAD_MIN;
+	} else {
+		ra->window = 0;
+		ra->issued = 0;
+	}
+	ra->next = end;
+	if(ra->window > 0 && ra->issued-end_block < ra->window/2) {
+		first = maximum(ra->issued, end_block);
+		last  = minimum(end_block+ra->window, file_end);
+		ra->issued = maximum(ra->issued, last);
+	}
+	pthread_mutex_unlock(latch);
+	if(first >= last) {
+		return;
+	}
+
+	struct fs_extent *ext = list->ext;
+	for(int i=extent_next(ext, list->n, first);i<list->n && ext[i].logical<last;i++) {
+		int from = maximum(first, ext[i].logical);
+		int to   = minimum(last, ext[i].logical+ext[i].length);
+		if(from < to) {
+			disk_prefetch(ext[i].start+(from-ext[i].logical), to-from);
+		}
+	}
+}
+
+static int do_read( int inumber, char *data, int length, int64_t offset )
+{
+	if((is_mounted==0)||!is_valid_inumber(inumber)||(length<=0)||(offset<0)) {  //invalid inumber input
+		return 0;
+	}
+
+	struct fs_inode *inode = &inode_table[inumber];
+	if((inode->isvalid == 0)||(offset>=inode->size)) {  
+		return 0;
+	}
+
+	int64_t left     = inode->size-offset;
+	int bytes_copied = left < length ? (int)left : length;
+	int64_t end      = offset+bytes_copied;
+	int64_t pos      = offset;             //next file byte to fill in
+
+	if(inode->flags & FS_INLINE) {
+		memcpy(data, inode->data+offset, bytes_copied);
+		return bytes_copied;
+	}
+
+	struct extent_list list;
+	extent_load(inode, &list);
+	struct fs_extent *ext = list.ext;
+	readahead_update(inumber, &list, offset, end);
+
+	//walks the extents overlapping the range once. whole blocks are read
+	//straight into the caller buffer with one asynchronous request per
+	//extent, all of them in flight together, partial
+	//blocks at either end are copied out of the block in place.
+	//gaps between extents are holes and read as zeros
+	for(int i=extent_next(ext, list.n, offset/DISK_BLOCK_SIZE);i<list.n && pos<end;i++) {
+		int64_t ext_begin = (int64_t)ext[i].logical*DISK_BLOCK_SIZE;
+		int64_t ext_end   = ext_begin+(int64_t)ext[i].length*DISK_BLOCK_SIZE;
+		if(ext_begin >= end) {
+			break;
+		}
+		if(ext_begin > pos) {
+			memset(data+(pos-offset), 0, ext_begin-pos);
+			pos = ext_begin;
+		}
+		int64_t stop = end < ext_end ? end : ext_end;
+		union fs_block block;
+
+		if(pos%DISK_BLOCK_SIZE) {
+			int64_t blk_end = (pos/DISK_BLOCK_SIZE+1)*DISK_BLOCK_SIZE;
+			int chunk = (int)((stop < blk_end ? stop : blk_end)-pos);
+			int blk = ext[i].start+(pos/DISK_BLOCK_SIZE-ext[i].logical);
+			const union fs_block *view = block_view(blk, &block);
+			memcpy(data+(pos-offset), view->data+pos%DISK_BLOCK_SIZE, chunk);
+			block_unview(blk, view, &block);
+			pos += chunk;
+		}
+
+		int whole = (stop-pos)/DISK_BLOCK_SIZE;
+		if(whole>0) {
+			disk_submit(0, ext[i].start+(pos/DISK_BLOCK_SIZE-ext[i].logical), whole, data+(pos-offset), NULL);
+			pos += (int64_t)whole*DISK_BLOCK_SIZE;
+		}
+
+		if(pos<stop) {
+			int blk = ext[i].start+(pos/DISK_BLOCK_SIZE-ext[i].logical);
+			const union fs_block *view = block_view(blk, &block);
+			memcpy(data+(pos-offset), view->data, stop-pos);
+			block_unview(blk, view, &block);
+			pos = stop;
+		}
+	}
+	if(pos<end) {
+		memset(data+(pos-offset), 0, end-pos);
+	}
+	disk_drain();
+	extent_release(&list);
+
+	return bytes_copied;
+}
+
+//helper fn
+//writes len bytes at byte off of a single block. the rest of the block keeps
+//its old contents if preserve is set, otherwise it is zero filled
+static void write_partial(int blocknum, int off, const char *src, int len, int preserve) {
+	union fs_block block;
+	if(preserve) {
+		disk_read(blocknum, block.data);
+	} else {
+		memset(block.data, 0, sizeof(block));
+	}
+	memcpy(block.data+off, src, len);
+	disk_write(blocknum, block.data);
+}
+
+//helper fn
+//whether a block of data is all zeros. the block is or-ed together 32
+//bytes at a time in gcc vector types, which compile to SIMD loads and ors,
+//and tested every 256 bytes so data that is not zero is rejected early
+static int block_is_zero(const char *data) {
+	typedef uint64_t zero_vec __attribute__((vector_size(32)));
+	for(int i=0; i<DISK_BLOCK_SIZE; i+=8*sizeof(zero_vec)) {
+		zero_vec acc = {0, 0, 0, 0}, v;
+		for(int j=0; j<8; j++) {
+			memcpy(&v, data+i+j*sizeof(zero_vec), sizeof(v));
+			acc |= v;
+		}
+		if(acc[0]|acc[1]|acc[2]|acc[3]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+//helper fn
+//whether file block b of a write of data at offset is written whole and
+//with zeros only, at a place that holds no file data: a hole, or a block
+//reserved past the old end old_end. such blocks are left as holes
+static int block_elided(struct extent_list *list, const char *data, int64_t offset, int length, int b, int old_end) {
+	int64_t begin = (int64_t)b*DISK_BLOCK_SIZE;
+	if(begin < offset || begin+DISK_BLOCK_SIZE > offset+length) {
+		return 0;                           //partial block
+	}
+	if(b < old_end) {
+		int i = extent_next(list->ext, list->n, b);
+		if(i < list->n && list->ext[i].logical <= b) {
+			return 0;                       //overwrites file data in place
+		}
+	}
+	return block_is_zero(data+(begin-offset));
+}
+
+//helper fn
+//maps file blocks [first, last] for a write like map_range, except that
+//runs of zero blocks stay holes and any blocks reserved under them are
+//unmapped. returns the last block that is mapped or a hole afterwards
+static int map_data(int inumber, struct extent_list *list, const char *data, int64_t offset, int length, int first, int last, int old_end) {
+	int b = first;
+	while(b <= last) {
+		int e = b;
+		int elided = block_elided(list, data, offset, length, b, old_end);
+		while(e+1 <= last && block_elided(list, data, offset, length, e+1, old_end) == elided) {
+			e++;
+		}
+		if(elided) {
+			if(!unreserve(list, maximum(b, old_end), e+1)) {
+				return b-1;
+			}
+		} else {
+			int mapped = map_range(inumber, list, b, e);
+			if(mapped != e) {
+				return mapped;
+			}
+		}
+		b = e+1;
+	}
+	return last;
+}
+
+static int do_write( int inumber, const char *data, int length, int64_t offset );
+
+//helper fn
+//moves the data of an inline file out to a block, leaving an ordinary file
+//with the same contents. returns 0 if the disk is full, the file stays
+//inline then
+static int inline_migrate(int inumber) {
+	struct fs_inode *inode = &inode_table[inumber];
+	char old[INLINE_DATA_SIZE];
+	int64_t size = inode->size;
+	memcpy(old, inode->data, sizeof(old));
+
+	memset(inode->data, 0, sizeof(inode->data));
+	inode->flags   &= ~FS_INLINE;
+	inode->nextents = 0;
+	inode->depth    = 0;
+	inode->size     = 0;
+	if(size > 0 && do_write(inumber, old, size, 0) != size) {
+		memcpy(inode->data, old, sizeof(old));
+		inode->flags |= FS_INLINE;
+		inode->size   = size;
+		return 0;
+	}
+	inode->size = size;
+	inode_mark_dirty(inumber);
+	return 1;
+}
+
+static int do_write( int inumber, const char *data, int length, int64_t offset )
+{
+	if((is_mounted==0)||!is_valid_inumber(inumber)||(length<=0)||(offset<0)) {  //invalid inumber input
+		return 0;
+	}
+	struct fs_inode *inode = &inode_table[inumber];
+	if(inode->isvalid != 1) {
+		return 0;                      //not a file
+	}
+	if(offset+length > (int64_t)MAX_FILE_BLOCKS*DISK_BLOCK_SIZE) {
+		return 0;                      //past the largest file size
+	}
+
+	//small files are written in the inode and only the inode block goes to
+	//the disk, through the journal. a write that does not fit moves the
+	//data to a block first
+	if(inode->flags & FS_INLINE) {
+		if(offset+length <= INLINE_DATA_SIZE) {
+			memcpy(inode->data+offset, data, length);
+			if(offset+length > inode->size) {
+				inode->size = offset+length;
+			}
+			inode_mark_dirty(inumber);
+			inode_sync();
+			return length;
+		}
+		if(!inline_migrate(inumber)) {
+			return 0;
+		}
+	}
+
+	int strt_disk_num = offset/DISK_BLOCK_SIZE;
+	int end_disk_num  = (offset+length-1)/DISK_BLOCK_SIZE;
+
+	struct extent_list list;
+	extent_load(inode, &list);
+
+	//a write past the end must not expose blocks reserved between the old
+	//end and the write
+	int old_end = (inode->size+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;
+	if(!unreserve(&list, old_end, strt_disk_num)) {
+		extent_release(&list);
+		return 0;
+	}
+
+	//a partial block at either end keeps the bytes around the write only if it
+	//was already mapped and holds file data. new blocks are zero filled
+	int i, n = list.n;
+	struct fs_extent *ext = list.ext;
+	i = extent_next(ext, n, strt_disk_num);
+	int keep_head = i<n && ext[i].logical<=strt_disk_num && (int64_t)strt_disk_num*DISK_BLOCK_SIZE<inode->size;
+	i = extent_next(ext, n, end_disk_num);
+	int keep_tail = i<n && ext[i].logical<=end_disk_num && (int64_t)end_disk_num*DISK_BLOCK_SIZE<inode->size;
+
+	//blocks the file already owns are overwritten in place, only holes get
+	//new blocks, unless they are written with zeros
+	int last_mapped = map_data(inumber, &list, data, offset, length, strt_disk_num, end_disk_num, old_end);
+	int64_t end = (int64_t)(last_mapped+1)*DISK_BLOCK_SIZE;
+	int64_t pos = offset;                //next file byte to write
+	if(end > offset+length) {
+		end = offset+length;
+	}
+	n   = list.n;
+	ext = list.ext;
+
+	for(i=extent_next(ext, n, strt_disk_num); i<n && pos<end; i++) {
+		int64_t ext_begin = (int64_t)ext[i].logical*DISK_BLOCK_SIZE;
+		int64_t ext_end   = (int64_t)(ext[i].logical+ext[i].length)*DISK_BLOCK_SIZE;
+		int64_t stop      = end < ext_end ? end : ext_end;
+		if(ext_begin >= end) {
+			break;
+		}
+		if(ext_begin > pos) {
+			pos = ext_begin;                 //zero blocks left as a hole
+		}
+		int blk         = pos/DISK_BLOCK_SIZE;
+
+		if(pos%DISK_BLOCK_SIZE || stop-pos<DISK_BLOCK_SIZE) {
+			int64_t blk_end = (int64_t)(blk+1)*DISK_BLOCK_SIZE;
+			int chunk = (int)((stop < blk_end ? stop : blk_end)-pos);
+			int keep  = (blk==strt_disk_num) ? keep_head : keep_tail;
+			write_partial(ext[i].start+(blk-ext[i].logical), pos%DISK_BLOCK_SIZE, data+(pos-offset), chunk, keep);
+			pos += chunk;
+			blk++;
+		}
+
+		int whole = (stop-pos)/DISK_BLOCK_SIZE;
+		if(whole>0) {
+			disk_writev(ext[i].start+(blk-ext[i].logical), whole, data+(pos-offset));
+			pos += (int64_t)whole*DISK_BLOCK_SIZE;
+			blk += whole;
+		}
+
+		if(pos<stop) {
+			write_partial(ext[i].start+(blk-ext[i].logical), 0, data+(pos-offset), stop-pos, keep_tail);
+			pos = stop;
+		}
+	}
+
+	//the rest of the range, if any, is zero blocks left as holes
+	int bytes_copied = end > offset ? (int)(end-offset) : 0;
+	if(offset+bytes_copied > inode->size) {
+		inode->size = offset+bytes_copied;
+	}
+	extent_store(inumber, &list);
+	extent_release(&list);
+	inode_sync();
+	return bytes_copied;
+}
 
-	for(int i=0;i<num_delimit-1;i++) {
-		
-		if(i==0) {
-			token = strtok(dir_path, delimit);
-	    } else {
-	    	token = strtok(NULL, delimit);
-	    }
-	    block_num = inode_val.indirect;
-	    sz        = inode_val.size;
-	    disk_read(block_num,block.data);
-	    int flag = 0;
-	    for(int j=0;j<sz;j++) {
-	    	if(strcmp(token, block.dir[j].name)==0) {
-	    		flag=1;
-	    		break;
-	    	}
-	    }
-	    if(flag==0) {
-	    	return 0;
-	    }
-	    inode_val = get_dir_inode(token, num_inode_blocks);
-
-	}
-
-	block_num = inode_val.indirect;
-    sz        = inode_val.size;
-  
-    disk_read(block_num,block.data);
-
-
-    if(num_delimit==1) {
-    	token = strtok(dir_path, delimit);
-    } else {
-    	token = strtok(NULL, delimit);
-    }
-    
-    for(int j=0;j<sz;j++) {
-    	if(strcmp(token, block.dir[j].name)==0) {
-    		return 0;
-    	}
-    }
+//sets the size of a file. blocks past the new end are freed and the unused
+//part of the last block is cleared, so growing the file again reads zeros.
+//growing only changes the size, the new range is a hole until written
+static int do_truncate( int inumber, int64_t length )
+{
+	if((is_mounted==0)||!is_valid_inumber(inumber)||(length<0)) {  //invalid inumber input
+		return 0;
+	}
+	struct fs_inode *inode = &inode_table[inumber];
+	if(inode->isvalid != 1 || length > (int64_t)MAX_FILE_BLOCKS*DISK_BLOCK_SIZE) {
+		return 0;                      //not a file, or too large
+	}
 
-    return 1;
+	if(inode->flags & FS_INLINE) {
+		if(length > INLINE_DATA_SIZE) {
+			if(!inline_migrate(inumber)) {
+				return 0;
+			}
+		} else {
+			if(length < inode->size) {
+				memset(inode->data+length, 0, inode->size-length);
+			}
+			inode->size = length;
+			inode_mark_dirty(inumber);
+			inode_sync();
+			return 1;
+		}
+	}
 
+	if(length < inode->size) {
+		struct extent_list list;
+		extent_load(inode, &list);
+		int keep_blocks = (length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;
+		int file_blocks = extent_end(list.ext, list.n);
+		if(file_blocks > keep_blocks) {
+			extent_punch(&list, keep_blocks, file_blocks-keep_blocks);
+		}
+		if(length%DISK_BLOCK_SIZE) {
+			int last = length/DISK_BLOCK_SIZE;
+			int i = extent_next(list.ext, list.n, last);
+			if(i<list.n && list.ext[i].logical<=last) {
+				int blocknum = list.ext[i].start+(last-list.ext[i].logical);
+				union fs_block block;
+				disk_read(blocknum, block.data);
+				memset(block.data+length%DISK_BLOCK_SIZE, 0, DISK_BLOCK_SIZE-length%DISK_BLOCK_SIZE);
+				disk_write(blocknum, block.data);
+			}
+		}
+		extent_store(inumber, &list);
+		extent_release(&list);
+	} else if(length > inode->size) {
+		struct extent_list list;
+		extent_load(inode, &list);
+		int old_end = (inode->size+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;
+		int new_end = (length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;
+		int ok = unreserve(&list, old_end, new_end);
+		extent_store(inumber, &list);
+		extent_release(&list);
+		if(!ok) {
+			return 0;
+		}
+	}
+	inode->size = length;
+	inode_mark_dirty(inumber);
+	inode_sync();
+	return 1;
+}
 
+//helper fn
+//zeros bytes [from, to) of a single file block in place, if it is mapped
+static void zero_partial(struct extent_list *list, int64_t from, int64_t to) {
+	if(from >= to) {
+		return;
+	}
+	int b = from/DISK_BLOCK_SIZE;
+	int i = extent_next(list->ext, list->n, b);
+	if(i<list->n && list->ext[i].logical<=b) {
+		int blocknum = list->ext[i].start+(b-list->ext[i].logical);
+		union fs_block block;
+		disk_read(blocknum, block.data);
+		memset(block.data+from%DISK_BLOCK_SIZE, 0, to-from);
+		disk_write(blocknum, block.data);
+	}
 }
 
-//returns first vacant inode
-int fs_get_vacant_inode(char* dir_name, int num_inode_blocks)
+//makes bytes [offset, offset+length) of a file a hole. the blocks wholly
+//inside the range are unmapped and freed, the partial blocks at its ends
+//are zeroed in place. the size does not change. returns 0 if the extent
+//tree has no room for the split a punch in the middle of an extent needs
+static int do_punch( int inumber, int64_t offset, int64_t length )
 {
-	
-	union fs_block block;
-	//int cur_disk_block = 0;
-	
-	
-	int inode_idx = 0;
-
-	for(int i=1; i<=num_inode_blocks; i++) {
-		disk_read(i, block.data);
-		for(int j=0;j<INODES_PER_BLOCK; j++) {
-			if(block.inode[j].isvalid == 0) {
-				block.inode[j].isvalid=2;
-				block.inode[j].size=0;
-				
-				int blk = get_free_block(num_inode_blocks);
-				if(blk==-1) {
-					return -1;
-				}
-				block.inode[j].indirect = blk;
-				strcpy(block.inode[j].attr.dir_name,dir_name);
-				disk_write(i, block.data);
-				return inode_idx;
-			}
-			inode_idx++;
+	if((is_mounted==0)||!is_valid_inumber(inumber)||(offset<0)||(length<0)) {
+		return 0;
+	}
+	struct fs_inode *inode = &inode_table[inumber];
+	if(inode->isvalid != 1) {
+		return 0;                      //not a file
+	}
+	int64_t end = offset+length;
+	if(end > (int64_t)MAX_FILE_BLOCKS*DISK_BLOCK_SIZE) {
+		end = (int64_t)MAX_FILE_BLOCKS*DISK_BLOCK_SIZE;
+	}
+	if(offset >= end) {
+		return 1;
+	}
+	if(inode->flags & FS_INLINE) {
+		if(offset < INLINE_DATA_SIZE) {
+			memset(inode->data+offset, 0, minimum(end, INLINE_DATA_SIZE)-offset);
+			inode_mark_dirty(inumber);
+			inode_sync();
 		}
+		return 1;
 	}
+	int first = (offset+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;   //whole blocks [first, last)
+	int last  = end/DISK_BLOCK_SIZE;
 
-	return -1;   //inode table full
+	struct extent_list list;
+	extent_load(inode, &list);
+	if(last > first && !extent_reserve(&list, list.n+1)) {
+		extent_release(&list);
+		return 0;
+	}
+	int64_t head_end = end < (int64_t)first*DISK_BLOCK_SIZE ? end : (int64_t)first*DISK_BLOCK_SIZE;
+	zero_partial(&list, offset, head_end);
+	if(last >= first) {
+		int64_t tail = (int64_t)last*DISK_BLOCK_SIZE;
+		zero_partial(&list, tail > head_end ? tail : head_end, end);
+	}
+	if(last > first) {
+		extent_punch(&list, first, last-first);
+	}
+	extent_store(inumber, &list);
+	extent_release(&list);
+	inode_sync();
+	return 1;
 }
 
+//maps the blocks of a file up to length in as few allocator runs as it
+//takes, so a file whose final size is known up front gets one contiguous
+//run instead of one per write. the size is not changed: the reserved
+//blocks lie past the end until writes cover them. holes below the end stay
+//holes. returns 1 if every block up to length is mapped
+static int do_reserve( int inumber, int64_t length )
+{
+	if((is_mounted==0)||!is_valid_inumber(inumber)||(length<0)) {
+		return 0;
+	}
+	struct fs_inode *inode = &inode_table[inumber];
+	if(inode->isvalid != 1 || length > (int64_t)MAX_FILE_BLOCKS*DISK_BLOCK_SIZE) {
+		return 0;                      //not a file, or too large
+	}
+	if(inode->flags & FS_INLINE) {
+		if(length <= INLINE_DATA_SIZE) {
+			return 1;                  //fits in the inode, nothing to reserve
+		}
+		if(!inline_migrate(inumber)) {
+			return 0;
+		}
+	}
+	int first = (inode->size+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;
+	int last  = (length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE-1;
+	if(first > last) {
+		return 1;
+	}
+
+	struct extent_list list;
+	extent_load(inode, &list);
+	int last_mapped = map_range(inumber, &list, first, last);
+	extent_store(inumber, &list);
+	extent_release(&list);
+	inode_sync();
+	return last_mapped == last;
+}
 
-int fs_create_dir(char* dir_path) {
+//helper fn
+//resolves a path to an inode no by walking directory entries from the root
+//directory (inode 0), one dentry cache lookup per component. every
+//component but the last has to be a directory. returns -1 if the path
+//does not exist
+static int do_lookup( const char *path )
+{
 	if(is_mounted == 0) {
-		printf("File system not mounted\n");
 		return -1;
 	}
-	
-	char dir_path_cp[DIR_PATH_SIZE];
-	strcpy(dir_path_cp, dir_path);
-	//checks if the given directory path is valid
-	if(is_valid_path(dir_path_cp)==0) {
+
+	int inumber = 0;
+	int type    = 1;
+	const char *p = path;
+	while(*p) {
+		while(*p == '/') {
+			p++;
+		}
+		if(*p == '\0') {
+			break;
+		}
+		const char *end = strchr(p, '/');
+		int len = end ? end-p : strlen(p);
+		if(len >= FILE_NAME_SIZE || type != 1) {
+			return -1;              //name too long to exist, or walking through a file
+		}
+		char name[FILE_NAME_SIZE];
+		memcpy(name, p, len);
+		name[len] = '\0';
+
+		inumber = dcache_lookup(inumber, name, &type);
+		if(inumber == -1) {
+			return -1;
+		}
+		p += len;
+	}
+	return inumber;
+}
+
+//helper fn
+//splits a path into the inode no of its parent directory and its last
+//component, copied into name. returns -1 if the parent does not exist or
+//is not a directory, or if there is no last component
+static int lookup_parent(const char *path, char *name, int name_size) {
+	char parent_path[1024];
+	int  len = strlen(path);
+	while(len > 0 && path[len-1] == '/') {
+		len--;                          //ignore trailing slashes
+	}
+	int start = len;
+	while(start > 0 && path[start-1] != '/') {
+		start--;
+	}
+	if(start == len || len-start >= name_size || start >= sizeof(parent_path)) {
 		return -1;
 	}
+	memcpy(name, path+start, len-start);
+	name[len-start] = '\0';
+	memcpy(parent_path, path, start);
+	parent_path[start] = '\0';
 
-	int num_delimit = 0;
-	const char delimit[2] = "/";
-	char* token = "root";
-	union fs_block block;
-  
-	for(int i=0;i<strlen(dir_path);i++) {
-		if(dir_path[i]=='/' && i<strlen(dir_path)-1) {
-			num_delimit++;
-		}
+	int par_inode_no = do_lookup(parent_path);
+	if(par_inode_no == -1 || inode_table[par_inode_no].isvalid != 2) {
+		return -1;
 	}
-	if(dir_path[0]!='/') {
-		num_delimit++;
+	return par_inode_no;
+}
+
+//a listing of a directory into an array of at most max entries
+struct dir_listing {
+	struct fs_dirent *entries;
+	int max;
+	int n;
+};
+
+//helper fn
+static void list_entry(struct dir_block *entry, void *arg) {
+	struct dir_listing *listing = arg;
+	if(listing->n < listing->max) {
+		struct fs_dirent *e = &listing->entries[listing->n];
+		memcpy(e->name, entry->name, FILE_NAME_SIZE);
+		e->inumber = entry->inode_num;
+		e->type    = entry->type;
 	}
+	listing->n++;
+}
 
-	disk_read(0,block.data);
-	int num_inode_blocks = block.super.ninodeblocks;
+//copies the entries of a directory into entries, at most max of them.
+//returns the number of entries in the directory, which may be more than
+//max, or -1 if it is not a directory
+static int do_readdir(int dir_inode_no, struct fs_dirent *entries, int max)
+{
+	if(is_mounted == 0 || !is_valid_inumber(dir_inode_no) || inode_table[dir_inode_no].isvalid != 2) {
+		return -1;
+	}
+	struct dir_listing listing = {entries, max, 0};
+	dir_iterate(dir_inode_no, list_entry, &listing);
+	return listing.n;
+}
+
+//creates a file given its path. returns the inode no of the new file
+static int do_create_file(const char* path)
+{
+	char file_name[FILE_NAME_SIZE];
+	int par_inode_no = lookup_parent(path, file_name, sizeof(file_name));
+	if(par_inode_no == -1) {
+		return -1;
+	}
+	return do_create(par_inode_no, file_name);
+}
+
+//deletes the file at the given path
+static int do_delete_file(const char* path)
+{
+	char file_name[FILE_NAME_SIZE];
+	int type;
+	int par_inode_no = lookup_parent(path, file_name, sizeof(file_name));
+	if(par_inode_no == -1) {
+		return 0;
+	}
+	int inumber = dcache_lookup(par_inode_no, file_name, &type);
+	if(inumber == -1 || type != 0) {
+		return 0;
+	}
+	return delete_entry(inumber, par_inode_no, file_name);
+}
+
+//helper fn
+//allocates the inode of a new directory together with its first leaf.
+//returns the inode no, -1 if there is no free inode or block
+static int dir_alloc(int par_inode_no)
+{
+	int inode_idx = inode_alloc(par_inode_no, 1);
+	if(inode_idx == -1) {
+		return -1;   //inode table full
+	}
+	struct fs_inode *inode = &inode_table[inode_idx];
+	memset(inode, 0, sizeof(*inode));
+	inode->isvalid = 2;
+	inode->parent  = par_inode_no;
+	inode_mark_dirty(inode_idx);
+
+	struct extent_list list;
+	extent_load(inode, &list);
+	if(dir_grow(inode_idx, &list) == -1) {
+		extent_release(&list);
+		inode_release(inode_idx);
+		return -1;
+	}
+	union fs_block block;
+	memset(block.data, 0, sizeof(block));
+	meta_write(list.ext[0].start, block.data);
+	extent_release(&list);
+	return inode_idx;
+}
 
-	struct fs_inode par_inode;
-	
-	if(num_delimit>1) {
-		for(int i=0;i<num_delimit-1;i++) {
-			if(i==0) {
-				token = strtok(dir_path, delimit);
-			} else {
-				token = strtok(NULL, delimit);
-			}
-		}
-		par_inode = get_dir_inode(token, num_inode_blocks);
-	} else {
-		disk_read(1,block.data);
-		par_inode = block.inode[0];
 
+//creates a directory given its path. returns its inode no
+static int do_create_dir(char* dir_path) {
+	if(is_mounted == 0) {
+		printf("File system not mounted\n");
+		return -1;
+	}
+	
+	//the parent has to exist and the new name must not
+	char dir_name[FILE_NAME_SIZE];
+	int  type;
+	int par_inode_no = lookup_parent(dir_path, dir_name, sizeof(dir_name));
+	if(par_inode_no == -1 || dcache_lookup(par_inode_no, dir_name, &type) != -1) {
+		return -1;
 	}
 
-	int num_records = par_inode.size;
-	if(num_records == DIR_ENTRIES_PER_BLOCK-1) {
+	int inode_num = dir_alloc(par_inode_no);
+	if(inode_num == -1) {
 		return -1;
 	}
-	disk_read(par_inode.indirect, block.data);
-	char* dir_name;
-	if(num_delimit>1) {
-		dir_name = strtok(NULL, delimit);
-    } else {
-    	dir_name = strtok(dir_path, delimit);
-    }
-	strcpy(block.dir[num_records].name,dir_name);
 
 	//update parent dir entry data
-	int inode_num = fs_get_vacant_inode(dir_name, num_inode_blocks);
-	block.dir[num_records].inode_num = inode_num;
-	block.dir[num_records].type      = 1;
-	disk_write(par_inode.indirect, block.data);
+	if(!dir_add(par_inode_no, dir_name, inode_num, 1)) {
+		inode_release(inode_num);
+		inode_sync();
+		return -1;
+	}
+	dcache_add(par_inode_no, dir_name, inode_num, 1);
     
 	//update parent dir inode data
-	for(int i=1; i<=num_inode_blocks; i++) {
-		disk_read(i, block.data);
-		for(int j=0;j<INODES_PER_BLOCK; j++) {
-			if(block.inode[j].isvalid == 2 && strcmp(block.inode[j].attr.dir_name,token)==0) {
-				block.inode[j].size++;
-				disk_write(i, block.data);	
-			}
-		}
-	}
+	inode_table[par_inode_no].size++;
+	inode_mark_dirty(par_inode_no);
+	inode_sync();
 
-	return 0;
-   
+	return inode_num;
 }
 
 //updates parent directory inode structure data after deletion of one of its directories
 int update_parent_inode_data_after_deletion(int dir_inode_no) {
-	union fs_block block;
-	union fs_block dir_block;
-	disk_read(0,block.data);
-	int num_inode_blocks = block.super.ninodeblocks;
-	
-    
-	for(int bl=1; bl<= num_inode_blocks; bl++) {
-		disk_read(bl, block.data);
-		for(int i=0;i<INODES_PER_BLOCK;i++) {
-			if(block.inode[i].isvalid==2) {
-				int sz = block.inode[i].size;
-				if(sz>0) {
-					disk_read(block.inode[i].indirect, dir_block.data);
-					for(int j=0; j<sz; j++) {
-						if(dir_block.dir[j].inode_num == dir_inode_no) {
-							for(int k=j+1;k<sz;k++) {
-								dir_block.dir[k-1] = dir_block.dir[k];
-							}
-							disk_write(block.inode[i].indirect, dir_block.data);
-							block.inode[i].size--;
-							disk_write(bl, block.data);
-							return 0;
-						}
-					}
+	char name[FILE_NAME_SIZE];
 
-				}
-			}
-		}
+	int par_inode_no = inode_table[dir_inode_no].parent;
+	struct fs_inode *inode = &inode_table[par_inode_no];
+	if(inode->isvalid != 2) {
+		return -1;
 	}
-	return -1;
+	if(!dir_name_of(par_inode_no, dir_inode_no, name) || !dir_remove(par_inode_no, name)) {
+		return -1;
+	}
+	dcache_remove(par_inode_no, name);
+	inode->size--;
+	inode_mark_dirty(par_inode_no);
+	return 0;
+}
+
+static void dir_release(int dir_inode_no);
+
+//helper fn
+static void release_entry(struct dir_block *entry, void *arg) {
+	if(entry->type==1) { //directory
+		dir_release(entry->inode_num);
+	} else {
+		inode_release(entry->inode_num);
+	}
+}
+
+//helper fn
+//frees a directory and everything below it. entries are not removed one by
+//one since the whole directory goes away
+static void dir_release(int dir_inode_no) {
+	dir_iterate(dir_inode_no, release_entry, NULL);
+	dcache_forget(dir_inode_no);
+	inode_release(dir_inode_no);
 }
 
-int fs_delete_dir(int dir_inode_no) {
+static int do_delete_dir(int dir_inode_no) {
 
 	if(is_mounted == 0) {
 		printf("File system not mounted\n");
@@ -852,42 +3163,288 @@ int fs_delete_dir(int dir_inode_no) {
 		printf("Cannot delete root directory\n");
 		return -1;
 	}
-	union fs_block block;
-	union fs_block dir_block;
+	if(!is_valid_inumber(dir_inode_no) || inode_table[dir_inode_no].isvalid!=2) {
+		return -1;
+	}
 
-	
+	if(update_parent_inode_data_after_deletion(dir_inode_no)==-1) {
+		return -1;
+	}
 
+	dir_release(dir_inode_no);
+	inode_sync();
+	return 0;
+}
 
-	int dir_inode_block_idx = dir_inode_no % INODES_PER_BLOCK;
-	int dir_block_idx       = dir_inode_no/INODES_PER_BLOCK+1;
-	if(update_parent_inode_data_after_deletion(dir_inode_no)==-1) {
+//helper fn
+//shares the mount lock and takes the lock of a valid inode of the mounted
+//file system, exclusively if write is set. returns 0 with nothing held if
+//there is no such inode. calls that change the file system run as a
+//journal handle, started before any lock another handle may wait for
+static int inode_enter(int inumber, int write) {
+	pthread_rwlock_rdlock(&mount_lock);
+	if(is_mounted == 0 || inode_lock == NULL || !is_valid_inumber(inumber)) {
+		pthread_rwlock_unlock(&mount_lock);
+		return 0;
+	}
+	if(write) {
+		journal_begin();
+		pthread_rwlock_wrlock(&inode_lock[inumber]);
+	} else {
+		pthread_rwlock_rdlock(&inode_lock[inumber]);
+	}
+	return 1;
+}
+
+//helper fn
+static void inode_leave(int inumber, int write) {
+	pthread_rwlock_unlock(&inode_lock[inumber]);
+	if(write) {
+		journal_end();
+	}
+	pthread_rwlock_unlock(&mount_lock);
+}
+
+//helper fn
+static void ns_enter(int write) {
+	pthread_rwlock_rdlock(&mount_lock);
+	if(write) {
+		journal_begin();
+	}
+	pthread_mutex_lock(&ns_lock);
+}
+
+//helper fn
+static void ns_leave(int write) {
+	pthread_mutex_unlock(&ns_lock);
+	if(write) {
+		journal_end();
+	}
+	pthread_rwlock_unlock(&mount_lock);
+}
+
+//the calls below can be made from any number of threads. they take the
+//locks described at the top and leave the work to the functions above
+
+int fs_format()
+{
+	int64_t start = stats_begin(FS_OP_FORMAT);
+	pthread_rwlock_wrlock(&mount_lock);
+	int result = do_format();
+	pthread_rwlock_unlock(&mount_lock);
+	stats_end(FS_OP_FORMAT, start);
+	return result;
+}
+
+int fs_mount()
+{
+	int64_t start = stats_begin(FS_OP_MOUNT);
+	pthread_rwlock_wrlock(&mount_lock);
+	int result = do_mount();
+	pthread_rwlock_unlock(&mount_lock);
+	stats_end(FS_OP_MOUNT, start);
+	return result;
+}
+
+int fs_unmount()
+{
+	int64_t start = stats_begin(FS_OP_UNMOUNT);
+	pthread_rwlock_wrlock(&mount_lock);
+	int result = do_unmount();
+	pthread_rwlock_unlock(&mount_lock);
+	stats_end(FS_OP_UNMOUNT, start);
+	return result;
+}
+
+void fs_debug()
+{
+	ns_enter(0);
+	do_debug();
+	ns_leave(0);
+}
+
+int fs_create(int dir_inode_no, char* file_name)
+{
+	int64_t start = stats_begin(FS_OP_CREATE);
+	ns_enter(1);
+	int result = do_create(dir_inode_no, file_name);
+	ns_leave(1);
+	stats_end(FS_OP_CREATE, start);
+	return result;
+}
+
+int fs_delete( int inumber, int dir_inode_no)
+{
+	int64_t start = stats_begin(FS_OP_DELETE);
+	ns_enter(1);
+	int result = do_delete(inumber, dir_inode_no);
+	ns_leave(1);
+	stats_end(FS_OP_DELETE, start);
+	return result;
+}
+
+int64_t fs_getsize( int inumber )
+{
+	if(!inode_enter(inumber, 0)) {
 		return -1;
 	}
-	disk_read(dir_block_idx, block.data);
+	int64_t size = do_getsize(inumber);
+	inode_leave(inumber, 0);
+	return size;
+}
 
-	
+//free data blocks and inodes, the sums of the group counts
+void fs_usage( int *free_blocks, int *free_inodes )
+{
+	*free_blocks = *free_inodes = 0;
+	pthread_rwlock_rdlock(&mount_lock);
+	if(is_mounted == 0 || groups == NULL) {
+		pthread_rwlock_unlock(&mount_lock);
+		return;
+	}
+	for(int g=0; g<super.ngroups; g++) {
+		*free_blocks += __atomic_load_n(&groups[g].free_blocks, __ATOMIC_RELAXED);
+		*free_inodes += __atomic_load_n(&groups[g].free_inodes, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_unlock(&mount_lock);
+}
 
-	int dir_entry_block_idx = block.inode[dir_inode_block_idx].indirect;
-	int dir_entry_sz        = block.inode[dir_inode_block_idx].size;
-    //update paren
-
-	if(dir_entry_sz>0) {
-		disk_read(dir_entry_block_idx, dir_block.data);
-		for(int i=0;i<dir_entry_sz;i++) {
-			if(block.dir[i].type==1) { //directory
-				fs_delete_dir(dir_block.dir[i].inode_num);
-			} else {
-				fs_delete(dir_block.dir[i].inode_num, dir_inode_no);
-			}
-		}
+int fs_read( int inumber, char *data, int length, int64_t offset )
+{
+	int64_t start = stats_begin(FS_OP_READ);
+	int result = 0;
+	if(inode_enter(inumber, 0)) {
+		result = do_read(inumber, data, length, offset);
+		inode_leave(inumber, 0);
+	}
+	stats_end(FS_OP_READ, start);
+	return result;
+}
+
+int fs_write( int inumber, const char *data, int length, int64_t offset )
+{
+	int64_t start = stats_begin(FS_OP_WRITE);
+	int result = 0;
+	if(inode_enter(inumber, 1)) {
+		result = do_write(inumber, data, length, offset);
+		inode_leave(inumber, 1);
 	}
-	disk_read(dir_block_idx, block.data); //re reading the block to sync the changes with file deletion
-	block.inode[dir_inode_block_idx].size = 0;
-	block.inode[dir_inode_block_idx].isvalid = 0;
-	for(int i=0; i<POINTERS_PER_INODE;i++) {
-		block.inode[dir_inode_block_idx].attr.direct[i]=0;
+	stats_end(FS_OP_WRITE, start);
+	return result;
+}
+
+int fs_truncate( int inumber, int64_t length )
+{
+	int64_t start = stats_begin(FS_OP_TRUNCATE);
+	int result = 0;
+	if(inode_enter(inumber, 1)) {
+		result = do_truncate(inumber, length);
+		inode_leave(inumber, 1);
 	}
-	block.inode[dir_inode_block_idx].indirect = 0;
-	disk_write(dir_block_idx, block.data);
-	return 0;
+	stats_end(FS_OP_TRUNCATE, start);
+	return result;
+}
+
+int fs_reserve( int inumber, int64_t length )
+{
+	int64_t start = stats_begin(FS_OP_RESERVE);
+	int result = 0;
+	if(inode_enter(inumber, 1)) {
+		result = do_reserve(inumber, length);
+		inode_leave(inumber, 1);
+	}
+	stats_end(FS_OP_RESERVE, start);
+	return result;
+}
+
+int fs_punch( int inumber, int64_t offset, int64_t length )
+{
+	int64_t start = stats_begin(FS_OP_PUNCH);
+	int result = 0;
+	if(inode_enter(inumber, 1)) {
+		result = do_punch(inumber, offset, length);
+		inode_leave(inumber, 1);
+	}
+	stats_end(FS_OP_PUNCH, start);
+	return result;
+}
+
+int fs_lookup( const char *path )
+{
+	int64_t start = stats_begin(FS_OP_LOOKUP);
+	ns_enter(0);
+	int result = do_lookup(path);
+	ns_leave(0);
+	stats_end(FS_OP_LOOKUP, start);
+	return result;
+}
+
+int fs_create_batch( int dir_inumber, const char **names, int count, int *inumbers )
+{
+	int64_t start = stats_begin(FS_OP_CREATE);
+	ns_enter(1);
+	int result = do_create_batch(dir_inumber, names, count, inumbers);
+	ns_leave(1);
+	stats_end(FS_OP_CREATE, start);
+	return result;
+}
+
+int fs_readdir( int dir_inumber, struct fs_dirent *entries, int max )
+{
+	int64_t start = stats_begin(FS_OP_READDIR);
+	ns_enter(0);
+	int result = do_readdir(dir_inumber, entries, max);
+	ns_leave(0);
+	stats_end(FS_OP_READDIR, start);
+	return result;
+}
+
+int fs_create_file(const char* path)
+{
+	int64_t start = stats_begin(FS_OP_CREATE);
+	ns_enter(1);
+	int result = do_create_file(path);
+	ns_leave(1);
+	stats_end(FS_OP_CREATE, start);
+	return result;
+}
+
+int fs_delete_file(const char* path)
+{
+	int64_t start = stats_begin(FS_OP_DELETE);
+	ns_enter(1);
+	int result = do_delete_file(path);
+	ns_leave(1);
+	stats_end(FS_OP_DELETE, start);
+	return result;
+}
+
+int fs_create_dir(char* dir_path)
+{
+	int64_t start = stats_begin(FS_OP_MKDIR);
+	ns_enter(1);
+	int result = do_create_dir(dir_path);
+	ns_leave(1);
+	stats_end(FS_OP_MKDIR, start);
+	return result;
+}
+
+int fs_delete_dir(int dir_inode_no)
+{
+	int64_t start = stats_begin(FS_OP_RMDIR);
+	ns_enter(1);
+	int result = do_delete_dir(dir_inode_no);
+	ns_leave(1);
+	stats_end(FS_OP_RMDIR, start);
+	return result;
+}
+
+void fs_stats( struct fs_stats *stats )
+{
+	stats_read(stats);
+}
+
+void fs_stats_reset()
+{
+	stats_reset();
 }
@@ -1,17 +1,43 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdint.h>
+#include "stats.h"
+
+#define FS_NAME_SIZE 24    //names are at most FS_NAME_SIZE-1 characters
+
+//a directory entry as listed by fs_readdir
+struct fs_dirent {
+	char name[FS_NAME_SIZE];
+	int  inumber;
+	int  type;             //1 for a directory, 0 for a file
+};
+
 void fs_debug();
 int  fs_format();
 int  fs_mount();
+int  fs_unmount();
 
 int  fs_create();
 int  fs_delete( int inumber, int dir_inumber);
-int  fs_getsize();
+int64_t fs_getsize( int inumber );
+void fs_usage( int *free_blocks, int *free_inodes );
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+int  fs_read( int inumber, char *data, int length, int64_t offset );
+int  fs_write( int inumber, const char *data, int length, int64_t offset );
+int  fs_truncate( int inumber, int64_t length );
+int  fs_reserve( int inumber, int64_t length );
+int  fs_punch( int inumber, int64_t offset, int64_t length );
 int fs_delete_dir(int dir_inode_no);
 int fs_create_dir(char* dir_path);
+int fs_lookup( const char *path );
+int fs_create_file(const char* path);
+int fs_delete_file(const char* path);
+int fs_create_batch( int dir_inumber, const char **names, int count, int *inumbers );
+int fs_readdir( int dir_inumber, struct fs_dirent *entries, int max );
+
+//statistics of all calls since the start or the last fs_stats_reset
+void fs_stats( struct fs_stats *stats );
+void fs_stats_reset();
 
 #endif
@@ -0,0 +1,634 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "disk.h"
+#include "journal.h"
+#include "stats.h"
+
+#define JOURNAL_MAGIC 0x4a524e4c
+#define DESC_MAGIC    0x4a445343
+#define COMMIT_MAGIC  0x4a434d54
+#define DESC_ENTRIES  1020       //home blocks and revoked blocks listed by one descriptor
+#define JOURNAL_HASH  1024
+
+//first block of the journal. the transactions from seq on, starting at
+//log block tail, are committed but their blocks may not be home yet.
+//a checkpoint writes every committed block home and moves tail up
+struct journal_super {
+	int magic;
+	int nblocks;
+	int seq;
+	int tail;
+};
+
+//a transaction goes to the log as one sequential write: a descriptor, the
+//copies of the blocks it lists and a commit block with a checksum over the
+//descriptor and the copies. a transaction that doesn't fit before the end
+//of the journal starts over at log block 1. revoked blocks were freed, so
+//older copies of them must not be replayed over what the block holds now
+struct journal_desc {
+	int magic;
+	int seq;
+	int nblocks;
+	int nrevoke;
+	int entry[DESC_ENTRIES];  //home blocks of the copies, then revoked blocks
+};
+
+struct journal_commit {
+	int magic;
+	int seq;
+	uint64_t checksum;
+};
+
+//the newest copy of a metadata block that isn't home yet. a block written
+//again while its copy is being committed gets a new copy for the running
+//transaction, ahead of the old one on its hash chain
+struct jbuf {
+	int blocknum;
+	int txn;
+	struct jbuf *next;
+	char data[DISK_BLOCK_SIZE];
+};
+
+struct int_list {
+	int *v;
+	int n;
+	int cap;
+};
+
+//blocks written, revoked and freed by the handles of one transaction
+struct transaction {
+	int id;
+	struct jbuf **blocks;
+	int nblocks;
+	int cap;
+	struct int_list revoked;
+	struct int_list freed;        //given back to the allocator once committed
+};
+
+static int  active;
+static int  jstart;               //journal superblock
+static int  jsize;                //blocks in the journal, superblock included
+static int  head;                 //log block the next transaction is written at
+static int  used;                 //log blocks in use since the last checkpoint
+static int  next_seq;
+static char *log_buf;             //one transaction as it is written or read
+static struct jbuf *hash[JOURNAL_HASH];
+static int  nbufs;                //copies on the hash chains, read without the lock
+static struct transaction running;
+static int  nhandles;
+static int  locked;               //running transaction is being closed, new handles wait
+static int  stopping;
+static void (*release_fn)( int blocknum );
+
+static pthread_t       commit_thread;
+static pthread_mutex_t jlock         = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  handles_done  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  unlocked      = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  commit_wakeup = PTHREAD_COND_INITIALIZER;
+
+//helper fn
+static void *checked( void *p )
+{
+	if(!p) {
+		printf("ERROR: out of memory for the journal\n");
+		abort();
+	}
+	return p;
+}
+
+//helper fn
+static void list_add( struct int_list *list, int v )
+{
+	if(list->n==list->cap) {
+		list->cap = list->cap ? 2*list->cap : 64;
+		list->v   = checked(realloc(list->v, list->cap*sizeof(int)));
+	}
+	list->v[list->n++] = v;
+}
+
+//helper fn
+static void list_remove( struct int_list *list, int v )
+{
+	for(int i=0;i<list->n;i++) {
+		if(list->v[i]==v) {
+			list->v[i] = list->v[--list->n];
+			return;
+		}
+	}
+}
+
+//helper fn
+static uint64_t checksum( const char *data, size_t len )
+{
+	const uint64_t *w = (const uint64_t*)data;
+	uint64_t h = 14695981039346656037ULL;
+	for(size_t i=0;i<len/8;i++) {
+		h = (h ^ w[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+
+//helper fn
+//writes the journal superblock straight to the disk
+static void super_write( int seq, int tail )
+{
+	memset(log_buf, 0, DISK_BLOCK_SIZE);
+	struct journal_super *sb = (struct journal_super*)log_buf;
+	sb->magic   = JOURNAL_MAGIC;
+	sb->nblocks = jsize;
+	sb->seq     = seq;
+	sb->tail    = tail;
+	disk_submit(1, jstart, 1, log_buf, 0);
+	disk_drain();
+	disk_sync();
+}
+
+//helper fn
+//newest copy of a block, called with jlock held
+static struct jbuf *hash_find( int blocknum )
+{
+	struct jbuf *b = hash[blocknum%JOURNAL_HASH];
+	while(b && b->blocknum!=blocknum) {
+		b = b->next;
+	}
+	return b;
+}
+
+//helper fn
+static void hash_remove( struct jbuf *b )
+{
+	struct jbuf **p = &hash[b->blocknum%JOURNAL_HASH];
+	while(*p!=b) {
+		p = &(*p)->next;
+	}
+	*p = b->next;
+	__atomic_fetch_sub(&nbufs, 1, __ATOMIC_RELAXED);
+}
+
+//helper fn
+//reads the transaction with sequence number seq at log block pos into
+//log_buf. returns its length in blocks, 0 if no complete transaction with
+//that number is there
+static int txn_read( int pos, int seq )
+{
+	if(pos<1 || pos+2>jsize) {
+		return 0;
+	}
+	disk_read(jstart+pos, log_buf);
+	struct journal_desc *d = (struct journal_desc*)log_buf;
+	if(d->magic!=DESC_MAGIC || d->seq!=seq || d->nblocks<0 || d->nrevoke<0
+	   || d->nblocks+d->nrevoke>DESC_ENTRIES || pos+d->nblocks+2>jsize) {
+		return 0;
+	}
+	int len = d->nblocks+2;
+	disk_submit(0, jstart+pos+1, len-1, log_buf+DISK_BLOCK_SIZE, 0);
+	disk_drain();
+	struct journal_commit *c = (struct journal_commit*)(log_buf+(size_t)(len-1)*DISK_BLOCK_SIZE);
+	if(c->magic!=COMMIT_MAGIC || c->seq!=seq || c->checksum!=checksum(log_buf, (size_t)(len-1)*DISK_BLOCK_SIZE)) {
+		return 0;                     //torn write, the transaction never committed
+	}
+	return len;
+}
+
+//helper fn
+//finds the next transaction after one that ended at pos, which may have
+//started over at log block 1
+static int txn_find( int *pos, int seq )
+{
+	int len = txn_read(*pos, seq);
+	if(len==0 && *pos!=1) {
+		len = txn_read(1, seq);
+		if(len) {
+			*pos = 1;
+		}
+	}
+	return len;
+}
+
+struct revoke {
+	int blocknum;
+	int seq;
+};
+
+//helper fn
+static int revoke_cmp( const void *a, const void *b )
+{
+	const struct revoke *x = a, *y = b;
+	if(x->blocknum!=y->blocknum) {
+		return x->blocknum<y->blocknum ? -1 : 1;
+	}
+	return x->seq<y->seq ? 1 : x->seq>y->seq ? -1 : 0;
+}
+
+//helper fn
+//latest transaction that revoked blocknum, 0 if none did
+static int revoked_in( struct revoke *r, int n, int blocknum )
+{
+	int lo = 0, hi = n;
+	while(lo<hi) {
+		int mid = (lo+hi)/2;
+		if(r[mid].blocknum<blocknum) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo<n && r[lo].blocknum==blocknum ? r[lo].seq : 0;
+}
+
+//helper fn
+//writes the blocks of every complete transaction in the journal home. a
+//copy is skipped if its block was revoked by the same or a later
+//transaction. the first pass collects the revokes, the second replays
+static int replay( int seq, int tail )
+{
+	struct revoke *revokes = 0;
+	int nrevokes = 0, cap = 0;
+	int pos = tail, s = seq, len;
+	while((len = txn_find(&pos, s))>0) {
+		struct journal_desc *d = (struct journal_desc*)log_buf;
+		for(int i=0;i<d->nrevoke;i++) {
+			if(nrevokes==cap) {
+				cap     = cap ? 2*cap : 256;
+				revokes = checked(realloc(revokes, cap*sizeof(struct revoke)));
+			}
+			revokes[nrevokes++] = (struct revoke){d->entry[d->nblocks+i], s};
+		}
+		pos += len;
+		s++;
+	}
+	qsort(revokes, nrevokes, sizeof(struct revoke), revoke_cmp);
+
+	int count = s-seq;
+	pos = tail;
+	for(s=seq; (len = txn_find(&pos, s))>0; s++) {
+		struct journal_desc *d = (struct journal_desc*)log_buf;
+		for(int i=0;i<d->nblocks;i++) {
+			if(revoked_in(revokes, nrevokes, d->entry[i])<s) {
+				disk_write(d->entry[i], log_buf+(size_t)(i+1)*DISK_BLOCK_SIZE);
+			}
+		}
+		pos += len;
+	}
+	free(revokes);
+	next_seq = s;
+	return count;
+}
+
+//helper fn
+//makes room for a transaction of len blocks in the log, starting over at
+//log block 1 when it doesn't fit before the end
+static void checkpoint();
+static void log_space( int len )
+{
+	int skip = head+len>jsize ? jsize-head : 0;
+	if(used+skip+len>jsize-1) {
+		checkpoint();
+	} else if(skip) {
+		used += skip;
+		head  = 1;
+	}
+}
+
+//helper fn
+//every committed block has been handed to the disk with disk_write by now.
+//once they are on the disk the log is no longer needed and starts over
+static void checkpoint()
+{
+	disk_flush();
+	disk_sync();
+	head = 1;
+	used = 0;
+	super_write(next_seq, 1);
+}
+
+//helper fn
+//waits for the handles of the running transaction to finish and starts a
+//new one. the closed transaction is returned in t
+static void txn_close( struct transaction *t )
+{
+	pthread_mutex_lock(&jlock);
+	locked = 1;
+	while(nhandles>0) {
+		pthread_cond_wait(&handles_done, &jlock);
+	}
+	*t = running;
+	memset(&running, 0, sizeof(running));
+	running.id = t->id+1;
+	locked = 0;
+	pthread_cond_broadcast(&unlocked);
+	pthread_mutex_unlock(&jlock);
+}
+
+//helper fn
+//logs a closed transaction and then writes its blocks home. one larger
+//than a descriptor or the journal can take is logged as several journal
+//transactions in a row, so after a crash only a prefix of it may survive
+static void txn_commit( struct transaction *t )
+{
+	int nb = 0, nr = 0;
+	while(nb<t->nblocks || nr<t->revoked.n) {
+		int k = t->nblocks-nb;
+		if(k>DESC_ENTRIES) {
+			k = DESC_ENTRIES;
+		}
+		if(k>jsize-3) {
+			k = jsize-3;
+		}
+		//revokes go after the last copy, so no copy of a block is logged
+		//after the transaction revoking it
+		int r = nb+k==t->nblocks ? t->revoked.n-nr : 0;
+		if(r>DESC_ENTRIES-k) {
+			r = DESC_ENTRIES-k;
+		}
+		int len = k+2;
+
+		memset(log_buf, 0, DISK_BLOCK_SIZE);
+		struct journal_desc *d = (struct journal_desc*)log_buf;
+		d->magic   = DESC_MAGIC;
+		d->seq     = next_seq;
+		d->nblocks = k;
+		d->nrevoke = r;
+		for(int i=0;i<k;i++) {
+			d->entry[i] = t->blocks[nb+i]->blocknum;
+			memcpy(log_buf+(size_t)(i+1)*DISK_BLOCK_SIZE, t->blocks[nb+i]->data, DISK_BLOCK_SIZE);
+		}
+		memcpy(&d->entry[k], t->revoked.v+nr, r*sizeof(int));
+		char *end = log_buf+(size_t)(len-1)*DISK_BLOCK_SIZE;
+		memset(end, 0, DISK_BLOCK_SIZE);
+		struct journal_commit *c = (struct journal_commit*)end;
+		c->magic    = COMMIT_MAGIC;
+		c->seq      = next_seq;
+		c->checksum = checksum(log_buf, (size_t)(len-1)*DISK_BLOCK_SIZE);
+
+		log_space(len);
+		disk_submit(1, jstart+head, len, log_buf, 0);
+		disk_drain();
+		disk_sync();
+		head += len;
+		used += len;
+		next_seq++;
+
+		//committed, so the copies can go home. readers look at the copy
+		//until it is off the hash chain and at the disk after that
+		for(int i=0;i<k;i++) {
+			disk_write(t->blocks[nb+i]->blocknum, t->blocks[nb+i]->data);
+		}
+		pthread_mutex_lock(&jlock);
+		for(int i=0;i<k;i++) {
+			hash_remove(t->blocks[nb+i]);
+		}
+		pthread_mutex_unlock(&jlock);
+		for(int i=0;i<k;i++) {
+			free(t->blocks[nb+i]);
+		}
+		nb += k;
+		nr += r;
+	}
+	for(int i=0;i<t->freed.n;i++) {
+		release_fn(t->freed.v[i]);
+	}
+	free(t->blocks);
+	free(t->revoked.v);
+	free(t->freed.v);
+}
+
+//helper fn
+//commits the running transaction if it holds anything. the log is
+//checkpointed once it is half full, so commits rarely have to wait for one
+static void journal_commit()
+{
+	pthread_mutex_lock(&jlock);
+	int empty = running.nblocks==0 && running.revoked.n==0 && running.freed.n==0;
+	pthread_mutex_unlock(&jlock);
+	if(empty) {
+		return;
+	}
+	struct transaction t;
+	txn_close(&t);
+	txn_commit(&t);
+	if(used>(jsize-1)/2) {
+		checkpoint();
+	}
+}
+
+//helper fn
+//commit thread: group commit of everything the handles did in the last
+//JOURNAL_COMMIT_MS, sooner if the transaction grows large
+static void *commit_main( void *arg )
+{
+	pthread_mutex_lock(&jlock);
+	while(!stopping) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += JOURNAL_COMMIT_MS*1000000L;
+		until.tv_sec  += until.tv_nsec/1000000000L;
+		until.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&commit_wakeup, &jlock, &until);
+		if(stopping) {
+			break;
+		}
+		pthread_mutex_unlock(&jlock);
+		journal_commit();
+		pthread_mutex_lock(&jlock);
+	}
+	pthread_mutex_unlock(&jlock);
+	return 0;
+}
+
+//writes an empty journal of nblocks blocks starting at block start. the
+//log is cleared as well: sequence numbers start over at 1, so transactions
+//left from before must not look like the next one to replay
+int journal_format( int start, int nblocks )
+{
+	struct journal_super sb;
+	char block[DISK_BLOCK_SIZE];
+	memset(block, 0, sizeof(block));
+	for(int i=1; i<nblocks; i++) {
+		disk_write(start+i, block);
+	}
+	sb.magic   = JOURNAL_MAGIC;
+	sb.nblocks = nblocks;
+	sb.seq     = 1;
+	sb.tail    = 1;
+	memcpy(block, &sb, sizeof(sb));
+	disk_write(start, block);
+	return 1;
+}
+
+//replays the journal at start and starts committing to it. freed blocks
+//are handed to release once the transaction freeing them has committed.
+//returns the number of transactions replayed, -1 if there is no journal
+int journal_open( int start, int nblocks, void (*release)( int blocknum ) )
+{
+	journal_close();
+	if(posix_memalign((void**)&log_buf, DISK_BLOCK_SIZE, (size_t)(DESC_ENTRIES+2)*DISK_BLOCK_SIZE)!=0) {
+		log_buf = 0;
+		return -1;
+	}
+	jstart = start;
+	jsize  = nblocks;
+	disk_read(jstart, log_buf);
+	struct journal_super sb = *(struct journal_super*)log_buf;
+	if(sb.magic!=JOURNAL_MAGIC || sb.nblocks!=nblocks || sb.tail<1 || sb.tail>=nblocks) {
+		free(log_buf);
+		log_buf = 0;
+		return -1;
+	}
+
+	int count = replay(sb.seq, sb.tail);
+	head = sb.tail;
+	used = 0;
+	if(count>0) {
+		checkpoint();                  //replayed blocks are home, the log starts over
+	}
+
+	memset(&running, 0, sizeof(running));
+	running.id = 1;
+	release_fn = release;
+	stopping   = 0;
+	nhandles   = 0;
+	locked     = 0;
+	active     = 1;
+	if(pthread_create(&commit_thread, 0, commit_main, 0)!=0) {
+		active = 0;
+		free(log_buf);
+		log_buf = 0;
+		return -1;
+	}
+	return count;
+}
+
+//commits what is left, checkpoints and stops the commit thread
+void journal_close()
+{
+	if(!active) {
+		return;
+	}
+	pthread_mutex_lock(&jlock);
+	stopping = 1;
+	pthread_cond_signal(&commit_wakeup);
+	pthread_mutex_unlock(&jlock);
+	pthread_join(commit_thread, 0);
+	journal_commit();
+	checkpoint();
+	active = 0;
+	free(log_buf);
+	log_buf = 0;
+}
+
+//starts a handle. a handle must not be started while the caller holds
+//locks that another handle may wait for
+void journal_begin()
+{
+	if(!active) {
+		return;
+	}
+	pthread_mutex_lock(&jlock);
+	while(locked) {
+		pthread_cond_wait(&unlocked, &jlock);
+	}
+	nhandles++;
+	pthread_mutex_unlock(&jlock);
+}
+
+void journal_end()
+{
+	if(!active) {
+		return;
+	}
+	pthread_mutex_lock(&jlock);
+	if(--nhandles==0) {
+		pthread_cond_signal(&handles_done);
+	}
+	pthread_mutex_unlock(&jlock);
+}
+
+//adds a metadata block to the running transaction. without an open journal
+//the block is written straight away
+void journal_write( int blocknum, const char *data )
+{
+	if(!active) {
+		disk_write(blocknum, data);
+		return;
+	}
+	pthread_mutex_lock(&jlock);
+	struct jbuf *b = hash_find(blocknum);
+	if(b==0 || b->txn!=running.id) {
+		b = checked(malloc(sizeof(struct jbuf)));
+		b->blocknum = blocknum;
+		b->txn      = running.id;
+		b->next     = hash[blocknum%JOURNAL_HASH];
+		hash[blocknum%JOURNAL_HASH] = b;
+		__atomic_fetch_add(&nbufs, 1, __ATOMIC_RELAXED);
+		if(running.nblocks==running.cap) {
+			running.cap    = running.cap ? 2*running.cap : 64;
+			running.blocks = checked(realloc(running.blocks, running.cap*sizeof(struct jbuf*)));
+		}
+		running.blocks[running.nblocks++] = b;
+		if(running.nblocks==(jsize-3)/2) {
+			pthread_cond_signal(&commit_wakeup);   //half the log, commit early
+		}
+	}
+	memcpy(b->data, data, DISK_BLOCK_SIZE);
+	list_remove(&running.revoked, blocknum);    //in use again
+	pthread_mutex_unlock(&jlock);
+}
+
+//copies the newest version of a block into data if the journal holds one
+//that isn't home yet. returns 0 if the disk has the newest version
+int journal_read( int blocknum, char *data )
+{
+	if(!active || __atomic_load_n(&nbufs, __ATOMIC_RELAXED)==0) {
+		return 0;
+	}
+	pthread_mutex_lock(&jlock);
+	struct jbuf *b = hash_find(blocknum);
+	if(b) {
+		memcpy(data, b->data, DISK_BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&jlock);
+	if(b) {
+		stats_event(FS_EV_JOURNAL_HIT, 1);
+	}
+	return b!=0;
+}
+
+//frees a metadata block. it goes back to the allocator only after the
+//transaction has committed, so it can't be overwritten by new data while
+//a crash could still bring back the metadata pointing at it
+void journal_free( int blocknum )
+{
+	if(!active) {
+		if(release_fn) {
+			release_fn(blocknum);
+		}
+		return;
+	}
+	pthread_mutex_lock(&jlock);
+	list_add(&running.revoked, blocknum);
+	list_add(&running.freed, blocknum);
+	pthread_mutex_unlock(&jlock);
+}
+
+//frees a file data block. data is written in place and never logged, so
+//there is nothing to revoke, but the block still waits for the commit: if
+//another file wrote into it first, a crash could bring back the freeing
+//file pointing at the other file's data
+void journal_release( int blocknum )
+{
+	if(!active) {
+		if(release_fn) {
+			release_fn(blocknum);
+		}
+		return;
+	}
+	pthread_mutex_lock(&jlock);
+	list_add(&running.freed, blocknum);
+	pthread_mutex_unlock(&jlock);
+}
@@ -0,0 +1,24 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_BLOCKS     1024  //largest journal format reserves (4 MiB)
+#define JOURNAL_MIN_BLOCKS 8
+#define JOURNAL_COMMIT_MS  5     //running transaction is committed at least this often
+
+//write-ahead journal for metadata blocks. every call that changes the file
+//system runs as a handle between journal_begin and journal_end, and the
+//blocks it writes with journal_write join the running transaction. a
+//background thread commits the transaction, with the handles of all
+//threads that ran meanwhile, as one sequential write to the journal and
+//only then writes the blocks to their home locations
+int  journal_format( int start, int nblocks );
+int  journal_open( int start, int nblocks, void (*release)( int blocknum ) );
+void journal_close();
+void journal_begin();
+void journal_end();
+void journal_write( int blocknum, const char *data );
+int  journal_read( int blocknum, char *data );
+void journal_free( int blocknum );
+void journal_release( int blocknum );
+
+#endif
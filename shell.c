@@ -1,5 +1,6 @@
 #include "fs.h"
 #include "disk.h"
+#include "transfer.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,6 +9,8 @@
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int parse_inode( const char *arg );
+static void do_stats();
 
 int main( int argc, char *argv[] )
 {
@@ -15,18 +18,36 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
-	int inumber, result, args;
+	char arg3[1024];
+	int inumber, args;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	if(argc<3 || argc>5) {
+		printf("use: %s <diskfile> <nblocks> [cache blocks] [direct|mmap]\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	int disk_flags = 0;
+	if(argc==5) {
+		if(!strcmp(argv[4],"direct")) {
+			disk_flags = DISK_DIRECT;
+		} else if(!strcmp(argv[4],"mmap")) {
+			disk_flags = DISK_MMAP;
+		} else {
+			printf("unknown disk mode: %s\n",argv[4]);
+			return 1;
+		}
+	}
+
+	if(!disk_open(argv[1],atoi(argv[2]),disk_flags)) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
 
+	if(argc>=4 && !disk_cache_init(atoi(argv[3]))) {
+		printf("couldn't allocate a cache of %s blocks\n",argv[3]);
+		return 1;
+	}
+
 	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
 
 	while(1) {
@@ -38,7 +59,7 @@ int main( int argc, char *argv[] )
 		if(line[0]=='\n') continue;
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+		args = sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3);
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
@@ -61,6 +82,25 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: mount\n");
 			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(fs_unmount()) {
+					printf("disk unmounted.\n");
+				} else {
+					printf("unmount failed!\n");
+				}
+			} else {
+				printf("use: unmount\n");
+			}
+		} else if(!strcmp(cmd,"stats")) {
+			if(args==1) {
+				do_stats();
+			} else if(args==2 && !strcmp(arg1,"reset")) {
+				fs_stats_reset();
+				printf("statistics reset.\n");
+			} else {
+				printf("use: stats [reset]\n");
+			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
 				fs_debug();
@@ -69,10 +109,10 @@ int main( int argc, char *argv[] )
 			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
-				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
+				inumber = parse_inode(arg1);
+				int64_t size = fs_getsize(inumber);
+				if(size>=0) {
+					printf("inode %d has size %lld\n",inumber,(long long)size);
 				} else {
 					printf("getsize failed!\n");
 				}
@@ -80,8 +120,39 @@ int main( int argc, char *argv[] )
 				printf("use: getsize <inumber>\n");
 			}
 			
-		} else if(!strcmp(cmd,"create")) {
+		} else if(!strcmp(cmd,"truncate")) {
 			if(args==3) {
+				inumber = parse_inode(arg1);
+				if(fs_truncate(inumber,atoll(arg2))) {
+					printf("inode %d truncated to %lld bytes\n",inumber,atoll(arg2));
+				} else {
+					printf("truncate failed!\n");
+				}
+			} else {
+				printf("use: truncate <inumber|path> <size>\n");
+			}
+
+		} else if(!strcmp(cmd,"punch")) {
+			if(args==4) {
+				inumber = parse_inode(arg1);
+				if(fs_punch(inumber,atoll(arg2),atoll(arg3))) {
+					printf("punched %lld bytes at %lld out of inode %d\n",atoll(arg3),atoll(arg2),inumber);
+				} else {
+					printf("punch failed!\n");
+				}
+			} else {
+				printf("use: punch <inumber|path> <offset> <length>\n");
+			}
+
+		} else if(!strcmp(cmd,"create")) {
+			if(args==2) {
+				inumber = fs_create_file(arg1);
+				if(inumber>=0) {
+					printf("created inode %d\n",inumber);
+				} else {
+					printf("create failed!\n");
+				}
+			} else if(args==3) {
 				int dir_inode_no = atoi(arg1);
 				inumber = fs_create(dir_inode_no, arg2);
 				if(inumber>=0) {
@@ -90,10 +161,16 @@ int main( int argc, char *argv[] )
 					printf("create failed!\n");
 				}
 			} else {
-				printf("use: create <dir inode no> <file name>\n");
+				printf("use: create <dir inode no> <file name> | create <path>\n");
 			}
 		} else if(!strcmp(cmd,"delete")) {
-			if(args==3) {
+			if(args==2) {
+				if(fs_delete_file(arg1)) {
+					printf("%s deleted.\n",arg1);
+				} else {
+					printf("delete failed!\n");
+				}
+			} else if(args==3) {
 				inumber         = atoi(arg1);
 				int dir_inumber = atoi(arg2); 
 				if(fs_delete(inumber, dir_inumber)) {
@@ -102,40 +179,58 @@ int main( int argc, char *argv[] )
 					printf("delete failed!\n");	
 				}
 			} else {
-				printf("use: delete <inumber> <dir inumber>\n");
+				printf("use: delete <inumber> <dir inumber> | delete <path>\n");
 			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
-				inumber = atoi(arg1);
+				inumber = parse_inode(arg1);
 				if(!do_copyout(inumber,"/dev/stdout")) {
 					printf("cat failed!\n");
 				}
 			} else {
-				printf("use: cat <inumber>\n");
+				printf("use: cat <inumber|path>\n");
 			}
 
 		} else if(!strcmp(cmd,"copyin")) {
 			if(args==3) {
-				inumber = atoi(arg2);
+				inumber = parse_inode(arg2);
 				if(do_copyin(arg1,inumber)) {
 					printf("copied file %s to inode %d\n",arg1,inumber);
 				} else {
 					printf("copy failed!\n");
 				}
 			} else {
-				printf("use: copyin <filename> <inumber>\n");
+				printf("use: copyin <filename> <inumber|path>\n");
 			}
 
 		} else if(!strcmp(cmd,"copyout")) {
 			if(args==3) {
-				inumber = atoi(arg1);
+				inumber = parse_inode(arg1);
 				if(do_copyout(inumber,arg2)) {
 					printf("copied inode %d to file %s\n",inumber,arg2);
 				} else {
 					printf("copy failed!\n");
 				}
 			} else {
-				printf("use: copyout <inumber> <filename>\n");
+				printf("use: copyout <inumber|path> <filename>\n");
+			}
+
+		} else if(!strcmp(cmd,"import")) {
+			if(args==3) {
+				if(!transfer_import(arg1,arg2)) {
+					printf("import failed!\n");
+				}
+			} else {
+				printf("use: import <host dir> <path>\n");
+			}
+
+		} else if(!strcmp(cmd,"export")) {
+			if(args==3) {
+				if(!transfer_export(arg1,arg2)) {
+					printf("export failed!\n");
+				}
+			} else {
+				printf("use: export <path> <host dir>\n");
 			}
 
 		} else if(!strcmp(cmd, "mkdir")) {
@@ -152,28 +247,51 @@ int main( int argc, char *argv[] )
 
 		} else if(!strcmp(cmd, "rmdir")) {
 			if(args==2) {
-				inumber = atoi(arg1);
+				inumber = parse_inode(arg1);
 				if(fs_delete_dir(inumber)==-1) {
-					printf("directory could not be created.Please provide a valid directory inode num\n");
+					printf("directory could not be removed. Please provide a valid directory inode num\n");
 				} else {
 					printf("directory and its files deleted\n");
 				}
 			} else {
-				printf("use: mkdir <path>\n");
+				printf("use: rmdir <inode>\n");
 			}
 			//test();
 
+		} else if(!strcmp(cmd, "lookup")) {
+			if(args==2) {
+				inumber = fs_lookup(arg1);
+				if(inumber>=0) {
+					printf("%s is inode %d\n",arg1,inumber);
+				} else {
+					printf("%s not found\n",arg1);
+				}
+			} else {
+				printf("use: lookup <path>\n");
+			}
+
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
 			printf("    format\n");
 			printf("    mount\n");
+			printf("    unmount\n");
 			printf("    debug\n");
+			printf("    stats [reset]\n");
 			printf("    create <parent dir inode no> <file name>\n");
+			printf("    create <path>\n");
 			printf("    delete  <inode> <parent dir inode>\n");
+			printf("    delete  <path>\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
+			printf("    import  <host dir> <path>\n");
+			printf("    export  <path> <host dir>\n");
+			printf("    truncate <inode> <size>\n");
+			printf("    punch <inode> <offset> <length>\n");
 			printf("    mkdir <path>\n");
+			printf("    rmdir <inode>\n");
+			printf("    lookup <path>\n");
+			printf("    an <inode> argument can also be given as a path starting with /\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -184,10 +302,10 @@ int main( int argc, char *argv[] )
 		} else {
 			printf("unknown command: %s\n",cmd);
 			printf("type 'help' for a list of commands.\n");
-			result = 1;
 		}
 	}
 
+	fs_unmount();
 	printf("closing emulated disk.\n");
 	disk_close();
 
@@ -196,62 +314,94 @@ int main( int argc, char *argv[] )
 
 static int do_copyin( const char *filename, int inumber )
 {
-	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	int64_t result = transfer_copyin(filename,inumber);
+	if(result<0) {
+		return 0;
+	}
+	printf("%lld bytes copied\n",(long long)result);
+	return 1;
+}
 
-	file = fopen(filename,"r");
-	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
+static int do_copyout( int inumber, const char *filename )
+{
+	fflush(stdout);          //cat writes to the same file descriptor
+	int64_t result = transfer_copyout(inumber,filename);
+	if(result<0) {
 		return 0;
 	}
-    
-    
+	printf("%lld bytes copied\n",(long long)result);
+	return 1;
+}
 
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result<=0) break;
-		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
-			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
-				break;
-			}
-			offset += actual;
-			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
-				break;
-			}
-		}
+//an argument naming a file or directory is either its inode no or,
+//if it starts with a slash, its path
+static int parse_inode( const char *arg )
+{
+	if(arg[0]=='/') {
+		return fs_lookup(arg);
 	}
+	return atoi(arg);
+}
 
-	printf("%d bytes copied\n",offset);
+//upper bound of the histogram bucket holding the q-th fraction of the values
+static uint64_t percentile( const uint64_t *hist, uint64_t total, double q )
+{
+	uint64_t seen = 0;
+	for(int i=0; i<FS_STATS_BUCKETS; i++) {
+		seen += hist[i];
+		if(total>0 && seen>=q*total) {
+			return i==0 ? 0 : 1ULL<<i;
+		}
+	}
+	return 0;
+}
 
-	fclose(file);
-	return 1;
+//prints the non empty buckets of a histogram as upper bound:count
+static void print_histogram( const char *title, const uint64_t *hist )
+{
+	printf("    %s:",title);
+	for(int i=0; i<FS_STATS_BUCKETS; i++) {
+		if(hist[i]) {
+			printf(" %s%llu:%llu",i==FS_STATS_BUCKETS-1 ? ">" : "<",i==FS_STATS_BUCKETS-1 ? 1ULL<<(i-1) : 1ULL<<i,(unsigned long long)hist[i]);
+		}
+	}
+	printf("\n");
 }
 
-static int do_copyout( int inumber, const char *filename )
+static void do_stats()
 {
-	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
+	struct fs_stats s;
+	fs_stats(&s);
 
-	file = fopen(filename,"w");
-	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
-		return 0;
+	printf("%-10s %9s %10s %9s %9s %12s %12s\n","call","calls","avg us","p50 us","p99 us","blocks read","written");
+	for(int op=0; op<FS_OP_COUNT; op++) {
+		struct fs_op_stats *o = &s.op[op];
+		if(o->calls==0 && o->blocks_read==0 && o->blocks_written==0) {
+			continue;
+		}
+		printf("%-10s %9llu %10.1f %9llu %9llu %12llu %12llu\n",stats_op_name(op),(unsigned long long)o->calls,
+			o->calls ? o->nanoseconds/1000.0/o->calls : 0.0,
+			(unsigned long long)percentile(o->latency,o->calls,0.5),(unsigned long long)percentile(o->latency,o->calls,0.99),
+			(unsigned long long)o->blocks_read,(unsigned long long)o->blocks_written);
+		if(o->calls) {
+			print_histogram("latency us",o->latency);
+		}
 	}
 
-	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
-		offset += result;
+	const char *alloc_names[FS_ALLOC_COUNT] = { "block", "inode" };
+	for(int a=0; a<FS_ALLOC_COUNT; a++) {
+		struct fs_alloc_stats *al = &s.alloc[a];
+		if(al->calls==0) {
+			continue;
+		}
+		printf("%s allocations: %llu, %.2f groups and %.2f bitmap words searched on average\n",alloc_names[a],
+			(unsigned long long)al->calls,(double)al->groups/al->calls,(double)al->words/al->calls);
+		print_histogram("words scanned",al->scan);
 	}
 
-	printf("%d bytes copied\n",offset);
-
-	fclose(file);
-	return 1;
+	uint64_t hits = s.event[FS_EV_CACHE_HIT], misses = s.event[FS_EV_CACHE_MISS];
+	printf("cache: %llu hits, %llu misses, %.1f%% hit rate, %llu dirty write backs\n",(unsigned long long)hits,(unsigned long long)misses,
+		hits+misses ? 100.0*hits/(hits+misses) : 0.0,(unsigned long long)s.event[FS_EV_WRITE_BACK]);
+	printf("stream buffer: %llu hits, %llu blocks read ahead\n",(unsigned long long)s.event[FS_EV_STREAM_HIT],(unsigned long long)s.event[FS_EV_READ_AHEAD]);
+	printf("journal: %llu metadata reads served\n",(unsigned long long)s.event[FS_EV_JOURNAL_HIT]);
 }
@@ -0,0 +1,214 @@
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define STATS_WORDS (sizeof(struct fs_stats)/sizeof(uint64_t))
+
+//counters of one thread. only the owner writes them, with a relaxed load
+//and store instead of a locked add, readers load them while it runs
+struct stats_block {
+	struct fs_stats s;
+	struct stats_block *next;
+};
+
+static __thread struct stats_block *mine;
+static __thread int current_op;         //call the thread is in, FS_OP_NONE outside
+static __thread int scanned;            //bitmap words scanned by the running allocation
+
+static struct stats_block *blocks;      //blocks of all live threads
+static struct fs_stats retired;         //counts of threads that have exited
+static struct fs_stats baseline;        //totals at the last stats_reset
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t   stats_key;
+static pthread_once_t  stats_once = PTHREAD_ONCE_INIT;
+
+static const char *op_names[FS_OP_COUNT] = {
+	"other", "create", "delete", "read", "write", "truncate",
+	"mkdir", "rmdir", "lookup", "mount", "unmount", "format", "readdir",
+	"reserve", "punch"
+};
+
+//helper fn
+static void bump( uint64_t *counter, uint64_t n )
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED)+n, __ATOMIC_RELAXED);
+}
+
+//helper fn
+//adds the counters of from to to, reading from with relaxed loads
+static void add_up( struct fs_stats *to, struct fs_stats *from )
+{
+	uint64_t *t = (uint64_t*)to, *f = (uint64_t*)from;
+	for(size_t i=0; i<STATS_WORDS; i++) {
+		t[i] += __atomic_load_n(&f[i], __ATOMIC_RELAXED);
+	}
+}
+
+//helper fn
+//a thread that exits hands its counts over to retired
+static void thread_exit( void *arg )
+{
+	struct stats_block *b = arg;
+	pthread_mutex_lock(&stats_lock);
+	add_up(&retired, &b->s);
+	for(struct stats_block **p=&blocks; *p; p=&(*p)->next) {
+		if(*p==b) {
+			*p = b->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+	free(b);
+}
+
+//helper fn
+static void key_init()
+{
+	pthread_key_create(&stats_key, thread_exit);
+}
+
+//helper fn
+//the block of the calling thread, set up on its first count. returns 0 if
+//there is no memory for one, the count is dropped then
+static struct fs_stats *block()
+{
+	if(mine) {
+		return &mine->s;
+	}
+	pthread_once(&stats_once, key_init);
+	struct stats_block *b = calloc(1, sizeof(*b));
+	if(!b) {
+		return 0;
+	}
+	pthread_mutex_lock(&stats_lock);
+	b->next = blocks;
+	blocks  = b;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(stats_key, b);
+	mine = b;
+	return &b->s;
+}
+
+//helper fn
+static int bucket( uint64_t value )
+{
+	if(value==0) {
+		return 0;
+	}
+	int b = 64-__builtin_clzll(value);
+	return b<FS_STATS_BUCKETS ? b : FS_STATS_BUCKETS-1;
+}
+
+//helper fn
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+//starts timing a call. disk I/O of the thread counts for op until stats_end
+int64_t stats_begin( int op )
+{
+	current_op = op;
+	return now_ns();
+}
+
+void stats_end( int op, int64_t start )
+{
+	int64_t ns = now_ns()-start;
+	current_op = FS_OP_NONE;
+	struct fs_stats *s = block();
+	if(!s) {
+		return;
+	}
+	bump(&s->op[op].calls, 1);
+	bump(&s->op[op].nanoseconds, ns);
+	bump(&s->op[op].latency[bucket(ns/1000)], 1);
+}
+
+//call the thread is in, so I/O done for it elsewhere can be charged to it
+int stats_op()
+{
+	return current_op;
+}
+
+void stats_set_op( int op )
+{
+	current_op = op;
+}
+
+void stats_io( int write, int count )
+{
+	struct fs_stats *s = block();
+	if(s) {
+		bump(write ? &s->op[current_op].blocks_written : &s->op[current_op].blocks_read, count);
+	}
+}
+
+void stats_event( int event, int count )
+{
+	struct fs_stats *s = block();
+	if(s) {
+		bump(&s->event[event], count);
+	}
+}
+
+//words scanned by a bitmap search, added to the allocation in progress
+void stats_scan( int words )
+{
+	scanned += words;
+}
+
+//ends an allocation that searched the given number of groups
+void stats_alloc( int alloc, int groups )
+{
+	struct fs_stats *s = block();
+	if(s) {
+		bump(&s->alloc[alloc].calls, 1);
+		bump(&s->alloc[alloc].groups, groups);
+		bump(&s->alloc[alloc].words, scanned);
+		bump(&s->alloc[alloc].scan[bucket(scanned)], 1);
+	}
+	scanned = 0;
+}
+
+//adds up the counters of all threads, less those at the last reset
+void stats_read( struct fs_stats *stats )
+{
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&stats_lock);
+	add_up(stats, &retired);
+	for(struct stats_block *b=blocks; b; b=b->next) {
+		add_up(stats, &b->s);
+	}
+	uint64_t *t = (uint64_t*)stats, *base = (uint64_t*)&baseline;
+	for(size_t i=0; i<STATS_WORDS; i++) {
+		t[i] -= base[i];
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+//starts counting from zero again. the threads' blocks are left alone, the
+//current totals become the baseline that stats_read subtracts
+void stats_reset()
+{
+	struct fs_stats now;
+	memset(&now, 0, sizeof(now));
+	pthread_mutex_lock(&stats_lock);
+	add_up(&now, &retired);
+	for(struct stats_block *b=blocks; b; b=b->next) {
+		add_up(&now, &b->s);
+	}
+	baseline = now;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+const char *stats_op_name( int op )
+{
+	return op>=0 && op<FS_OP_COUNT ? op_names[op] : "?";
+}
@@ -0,0 +1,80 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+//calls statistics are kept for. disk I/O done outside of any call, by the
+//read-ahead, write-behind and journal commit threads, counts as FS_OP_NONE
+#define FS_OP_NONE      0
+#define FS_OP_CREATE    1
+#define FS_OP_DELETE    2
+#define FS_OP_READ      3
+#define FS_OP_WRITE     4
+#define FS_OP_TRUNCATE  5
+#define FS_OP_MKDIR     6
+#define FS_OP_RMDIR     7
+#define FS_OP_LOOKUP    8
+#define FS_OP_MOUNT     9
+#define FS_OP_UNMOUNT   10
+#define FS_OP_FORMAT    11
+#define FS_OP_READDIR   12
+#define FS_OP_RESERVE   13
+#define FS_OP_PUNCH     14
+#define FS_OP_COUNT     15
+
+//events counted by the disk layer and the journal
+#define FS_EV_CACHE_HIT   0      //block found in the cache
+#define FS_EV_CACHE_MISS  1
+#define FS_EV_STREAM_HIT  2      //block found in the stream buffer
+#define FS_EV_READ_AHEAD  3      //blocks read ahead of sequential reads
+#define FS_EV_WRITE_BACK  4      //dirty blocks written back from the cache
+#define FS_EV_JOURNAL_HIT 5      //metadata reads served by the journal
+#define FS_EV_COUNT       6
+
+#define FS_ALLOC_BLOCK  0
+#define FS_ALLOC_INODE  1
+#define FS_ALLOC_COUNT  2
+
+//histograms have a bucket per power of two: bucket 0 counts the value 0
+//and bucket i the values from 2^(i-1) up to 2^i, the last one everything
+//above
+#define FS_STATS_BUCKETS 24
+
+struct fs_op_stats {
+	uint64_t calls;
+	uint64_t nanoseconds;
+	uint64_t blocks_read;         //disk blocks moved while in the call
+	uint64_t blocks_written;
+	uint64_t latency[FS_STATS_BUCKETS];   //calls by microseconds taken
+};
+
+struct fs_alloc_stats {
+	uint64_t calls;
+	uint64_t groups;              //block groups searched
+	uint64_t words;               //bitmap words scanned
+	uint64_t scan[FS_STATS_BUCKETS];      //calls by bitmap words scanned
+};
+
+//all counters are 64 bit, stats.c adds the structures up word by word
+struct fs_stats {
+	struct fs_op_stats    op[FS_OP_COUNT];
+	struct fs_alloc_stats alloc[FS_ALLOC_COUNT];
+	uint64_t event[FS_EV_COUNT];
+};
+
+//every thread counts into a block of its own with relaxed atomic stores,
+//so counting takes no lock and shares no cache line with other threads.
+//the blocks are only added up when the statistics are read
+int64_t stats_begin( int op );
+void stats_end( int op, int64_t start );
+int  stats_op();
+void stats_set_op( int op );
+void stats_io( int write, int count );
+void stats_event( int event, int count );
+void stats_scan( int words );
+void stats_alloc( int alloc, int groups );
+void stats_read( struct fs_stats *stats );
+void stats_reset();
+const char *stats_op_name( int op );
+
+#endif
@@ -0,0 +1,638 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define STRESS_FILES     8          //files the data phases run on
+#define STRESS_FILE_SIZE (4<<20)
+#define STRESS_IO_MAX    65536      //largest single read or write
+#define STRESS_NAMES     32         //names every namespace thread cycles through
+#define STRESS_SMALL_MAX 12000      //largest file the namespace threads write
+#define STRESS_SCRATCH_MAX (1<<20)  //scratch files are cut back past this size
+#define STRESS_THREADS   8
+#define STRESS_ITERS     2000
+#define STRESS_MAX_THREADS 64
+#define STRESS_REPORTS   20         //errors printed, the rest are only counted
+#define STRESS_CRASHES   16         //times the crash check kills its child
+#define STRESS_CRASH_FILES 16       //files the child deletes before it is killed
+#define STRESS_CRASH_SIZE  65536
+
+//multithreaded test of the locking model. every phase runs its threads
+//against one mounted file system and checks what they read back:
+//  same   readers and writers on one file
+//  many   every thread writes a file of its own and reads the others, and
+//         grows and truncates a scratch file
+//  names  creates, deletes, mkdirs and rmdirs in a shared directory
+//  mount  one thread unmounts and mounts over and over while the others
+//         look up and read the data files and sum the free counts
+//afterwards the data is checked again after a remount, everything is
+//deleted, and the free block and inode counts must be back where they
+//were right after format. last a child process deletes files and writes
+//new ones into the freed blocks until it is killed, and every deleted file
+//the journal brings back has to hold its own data
+
+static int files[STRESS_FILES];
+static int nthreads = STRESS_THREADS;
+static int iters    = STRESS_ITERS;
+static int errors;
+static int format_blocks, format_inodes;   //free counts right after format
+static int mount_blocks, mount_inodes;     //free counts while the mount phase runs
+static int remounting;                     //the mount phase is still remounting
+
+struct worker {
+	int id;
+	unsigned seed;
+	pthread_t thread;
+};
+
+static double now();
+static void fail( const char *what, int id, int64_t offset );
+static char pattern( int f, int64_t offset );
+static void *same_reader( void *arg );
+static void *same_writer( void *arg );
+static void *many_worker( void *arg );
+static void *names_worker( void *arg );
+static void *mount_worker( void *arg );
+static void run_phase( const char *name, void *(*fn[2])( void *arg ) );
+static int check_files();
+static int check_crash( const char *diskfile, int nblocks, int flags );
+
+int main( int argc, char *argv[] )
+{
+	const char *diskfile = "fs_stress.img";
+	int nblocks = 65536;
+	int cache   = -1;
+	int flags   = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "d:b:c:m:t:i:")) != -1) {
+		switch(opt) {
+		case 'd': diskfile = optarg; break;
+		case 'b': nblocks  = atoi(optarg); break;
+		case 'c': cache    = atoi(optarg); break;
+		case 't': nthreads = atoi(optarg); break;
+		case 'i': iters    = atoi(optarg); break;
+		case 'm':
+			if(!strcmp(optarg,"direct")) {
+				flags = DISK_DIRECT;
+			} else if(!strcmp(optarg,"mmap")) {
+				flags = DISK_MMAP;
+			} else {
+				printf("unknown disk mode: %s\n",optarg);
+				return 1;
+			}
+			break;
+		default:
+			printf("use: %s [-d diskfile] [-b nblocks] [-c cache blocks] [-m direct|mmap] [-t threads] [-i iterations]\n",argv[0]);
+			return 1;
+		}
+	}
+	if(nthreads<2 || nthreads>STRESS_MAX_THREADS) {
+		printf("threads must be between 2 and %d\n",STRESS_MAX_THREADS);
+		return 1;
+	}
+
+	if(!disk_open(diskfile,nblocks,flags)) {
+		printf("couldn't initialize %s: %s\n",diskfile,strerror(errno));
+		return 1;
+	}
+	if(cache>=0 && !disk_cache_init(cache)) {
+		printf("couldn't allocate a cache of %d blocks\n",cache);
+		return 1;
+	}
+	if(!fs_format() || !fs_mount()) {
+		printf("couldn't format %s\n",diskfile);
+		return 1;
+	}
+	fs_usage(&format_blocks, &format_inodes);
+
+	//the data phases start from files filled with their pattern
+	char *buffer = malloc(STRESS_IO_MAX);
+	char path[64];
+	for(int f=0; f<STRESS_FILES; f++) {
+		sprintf(path,"/file%d",f);
+		files[f] = fs_create_file(path);
+		for(int64_t off=0; off<STRESS_FILE_SIZE; off+=STRESS_IO_MAX) {
+			for(int i=0; i<STRESS_IO_MAX; i++) {
+				buffer[i] = pattern(f,off+i);
+			}
+			if(fs_write(files[f],buffer,STRESS_IO_MAX,off)!=STRESS_IO_MAX) {
+				fail("setup write", f, off);
+			}
+		}
+	}
+	free(buffer);
+	fs_create_dir("/shared");
+
+	void *(*same[2])( void *arg ) = { same_reader, same_writer };
+	void *(*many[2])( void *arg ) = { many_worker, many_worker };
+	void *(*names[2])( void *arg ) = { names_worker, names_worker };
+	void *(*mount[2])( void *arg ) = { mount_worker, mount_worker };
+	run_phase("same", same);
+	run_phase("many", many);
+	run_phase("names", names);
+
+	//the mount phase changes nothing, so once the releases deferred by the
+	//journal are in, every mount has to report the same counts
+	fs_unmount();
+	fs_mount();
+	fs_usage(&mount_blocks, &mount_inodes);
+	remounting = 1;
+	run_phase("mount", mount);
+
+	//the data has to survive an unmount, and so do the counts. they are
+	//compared between two mounts, since metadata blocks freed while mounted
+	//only count as free once the journal has committed their release
+	int before_blocks, before_inodes, after_blocks, after_inodes;
+	fs_unmount();
+	if(!fs_mount()) {
+		fail("remount", 0, 0);
+	}
+	fs_usage(&before_blocks, &before_inodes);
+	fs_unmount();
+	if(!fs_mount()) {
+		fail("remount", 0, 0);
+	}
+	fs_usage(&after_blocks, &after_inodes);
+	if(after_blocks!=before_blocks || after_inodes!=before_inodes) {
+		printf("counts changed over a remount: %d/%d free blocks, %d/%d free inodes\n",after_blocks,before_blocks,after_inodes,before_inodes);
+		errors++;
+	}
+	errors += check_files();
+	int shared = fs_lookup("/shared");
+	if(fs_readdir(shared,0,0)!=0) {
+		printf("/shared not empty after the names phase\n");
+		errors++;
+	}
+
+	//with everything deleted the disk has to be as empty as after format
+	fs_delete_dir(shared);
+	for(int f=0; f<STRESS_FILES; f++) {
+		sprintf(path,"/file%d",f);
+		if(!fs_delete_file(path)) {
+			fail("delete", f, 0);
+		}
+	}
+	fs_unmount();
+	if(!fs_mount()) {
+		fail("remount", 0, 0);
+	}
+	fs_usage(&after_blocks, &after_inodes);
+	if(after_blocks!=format_blocks || after_inodes!=format_inodes) {
+		printf("leaked %d blocks and %d inodes\n",format_blocks-after_blocks,format_inodes-after_inodes);
+		errors++;
+	}
+	fs_unmount();
+	disk_close();
+	errors += check_crash(diskfile, nblocks, flags);
+
+	printf("%d errors\n",errors);
+	return errors ? 1 : 0;
+}
+
+//helper fn
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+//helper fn
+static void fail( const char *what, int id, int64_t offset )
+{
+	if(__atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED) < STRESS_REPORTS) {
+		printf("%s failed: %d at %lld\n",what,id,(long long)offset);
+	}
+}
+
+//helper fn
+//byte at offset of data file f. writers always write the pattern, so a
+//read sees it no matter how it interleaves with them
+static char pattern( int f, int64_t offset )
+{
+	return (char)(f*31+offset*7+(offset>>12));
+}
+
+//helper fn
+//reads a range of a file holding the pattern of key and checks it
+static void read_range( int inumber, int key, int64_t offset, int length, char *buffer )
+{
+	if(fs_read(inumber,buffer,length,offset)!=length) {
+		fail("read", key, offset);
+		return;
+	}
+	for(int i=0; i<length; i++) {
+		if(buffer[i]!=pattern(key,offset+i)) {
+			fail("read check", key, offset+i);
+			return;
+		}
+	}
+}
+
+//helper fn
+//returns 1 if the whole range was written
+static int write_range( int inumber, int key, int64_t offset, int length, char *buffer )
+{
+	for(int i=0; i<length; i++) {
+		buffer[i] = pattern(key,offset+i);
+	}
+	if(fs_write(inumber,buffer,length,offset)!=length) {
+		fail("write", key, offset);
+		return 0;
+	}
+	return 1;
+}
+
+//helper fn
+//reads a random range of data file f and checks it
+static void read_check( int f, unsigned *seed, char *buffer )
+{
+	int64_t offset = rand_r(seed)%(STRESS_FILE_SIZE-STRESS_IO_MAX);
+	read_range(files[f], f, offset, 1+rand_r(seed)%STRESS_IO_MAX, buffer);
+}
+
+//helper fn
+//writes the pattern over a random range of data file f
+static void write_pattern( int f, unsigned *seed, char *buffer )
+{
+	int64_t offset = rand_r(seed)%(STRESS_FILE_SIZE-STRESS_IO_MAX);
+	write_range(files[f], f, offset, 1+rand_r(seed)%STRESS_IO_MAX, buffer);
+}
+
+static void *same_reader( void *arg )
+{
+	struct worker *w = arg;
+	char *buffer = malloc(STRESS_IO_MAX);
+	for(int i=0; i<iters; i++) {
+		read_check(0, &w->seed, buffer);
+	}
+	free(buffer);
+	return 0;
+}
+
+static void *same_writer( void *arg )
+{
+	struct worker *w = arg;
+	char *buffer = malloc(STRESS_IO_MAX);
+	for(int i=0; i<iters/4; i++) {
+		write_pattern(0, &w->seed, buffer);
+	}
+	free(buffer);
+	return 0;
+}
+
+//besides its data file every thread grows and cuts back a scratch file of
+//its own, so blocks are allocated and freed by all threads at once. a block
+//handed out twice shows up as a wrong pattern in one of the files
+static void *many_worker( void *arg )
+{
+	struct worker *w = arg;
+	char *buffer = malloc(STRESS_IO_MAX);
+	char path[64];
+	int mine = w->id%STRESS_FILES;
+	int key  = STRESS_FILES+w->id;
+	int64_t size = 0;
+	sprintf(path,"/scratch%d",w->id);
+	int scratch = fs_create_file(path);
+	if(scratch<0) {
+		fail("create", w->id, 0);
+		free(buffer);
+		return 0;
+	}
+
+	for(int i=0; i<iters; i++) {
+		int length = 1+rand_r(&w->seed)%STRESS_IO_MAX;
+		switch(i%4) {
+		case 0:
+			write_pattern(mine, &w->seed, buffer);
+			break;
+		case 1:
+			if(!write_range(scratch, key, size, length, buffer)) {
+				break;
+			}
+			size += length;
+			if(size > STRESS_SCRATCH_MAX) {
+				size = rand_r(&w->seed)%size;
+				if(!fs_truncate(scratch, size)) {
+					fail("truncate", key, size);
+				}
+			}
+			break;
+		default:
+			read_check((mine+1+rand_r(&w->seed)%(STRESS_FILES-1))%STRESS_FILES, &w->seed, buffer);
+			if(size > 0) {
+				int64_t offset = rand_r(&w->seed)%size;
+				read_range(scratch, key, offset, size-offset < length ? size-offset : length, buffer);
+			}
+			break;
+		}
+	}
+	if(fs_getsize(scratch)!=size) {
+		fail("scratch size", key, size);
+	}
+	if(!fs_delete_file(path)) {
+		fail("delete", key, 0);
+	}
+	free(buffer);
+	return 0;
+}
+
+//helper fn
+//a small file of size bytes, different for every thread and name
+static void small_data( char *buffer, int size, int id, int name )
+{
+	for(int i=0; i<size; i++) {
+		buffer[i] = (char)(id*17+name*5+i);
+	}
+}
+
+//every thread works on names of its own in /shared, so whether a name
+//exists is known and every call has to succeed. the directory and its
+//name space lock are shared by all of them
+static void *names_worker( void *arg )
+{
+	struct worker *w = arg;
+	int  size[STRESS_NAMES];
+	char path[64];
+	char *buffer = malloc(STRESS_SMALL_MAX);
+	char *check  = malloc(STRESS_SMALL_MAX);
+	memset(size, -1, sizeof(size));
+
+	for(int i=0; i<iters/4; i++) {
+		int n = rand_r(&w->seed)%STRESS_NAMES;
+		sprintf(path,"/shared/t%d_%d",w->id,n);
+		if(size[n]==-1) {
+			int inumber = fs_create_file(path);
+			if(inumber<0) {
+				fail("create", w->id, n);
+				continue;
+			}
+			//sizes both below and above what fits in an inode
+			size[n] = rand_r(&w->seed)%STRESS_SMALL_MAX;
+			small_data(buffer, size[n], w->id, n);
+			if(size[n]>0 && fs_write(inumber,buffer,size[n],0)!=size[n]) {
+				fail("small write", w->id, n);
+			}
+		} else {
+			int inumber = fs_lookup(path);
+			small_data(buffer, size[n], w->id, n);
+			if(inumber<0 || fs_read(inumber,check,STRESS_SMALL_MAX,0)!=size[n] || memcmp(buffer,check,size[n])) {
+				fail("small read", w->id, n);
+			}
+			if(!fs_delete_file(path)) {
+				fail("delete", w->id, n);
+			}
+			size[n] = -1;
+		}
+
+		//a directory with a few files, removed again as a whole
+		if(i%8==0) {
+			sprintf(path,"/shared/d%d_%d",w->id,i);
+			if(fs_create_dir(path)==-1) {
+				fail("mkdir", w->id, i);
+				continue;
+			}
+			for(int k=0; k<4; k++) {
+				sprintf(path,"/shared/d%d_%d/f%d",w->id,i,k);
+				int inumber = fs_create_file(path);
+				if(inumber<0 || fs_write(inumber,buffer,STRESS_SMALL_MAX/2,0)!=STRESS_SMALL_MAX/2) {
+					fail("create in directory", w->id, k);
+				}
+			}
+			sprintf(path,"/shared/d%d_%d",w->id,i);
+			if(fs_delete_dir(fs_lookup(path))==-1) {
+				fail("rmdir", w->id, i);
+			}
+		}
+	}
+
+	for(int n=0; n<STRESS_NAMES; n++) {
+		if(size[n]!=-1) {
+			sprintf(path,"/shared/t%d_%d",w->id,n);
+			if(!fs_delete_file(path)) {
+				fail("delete", w->id, n);
+			}
+		}
+	}
+	free(buffer);
+	free(check);
+	return 0;
+}
+
+//thread 0 remounts while the others keep calling in until it is done, odd
+//threads summing the free counts and even ones looking up and reading the
+//data files. a call that finds the file system unmounted fails, but one that
+//gets in has to see the files whole and the free counts of the last quiet
+//mount, or zeros if unmounted
+static void *mount_worker( void *arg )
+{
+	struct worker *w = arg;
+	char path[64];
+	char *buffer = malloc(STRESS_IO_MAX);
+
+	if(w->id==0) {
+		for(int i=0; i<iters/64; i++) {
+			fs_unmount();
+			if(!fs_mount()) {
+				fail("remount", w->id, i);
+			}
+		}
+		__atomic_store_n(&remounting, 0, __ATOMIC_RELAXED);
+		free(buffer);
+		return 0;
+	}
+	while(__atomic_load_n(&remounting, __ATOMIC_RELAXED)) {
+		usleep(10);                  //readers keep out a writer of mount_lock while any is in
+		if(w->id%2) {
+			int free_blocks, free_inodes;
+			fs_usage(&free_blocks, &free_inodes);
+			if((free_blocks!=0 || free_inodes!=0) && (free_blocks!=mount_blocks || free_inodes!=mount_inodes)) {
+				fail("usage", free_blocks, free_inodes);
+			}
+			continue;
+		}
+
+		int f = rand_r(&w->seed)%STRESS_FILES;
+		sprintf(path,"/file%d",f);
+		int inumber = fs_lookup(path);
+		if(inumber!=-1 && inumber!=files[f]) {
+			fail("lookup", f, inumber);
+		}
+		int64_t offset = rand_r(&w->seed)%(STRESS_FILE_SIZE-STRESS_IO_MAX);
+		int length = 1+rand_r(&w->seed)%STRESS_IO_MAX;
+		int got = fs_read(files[f],buffer,length,offset);
+		if(got==length) {
+			for(int k=0; k<length; k++) {
+				if(buffer[k]!=pattern(f,offset+k)) {
+					fail("read check", f, offset+k);
+					break;
+				}
+			}
+		} else if(got!=0) {
+			fail("read", f, offset);
+		}
+	}
+	free(buffer);
+	return 0;
+}
+
+//helper fn
+//runs nthreads threads, the first half with fn[0] and the rest with fn[1]
+static void run_phase( const char *name, void *(*fn[2])( void *arg ) )
+{
+	struct worker workers[STRESS_MAX_THREADS];
+	int before = errors;
+	double start = now();
+	for(int i=0; i<nthreads; i++) {
+		workers[i].id   = i;
+		workers[i].seed = i*7919+1;
+		pthread_create(&workers[i].thread, 0, fn[i<nthreads/2 ? 0 : 1], &workers[i]);
+	}
+	for(int i=0; i<nthreads; i++) {
+		pthread_join(workers[i].thread, 0);
+	}
+	printf("%-8s %d threads %8.3f s %d errors\n",name,nthreads,now()-start,errors-before);
+}
+
+//helper fn
+//reads every data file whole and checks it. returns the errors found
+static int check_files()
+{
+	char *buffer = malloc(STRESS_IO_MAX);
+	int bad = 0;
+	for(int f=0; f<STRESS_FILES; f++) {
+		if(fs_getsize(files[f])!=STRESS_FILE_SIZE) {
+			printf("file %d has size %lld\n",f,(long long)fs_getsize(files[f]));
+			bad++;
+		}
+		for(int64_t off=0; off<STRESS_FILE_SIZE; off+=STRESS_IO_MAX) {
+			if(fs_read(files[f],buffer,STRESS_IO_MAX,off)!=STRESS_IO_MAX) {
+				printf("file %d short at %lld\n",f,(long long)off);
+				bad++;
+				break;
+			}
+			for(int i=0; i<STRESS_IO_MAX; i++) {
+				if(buffer[i]!=pattern(f,off+i)) {
+					printf("file %d differs at %lld after remount\n",f,(long long)(off+i));
+					bad++;
+					break;
+				}
+			}
+		}
+	}
+	free(buffer);
+	return bad;
+}
+
+//helper fn
+//the child fills files and gets them onto disk, then deletes them and keeps
+//creating files of the same size so the freed blocks are taken again. it
+//has no cache, so all it writes is in the image when it is killed. a
+//delete the journal had not committed yet is undone on the next mount, and
+//the file it brings back must not show another file's data
+static void crash_child( const char *diskfile, int nblocks, int flags, int ready )
+{
+	char *buffer = malloc(STRESS_CRASH_SIZE);
+	char path[64];
+	if(!disk_open(diskfile,nblocks,flags) || !disk_cache_init(0) || !fs_format() || !fs_mount()) {
+		_exit(1);
+	}
+	for(int k=0; k<STRESS_CRASH_FILES; k++) {
+		sprintf(path,"/keep%d",k);
+		int inumber = fs_create_file(path);
+		for(int i=0; i<STRESS_CRASH_SIZE; i++) {
+			buffer[i] = pattern(STRESS_MAX_THREADS+k,i);
+		}
+		fs_write(inumber,buffer,STRESS_CRASH_SIZE,0);
+	}
+	fs_unmount();
+	if(!fs_mount() || write(ready,"",1)!=1) {
+		_exit(1);
+	}
+	for(int k=0; k<STRESS_CRASH_FILES; k++) {
+		sprintf(path,"/keep%d",k);
+		fs_delete_file(path);
+	}
+	memset(buffer,0xff,STRESS_CRASH_SIZE);
+	for(int n=0; ; n++) {
+		sprintf(path,"/new%d",n%STRESS_CRASH_FILES);
+		fs_delete_file(path);
+		fs_write(fs_create_file(path),buffer,STRESS_CRASH_SIZE,0);
+	}
+}
+
+//helper fn
+//kills a child at a different moment every round and checks the files it
+//was deleting after the journal is replayed. returns the errors found
+static int check_crash( const char *diskfile, int nblocks, int flags )
+{
+	char *buffer = malloc(STRESS_CRASH_SIZE);
+	char path[64];
+	int bad = 0;
+	double start = now();
+	for(int r=0; r<STRESS_CRASHES; r++) {
+		int ready[2];
+		char c;
+		if(pipe(ready)!=0) {
+			printf("crash: couldn't create a pipe: %s\n",strerror(errno));
+			bad++;
+			break;
+		}
+		fflush(stdout);
+		pid_t pid = fork();
+		if(pid==0) {
+			close(ready[0]);
+			crash_child(diskfile, nblocks, flags, ready[1]);
+		}
+		close(ready[1]);
+		int started = pid>0 && read(ready[0],&c,1)==1;
+		close(ready[0]);
+		if(started) {
+			usleep(r*1000);           //the commit interval is a few ms
+		}
+		if(pid>0) {
+			kill(pid,SIGKILL);
+			waitpid(pid,0,0);
+		}
+		if(!started) {
+			printf("crash: round %d didn't start\n",r);
+			bad++;
+			continue;
+		}
+
+		if(!disk_open(diskfile,nblocks,flags) || !fs_mount()) {
+			printf("crash: round %d couldn't mount\n",r);
+			bad++;
+			continue;
+		}
+		for(int k=0; k<STRESS_CRASH_FILES; k++) {
+			sprintf(path,"/keep%d",k);
+			int inumber = fs_lookup(path);
+			if(inumber==-1) {
+				continue;                //the delete had committed
+			}
+			int got = fs_read(inumber,buffer,STRESS_CRASH_SIZE,0);
+			for(int i=0; i<STRESS_CRASH_SIZE; i++) {
+				if(got!=STRESS_CRASH_SIZE || buffer[i]!=pattern(STRESS_MAX_THREADS+k,i)) {
+					printf("crash: round %d, %s differs at %d after replay\n",r,path,i);
+					bad++;
+					break;
+				}
+			}
+		}
+		fs_unmount();
+		disk_close();
+	}
+	printf("%-8s %d rounds  %8.3f s %d errors\n","crash",STRESS_CRASHES,now()-start,bad);
+	free(buffer);
+	return bad;
+}
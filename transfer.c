@@ -0,0 +1,708 @@
+#include "transfer.h"
+#include "fs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define TRANSFER_PATH 1024         //longest path the file system takes
+
+//a file waiting for its data to be copied
+struct transfer_job {
+	char *host;                  //path of the file on the host
+	int inumber;
+	struct transfer_job *next;
+};
+
+//state of one import or export. the walking thread queues jobs, the
+//copying threads take them, all under lock
+struct transfer {
+	int import;                  //1 from the host to the file system, 0 back
+	struct transfer_job *head, *tail;
+	int queued;
+	int done;                    //walk finished, no more jobs will come
+	pthread_mutex_t lock;
+	pthread_cond_t  work;        //a job was queued or the walk finished
+	pthread_cond_t  space;       //a job was taken off a full queue
+	int64_t bytes;
+	int files, dirs, errors;
+};
+
+static double now();
+static void *copy_reader( void *arg );
+static void *copy_thread( void *arg );
+static int transfer_run( struct transfer *t, int import, void (*walk)( struct transfer *t, void *arg ), void *arg );
+
+//helper fn
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+//helper fn
+static void count_error( struct transfer *t )
+{
+	pthread_mutex_lock(&t->lock);
+	t->errors++;
+	pthread_mutex_unlock(&t->lock);
+}
+
+//helper fn
+//queues a file for the copying threads, waiting while the queue is full
+static void queue_job( struct transfer *t, const char *host, int inumber )
+{
+	struct transfer_job *job = malloc(sizeof(*job));
+	char *copy = strdup(host);
+	if(!job || !copy) {
+		printf("out of memory for %s\n",host);
+		free(job);
+		free(copy);
+		count_error(t);
+		return;
+	}
+	job->host    = copy;
+	job->inumber = inumber;
+	job->next    = 0;
+
+	pthread_mutex_lock(&t->lock);
+	while(t->queued >= TRANSFER_QUEUE) {
+		pthread_cond_wait(&t->space, &t->lock);
+	}
+	if(t->tail) {
+		t->tail->next = job;
+	} else {
+		t->head = job;
+	}
+	t->tail = job;
+	t->queued++;
+	pthread_cond_signal(&t->work);
+	pthread_mutex_unlock(&t->lock);
+}
+
+//one end of a copy: a host file descriptor or an inode
+struct copy_end {
+	int fd;
+	int inumber;
+	const char *name;            //host path, for messages
+};
+
+//moves up to length bytes at offset between an end and data. returns the
+//bytes moved, 0 at the end of the source, or -1
+typedef int (*copy_fn)( struct copy_end *end, char *data, int length, int64_t offset );
+
+//a copy in flight. the reader fills the ring's buffers in order and the
+//writer drains them in the same order, so both sides run at once. filled
+//and drained only grow, the slot of a buffer is its count modulo the ring
+struct copy {
+	copy_fn get, put;
+	struct copy_end *from, *to;
+	char *data[TRANSFER_RING];
+	int length[TRANSFER_RING];   //0 marks the end of the source
+	int filled, drained;
+	int failed;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+};
+
+//helper fn
+//fills the whole length unless the host file ends first, so every fs_write
+//is a large contiguous one
+static int host_get( struct copy_end *end, char *data, int length, int64_t offset )
+{
+	int done = 0;
+	while(done < length) {
+		ssize_t n = read(end->fd, data+done, length-done);
+		if(n<0 && errno==EINTR) {
+			continue;
+		}
+		if(n<0) {
+			printf("couldn't read %s: %s\n",end->name,strerror(errno));
+			return -1;
+		}
+		if(n==0) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+//helper fn
+static int host_put( struct copy_end *end, char *data, int length, int64_t offset )
+{
+	int done = 0;
+	while(done < length) {
+		ssize_t n = write(end->fd, data+done, length-done);
+		if(n<0 && errno==EINTR) {
+			continue;
+		}
+		if(n<0) {
+			printf("couldn't write %s: %s\n",end->name,strerror(errno));
+			return -1;
+		}
+		done += n;
+	}
+	return done;
+}
+
+//helper fn
+static int file_get( struct copy_end *end, char *data, int length, int64_t offset )
+{
+	return fs_read(end->inumber, data, length, offset);
+}
+
+//helper fn
+static int file_put( struct copy_end *end, char *data, int length, int64_t offset )
+{
+	int actual = fs_write(end->inumber, data, length, offset);
+	if(actual!=length) {
+		printf("couldn't write %s to inode %d: disk full?\n",end->name,end->inumber);
+		return -1;
+	}
+	return actual;
+}
+
+//helper fn
+//copies one chunk at a time through a single buffer. returns the bytes
+//copied or -1
+static int64_t copy_serial( struct copy *c, char *buffer )
+{
+	int64_t offset = 0;
+	while(1) {
+		int length = c->get(c->from, buffer, TRANSFER_CHUNK, offset);
+		if(length<0) {
+			return -1;
+		}
+		if(length==0) {
+			return offset;
+		}
+		if(c->put(c->to, buffer, length, offset)!=length) {
+			return -1;
+		}
+		offset += length;
+	}
+}
+
+//fills the ring from the source until it ends or the copy fails
+static void *copy_reader( void *arg )
+{
+	struct copy *c = arg;
+	int64_t offset = 0;
+	while(1) {
+		pthread_mutex_lock(&c->lock);
+		while(c->filled-c->drained==TRANSFER_RING && !c->failed) {
+			pthread_cond_wait(&c->cond, &c->lock);
+		}
+		int slot = c->filled%TRANSFER_RING;
+		int failed = c->failed;
+		pthread_mutex_unlock(&c->lock);
+		if(failed) {
+			break;
+		}
+
+		int length = c->get(c->from, c->data[slot], TRANSFER_CHUNK, offset);
+
+		pthread_mutex_lock(&c->lock);
+		if(length<0) {
+			c->failed = 1;
+		} else {
+			c->length[slot] = length;
+			c->filled++;
+		}
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+		if(length<=0) {
+			break;
+		}
+		offset += length;
+	}
+	return 0;
+}
+
+//helper fn
+//copies with a reader thread filling a ring of TRANSFER_RING buffers while
+//the calling thread writes them out, so the copy runs at the speed of the
+//slower side. sources of at most one chunk, or when there is no memory or
+//thread for the ring, are copied serially through buffer. returns the
+//bytes copied or -1
+static int64_t copy_run( struct copy *c, int64_t size, char *buffer )
+{
+	int ring = 0;
+	if(size > TRANSFER_CHUNK) {
+		for(ring=0; ring<TRANSFER_RING; ring++) {
+			if(!(c->data[ring] = malloc(TRANSFER_CHUNK))) {
+				break;
+			}
+		}
+	}
+	pthread_t reader;
+	if(ring<TRANSFER_RING || pthread_create(&reader, 0, copy_reader, c)!=0) {
+		int64_t result = copy_serial(c, buffer);
+		for(int i=0; i<ring; i++) {
+			free(c->data[i]);
+		}
+		return result;
+	}
+
+	int64_t offset = 0;
+	while(1) {
+		pthread_mutex_lock(&c->lock);
+		while(c->filled==c->drained && !c->failed) {
+			pthread_cond_wait(&c->cond, &c->lock);
+		}
+		int slot   = c->drained%TRANSFER_RING;
+		int length = c->length[slot];
+		int done   = c->failed || c->filled==c->drained;
+		pthread_mutex_unlock(&c->lock);
+		if(done || length==0) {
+			break;
+		}
+
+		int ok = c->put(c->to, c->data[slot], length, offset)==length;
+
+		pthread_mutex_lock(&c->lock);
+		if(ok) {
+			c->drained++;
+		} else {
+			c->failed = 1;
+		}
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+		if(!ok) {
+			break;
+		}
+		offset += length;
+	}
+	pthread_join(reader, 0);
+	for(int i=0; i<TRANSFER_RING; i++) {
+		free(c->data[i]);
+	}
+	return c->failed ? -1 : offset;
+}
+
+//helper fn
+//copies a host file into an inode. the blocks for the whole file are
+//reserved first, so it is laid out in one run however it is written.
+//buffer is used for files of one chunk. returns the bytes copied or -1
+static int64_t import_file( const char *host, int inumber, char *buffer )
+{
+	int fd = open(host, O_RDONLY);
+	if(fd<0) {
+		printf("couldn't open %s: %s\n",host,strerror(errno));
+		return -1;
+	}
+	struct stat st;
+	int64_t size = fstat(fd, &st)==0 && S_ISREG(st.st_mode) ? st.st_size : 0;
+	if(size>0) {
+		fs_reserve(inumber, size);        //a copy that does not fit fails below
+	}
+
+	struct copy_end from = { fd, -1, host };
+	struct copy_end to   = { -1, inumber, host };
+	struct copy c;
+	memset(&c, 0, sizeof(c));
+	c.get  = host_get;
+	c.put  = file_put;
+	c.from = &from;
+	c.to   = &to;
+	pthread_mutex_init(&c.lock, 0);
+	pthread_cond_init(&c.cond, 0);
+	//a source of unknown size, such as a pipe, may still be large
+	int64_t result = copy_run(&c, size>0 ? size : TRANSFER_CHUNK+1, buffer);
+	pthread_cond_destroy(&c.cond);
+	pthread_mutex_destroy(&c.lock);
+	close(fd);
+	return result;
+}
+
+//helper fn
+//copies an inode out to a host file. returns the bytes copied or -1
+static int64_t export_file( int inumber, const char *host, char *buffer )
+{
+	//standard output is written where it stands rather than opened afresh,
+	//which would truncate it when it is redirected to a file
+	int fd = !strcmp(host,"/dev/stdout") ? dup(1) : open(host, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd<0) {
+		printf("couldn't open %s: %s\n",host,strerror(errno));
+		return -1;
+	}
+
+	struct copy_end from = { -1, inumber, host };
+	struct copy_end to   = { fd, -1, host };
+	struct copy c;
+	memset(&c, 0, sizeof(c));
+	c.get  = file_get;
+	c.put  = host_put;
+	c.from = &from;
+	c.to   = &to;
+	pthread_mutex_init(&c.lock, 0);
+	pthread_cond_init(&c.cond, 0);
+	int64_t result = copy_run(&c, fs_getsize(inumber), buffer);
+	pthread_cond_destroy(&c.cond);
+	pthread_mutex_destroy(&c.lock);
+	close(fd);
+	return result;
+}
+
+//helper fn
+//the single file copies of the shell, with a buffer of their own
+static int64_t copy_single( const char *host, int inumber, int import )
+{
+	char *buffer = malloc(TRANSFER_CHUNK);
+	if(!buffer) {
+		printf("out of memory for a copy buffer\n");
+		return -1;
+	}
+	int64_t result = import ? import_file(host, inumber, buffer) : export_file(inumber, host, buffer);
+	free(buffer);
+	return result;
+}
+
+//takes jobs off the queue until it is empty and the walk has finished
+static void *copy_thread( void *arg )
+{
+	struct transfer *t = arg;
+	char *buffer = malloc(TRANSFER_CHUNK);
+	if(!buffer) {
+		printf("out of memory for a copy buffer\n");
+		count_error(t);
+		return 0;
+	}
+	pthread_mutex_lock(&t->lock);
+	while(1) {
+		while(!t->head && !t->done) {
+			pthread_cond_wait(&t->work, &t->lock);
+		}
+		struct transfer_job *job = t->head;
+		if(!job) {
+			break;
+		}
+		t->head = job->next;
+		if(!t->head) {
+			t->tail = 0;
+		}
+		t->queued--;
+		pthread_cond_signal(&t->space);
+		pthread_mutex_unlock(&t->lock);
+
+		int64_t bytes = t->import ? import_file(job->host, job->inumber, buffer)
+		                          : export_file(job->inumber, job->host, buffer);
+		free(job->host);
+		free(job);
+
+		pthread_mutex_lock(&t->lock);
+		if(bytes<0) {
+			t->errors++;
+		} else {
+			t->bytes += bytes;
+			t->files++;
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+	free(buffer);
+	return 0;
+}
+
+//helper fn
+//joins a directory path and a name. returns 0 if the result is too long
+static int join( char *out, const char *dir, const char *name )
+{
+	int len = strlen(dir);
+	const char *sep = len>0 && dir[len-1]=='/' ? "" : "/";
+	return snprintf(out, TRANSFER_PATH, "%s%s%s", dir, sep, name) < TRANSFER_PATH;
+}
+
+//helper fn
+//creates the files of one directory with a single fs_create_batch call and
+//queues them for copying
+static void import_batch( struct transfer *t, int dir, const char *hostdir, const char **names, int count )
+{
+	int inumbers[TRANSFER_BATCH];
+	char host[TRANSFER_PATH];
+
+	fs_create_batch(dir, names, count, inumbers);
+	for(int i=0; i<count; i++) {
+		join(host, hostdir, names[i]);
+		if(inumbers[i]==-1) {
+			printf("couldn't create %s\n",names[i]);
+			count_error(t);
+		} else {
+			queue_job(t, host, inumbers[i]);
+		}
+	}
+}
+
+//helper fn
+//copies the tree under hostdir into the file system directory path, whose
+//inode no is dir. subdirectories are created as they are found and walked
+//after the files of this one are queued
+static void import_dir( struct transfer *t, const char *hostdir, const char *path, int dir )
+{
+	DIR *d = opendir(hostdir);
+	if(!d) {
+		printf("couldn't open %s: %s\n",hostdir,strerror(errno));
+		count_error(t);
+		return;
+	}
+
+	char *names[TRANSFER_BATCH];
+	int nnames = 0;
+	char **subdirs = 0;
+	int nsubdirs = 0, maxsubdirs = 0;
+	char host[TRANSFER_PATH];
+	struct dirent *e;
+	struct stat st;
+
+	while((e = readdir(d))) {
+		if(!strcmp(e->d_name,".") || !strcmp(e->d_name,"..")) {
+			continue;
+		}
+		if(strlen(e->d_name) >= FS_NAME_SIZE) {
+			printf("skipping %s/%s: names are at most %d characters\n",hostdir,e->d_name,FS_NAME_SIZE-1);
+			count_error(t);
+			continue;
+		}
+		if(!join(host, hostdir, e->d_name) || lstat(host, &st)<0) {
+			printf("skipping %s/%s\n",hostdir,e->d_name);
+			count_error(t);
+			continue;
+		}
+		if(S_ISDIR(st.st_mode)) {
+			if(nsubdirs==maxsubdirs) {
+				int grown = maxsubdirs ? maxsubdirs*2 : 16;
+				char **bigger = realloc(subdirs, grown*sizeof(char*));
+				if(!bigger) {
+					printf("out of memory for %s\n",host);
+					count_error(t);
+					continue;
+				}
+				subdirs    = bigger;
+				maxsubdirs = grown;
+			}
+			char *copy = strdup(e->d_name);
+			if(!copy) {
+				printf("out of memory for %s\n",host);
+				count_error(t);
+				continue;
+			}
+			subdirs[nsubdirs++] = copy;
+		} else if(S_ISREG(st.st_mode)) {
+			char *copy = strdup(e->d_name);
+			if(!copy) {
+				printf("out of memory for %s\n",host);
+				count_error(t);
+				continue;
+			}
+			names[nnames++] = copy;
+			if(nnames==TRANSFER_BATCH) {
+				import_batch(t, dir, hostdir, (const char**)names, nnames);
+				for(int i=0; i<nnames; i++) {
+					free(names[i]);
+				}
+				nnames = 0;
+			}
+		} else {
+			printf("skipping %s: not a file or directory\n",host);
+		}
+	}
+	closedir(d);
+
+	if(nnames>0) {
+		import_batch(t, dir, hostdir, (const char**)names, nnames);
+		for(int i=0; i<nnames; i++) {
+			free(names[i]);
+		}
+	}
+
+	char fspath[TRANSFER_PATH];
+	for(int i=0; i<nsubdirs; i++) {
+		join(host, hostdir, subdirs[i]);
+		int sub = -1;
+		if(join(fspath, path, subdirs[i])) {
+			sub = fs_create_dir(fspath);
+		}
+		if(sub==-1) {
+			printf("couldn't create directory %s\n",fspath);
+			count_error(t);
+		} else {
+			t->dirs++;
+			import_dir(t, host, fspath, sub);
+		}
+		free(subdirs[i]);
+	}
+	free(subdirs);
+}
+
+//helper fn
+//copies the directory dir of the file system into hostdir, which exists
+static void export_dir( struct transfer *t, int dir, const char *hostdir )
+{
+	int count = fs_readdir(dir, 0, 0);
+	struct fs_dirent *entries = count>0 ? malloc(count*sizeof(*entries)) : 0;
+	if(count<0 || (count>0 && !entries)) {
+		printf("couldn't list inode %d\n",dir);
+		count_error(t);
+		return;
+	}
+	int n = fs_readdir(dir, entries, count);
+	if(n > count) {
+		n = count;
+	}
+
+	char host[TRANSFER_PATH];
+	for(int i=0; i<n; i++) {
+		if(!join(host, hostdir, entries[i].name)) {
+			printf("skipping %s/%s: path too long\n",hostdir,entries[i].name);
+			count_error(t);
+			continue;
+		}
+		if(entries[i].type==1) {
+			if(mkdir(host, 0755)<0 && errno!=EEXIST) {
+				printf("couldn't create %s: %s\n",host,strerror(errno));
+				count_error(t);
+				continue;
+			}
+			t->dirs++;
+			export_dir(t, entries[i].inumber, host);
+		} else {
+			queue_job(t, host, entries[i].inumber);
+		}
+	}
+	free(entries);
+}
+
+//starts the copying threads, walks the tree and waits for the copies to
+//finish. returns 1 if there were no errors
+static int transfer_run( struct transfer *t, int import, void (*walk)( struct transfer *t, void *arg ), void *arg )
+{
+	pthread_t threads[TRANSFER_THREADS];
+	int nthreads = 0;
+
+	t->import = import;
+	pthread_mutex_init(&t->lock, 0);
+	pthread_cond_init(&t->work, 0);
+	pthread_cond_init(&t->space, 0);
+
+	double start = now();
+	for(int i=0; i<TRANSFER_THREADS; i++) {
+		if(pthread_create(&threads[nthreads], 0, copy_thread, t)==0) {
+			nthreads++;
+		}
+	}
+	if(nthreads==0) {
+		printf("couldn't start the copying threads\n");
+		return 0;
+	}
+
+	walk(t, arg);
+
+	pthread_mutex_lock(&t->lock);
+	t->done = 1;
+	pthread_cond_broadcast(&t->work);
+	pthread_mutex_unlock(&t->lock);
+	for(int i=0; i<nthreads; i++) {
+		pthread_join(threads[i], 0);
+	}
+	double seconds = now()-start;
+
+	printf("%d files in %d directories, %lld bytes copied in %.2f s (%.1f MB/s)\n",
+		t->files, t->dirs, (long long)t->bytes, seconds,
+		seconds>0 ? t->bytes/seconds/1e6 : 0.0);
+	if(t->errors) {
+		printf("%d errors\n",t->errors);
+	}
+
+	pthread_cond_destroy(&t->space);
+	pthread_cond_destroy(&t->work);
+	pthread_mutex_destroy(&t->lock);
+	return t->errors==0;
+}
+
+//the walks as transfer_run calls them
+struct walk_args {
+	const char *host;
+	const char *path;
+	int dir;
+};
+
+//helper fn
+static void import_walk( struct transfer *t, void *arg )
+{
+	struct walk_args *a = arg;
+	import_dir(t, a->host, a->path, a->dir);
+}
+
+//helper fn
+static void export_walk( struct transfer *t, void *arg )
+{
+	struct walk_args *a = arg;
+	export_dir(t, a->dir, a->host);
+}
+
+int transfer_import( const char *hostdir, const char *path )
+{
+	struct stat st;
+	if(stat(hostdir, &st)<0 || !S_ISDIR(st.st_mode)) {
+		printf("%s is not a directory\n",hostdir);
+		return 0;
+	}
+
+	//the target directory is created if it does not exist yet
+	char fspath[TRANSFER_PATH];
+	if(path[0]!='/' || strlen(path) >= sizeof(fspath)) {
+		printf("%s is not a valid path\n",path);
+		return 0;
+	}
+	strcpy(fspath, path);
+	int dir = fs_lookup(fspath);
+	if(dir==-1) {
+		dir = fs_create_dir(fspath);
+	}
+	if(dir==-1 || fs_readdir(dir, 0, 0)==-1) {
+		printf("%s is not a directory\n",path);
+		return 0;
+	}
+
+	struct transfer t;
+	memset(&t, 0, sizeof(t));
+	struct walk_args a = { hostdir, fspath, dir };
+	return transfer_run(&t, 1, import_walk, &a);
+}
+
+int transfer_export( const char *path, const char *hostdir )
+{
+	int dir = fs_lookup(path);
+	if(dir==-1 || fs_readdir(dir, 0, 0)==-1) {
+		printf("%s is not a directory\n",path);
+		return 0;
+	}
+	if(mkdir(hostdir, 0755)<0 && errno!=EEXIST) {
+		printf("couldn't create %s: %s\n",hostdir,strerror(errno));
+		return 0;
+	}
+
+	struct transfer t;
+	memset(&t, 0, sizeof(t));
+	struct walk_args a = { hostdir, path, dir };
+	return transfer_run(&t, 0, export_walk, &a);
+}
+
+int64_t transfer_copyin( const char *filename, int inumber )
+{
+	return copy_single(filename, inumber, 1);
+}
+
+int64_t transfer_copyout( int inumber, const char *filename )
+{
+	return copy_single(filename, inumber, 0);
+}
@@ -0,0 +1,25 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+
+#define TRANSFER_THREADS 4         //threads copying file data
+#define TRANSFER_CHUNK   (1<<20)   //bytes moved by one read or write
+#define TRANSFER_RING    4         //chunks in flight between the two sides of a copy
+#define TRANSFER_BATCH   128       //files created in a directory at a time
+#define TRANSFER_QUEUE   1024      //files waiting for a copying thread
+
+//copies whole trees between the host and the file system. the calling
+//thread walks the tree, creating the directories itself and the files of
+//each directory in batches, and queues the files for a pool of threads
+//that copy their data in large chunks. return 1 if everything was copied
+int transfer_import( const char *hostdir, const char *path );
+int transfer_export( const char *path, const char *hostdir );
+
+//copies a single file. a reader thread and the calling thread pass chunks
+//through a ring, and copyin reserves the blocks of the whole file before
+//writing. return the bytes copied or -1
+int64_t transfer_copyin( const char *filename, int inumber );
+int64_t transfer_copyout( int inumber, const char *filename );
+
+#endif